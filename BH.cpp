@@ -1,7 +1,4 @@
 #include "BH.h"
-#include <QMessageBox>
-#include <QStandardPaths>
-#include <QFileDialog>
 #include <chrono>
 #include <cassert>
 
@@ -16,7 +13,7 @@ void CHECK(int err)
    }
 }
 
-BH::BH(QObject* parent, short module_type) :
+BH::BH(QObject* parent, short module_type, std::function<bool(void)> confirm_force_connection) :
 FifoTcspc(parent),
 module_type(module_type),
 packet_buffer(PacketBuffer<Photon>(1000, 10000))
@@ -33,11 +30,7 @@ packet_buffer(PacketBuffer<Photon>(1000, 10000))
 
    if (no_of_active_spc == 0)
    {
-      QMessageBox msgbox(QMessageBox::Warning, "Force SPC card connection?", "Some SPC cards are in use, would you like to try and connect to them anyway?");
-      msgbox.addButton(QMessageBox::Yes);
-      msgbox.addButton(QMessageBox::No);
-
-      if (msgbox.exec() == QMessageBox::Yes)
+      if (confirm_force_connection && confirm_force_connection())
          activateSPCMCards(module_type, true);
 
       if (no_of_active_spc == 0)
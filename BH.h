@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <QTimer>
 #include <QFile>
+#include <functional>
 
 typedef qint32 Photon;
 
@@ -17,7 +18,9 @@ class BH : public FifoTcspc
 	Q_OBJECT
 
 public:
-	BH(QObject* parent, short module_type);
+	// If some cards are in use by another program, confirm_force_connection
+	// is asked whether to connect to them anyway; they are skipped if unset
+	BH(QObject* parent, short module_type, std::function<bool(void)> confirm_force_connection = nullptr);
 	~BH();
 
 	void init();
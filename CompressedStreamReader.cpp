@@ -0,0 +1,268 @@
+#include "CompressedStreamReader.h"
+#include "LZ4BlockStream.h"
+#include "lz4.h"
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+bool CompressedStreamReader::isSupported(const std::string& compression)
+{
+   if (compression == "lz4-stream" || compression == "lz4-block" || compression == "tcspc-block")
+      return true;
+   if (compression == "zstd-block")
+      return LZ4BlockStream::isCodecSupported(LZ4BlockStream::CodecZstd);
+   return false;
+}
+
+CompressedStreamReader::CompressedStreamReader(const char* data, size_t size, const std::string& compression, int n_threads) :
+   data(data),
+   size(size),
+   compression(compression),
+   n_threads(n_threads)
+{
+   if (!isSupported(compression))
+      throw std::runtime_error("Unsupported compression: " + compression);
+
+   decode_thread = std::thread(&CompressedStreamReader::decodeThread, this);
+}
+
+CompressedStreamReader::~CompressedStreamReader()
+{
+   {
+      std::lock_guard<std::mutex> lk(chunk_mutex);
+      stopping = true;
+   }
+   chunk_cv.notify_all();
+
+   decode_thread.join();
+}
+
+size_t CompressedStreamReader::read(char* dest, size_t max_bytes, size_t granularity)
+{
+   std::unique_lock<std::mutex> lk(chunk_mutex);
+   chunk_cv.wait(lk, [&] { return bytes_available >= granularity || finished; });
+
+   size_t n = std::min(max_bytes, bytes_available);
+   n -= n % granularity;
+
+   size_t copied = 0;
+   while (copied < n)
+   {
+      const std::vector<char>& chunk = chunks.front();
+      size_t n_copy = std::min(n - copied, chunk.size() - chunk_pos);
+      memcpy(dest + copied, chunk.data() + chunk_pos, n_copy);
+
+      copied += n_copy;
+      chunk_pos += n_copy;
+
+      if (chunk_pos == chunk.size())
+      {
+         chunks.pop_front();
+         chunk_pos = 0;
+      }
+   }
+   bytes_available -= n;
+
+   lk.unlock();
+   chunk_cv.notify_all();
+
+   return n;
+}
+
+uint64_t CompressedStreamReader::bytesDecompressed()
+{
+   std::lock_guard<std::mutex> lk(chunk_mutex);
+   return bytes_decompressed;
+}
+
+bool CompressedStreamReader::hasError()
+{
+   std::lock_guard<std::mutex> lk(chunk_mutex);
+   return !error_string.empty();
+}
+
+std::string CompressedStreamReader::errorString()
+{
+   std::lock_guard<std::mutex> lk(chunk_mutex);
+   return error_string;
+}
+
+void CompressedStreamReader::setError(const std::string& msg)
+{
+   std::lock_guard<std::mutex> lk(chunk_mutex);
+   if (error_string.empty())
+      error_string = msg;
+}
+
+bool CompressedStreamReader::pushChunk(std::vector<char>&& chunk)
+{
+   if (chunk.empty())
+      return true;
+
+   std::unique_lock<std::mutex> lk(chunk_mutex);
+   chunk_cv.wait(lk, [this] { return chunks.size() < max_chunks || stopping; });
+   if (stopping)
+      return false;
+
+   bytes_available += chunk.size();
+   bytes_decompressed += chunk.size();
+   chunks.push_back(std::move(chunk));
+
+   lk.unlock();
+   chunk_cv.notify_all();
+   return true;
+}
+
+void CompressedStreamReader::decodeThread()
+{
+   if (compression == "lz4-stream")
+      decodeChainedStream();
+   else
+      decodeBlockStream();
+
+   {
+      std::lock_guard<std::mutex> lk(chunk_mutex);
+      finished = true;
+   }
+   chunk_cv.notify_all();
+}
+
+void CompressedStreamReader::decodeChainedStream()
+{
+   // Each block may refer back up to 64 KB into previously decoded data,
+   // so decode into a window which keeps that much history in place.
+   // The writers use 16 KB messages, max_block_bytes leaves some headroom
+   const size_t history_bytes = 64 * 1024;
+   const size_t chunk_bytes = 1024 * 1024;
+   const size_t max_block_bytes = 64 * 1024;
+
+   std::vector<char> window(history_bytes + chunk_bytes + max_block_bytes);
+   size_t chunk_start = 0;
+   size_t pos = 0;
+
+   LZ4_streamDecode_t decode;
+   LZ4_setStreamDecode(&decode, nullptr, 0);
+
+   size_t in = 0;
+   while (in + sizeof(int32_t) <= size)
+   {
+      int32_t cmp_bytes;
+      memcpy(&cmp_bytes, data + in, sizeof(cmp_bytes));
+      in += sizeof(cmp_bytes);
+
+      if (cmp_bytes <= 0 || cmp_bytes > (int64_t) (size - in))
+      {
+         setError("Truncated or corrupt LZ4 stream");
+         break;
+      }
+
+      int n = LZ4_decompress_safe_continue(&decode, data + in, window.data() + pos, cmp_bytes, (int) (window.size() - pos));
+      if (n < 0)
+      {
+         setError("Corrupt block in LZ4 stream");
+         break;
+      }
+      in += cmp_bytes;
+      pos += n;
+
+      if (pos >= history_bytes + chunk_bytes)
+      {
+         if (!pushChunk(std::vector<char>(window.data() + chunk_start, window.data() + pos)))
+            return;
+
+         // Move the history to the front, the next block is decoded right after it
+         memmove(window.data(), window.data() + pos - history_bytes, history_bytes);
+         LZ4_setStreamDecode(&decode, window.data(), (int) history_bytes);
+         chunk_start = pos = history_bytes;
+      }
+   }
+
+   pushChunk(std::vector<char>(window.data() + chunk_start, window.data() + pos));
+}
+
+void CompressedStreamReader::decodeBlockStream()
+{
+   LZ4BlockStreamHeader header;
+   if (size < sizeof(header))
+   {
+      setError("Truncated block stream header");
+      return;
+   }
+   memcpy(&header, data, sizeof(header));
+
+   if (header.magic != LZ4BlockStream::header_magic)
+   {
+      setError("Not a compressed block stream");
+      return;
+   }
+   if (!LZ4BlockStream::isCodecSupported(header.codec))
+   {
+      setError("Block stream codec not supported in this build");
+      return;
+   }
+
+   // The footer marks the end of the blocks. A recording which was not
+   // closed cleanly has none, in which case read until the data runs out
+   size_t blocks_end = size;
+   LZ4BlockStreamFooter footer;
+   if (size >= sizeof(header) + sizeof(footer))
+   {
+      memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+      if (footer.magic == LZ4BlockStream::footer_magic && footer.table_offset >= sizeof(header) && footer.table_offset <= size - sizeof(footer))
+         blocks_end = footer.table_offset;
+   }
+
+   WorkerPool pool(n_threads);
+   size_t max_pending = 2 * pool.getNumThreads();
+   std::deque<std::future<std::vector<char>>> pending;
+
+   // Blocks are decompressed in parallel but queued in order;
+   // an empty result marks a corrupt block
+   auto writeNext = [&]()
+   {
+      std::vector<char> chunk = pending.front().get();
+      pending.pop_front();
+      if (chunk.empty())
+      {
+         setError("Corrupt block in block stream");
+         return false;
+      }
+      return pushChunk(std::move(chunk));
+   };
+
+   uint32_t codec = header.codec;
+   size_t in = sizeof(header);
+   bool ok = true;
+
+   while (ok && in + 2 * sizeof(uint32_t) <= blocks_end)
+   {
+      uint32_t stored_size, raw_size;
+      memcpy(&stored_size, data + in, sizeof(stored_size));
+      memcpy(&raw_size, data + in + sizeof(stored_size), sizeof(raw_size));
+      in += 2 * sizeof(uint32_t);
+
+      size_t n_stored = stored_size & ~LZ4BlockStream::stored_flag;
+      if (n_stored > blocks_end - in || raw_size == 0 || raw_size > header.block_bytes)
+      {
+         setError("Truncated or corrupt block stream");
+         break;
+      }
+
+      const char* src = data + in;
+      in += n_stored;
+
+      pending.push_back(pool.submit([=]()
+      {
+         std::vector<char> out(raw_size);
+         if (!LZ4BlockStream::decompressBlock(codec, src, stored_size, out.data(), raw_size))
+            out.clear();
+         return out;
+      }));
+
+      if (pending.size() >= max_pending)
+         ok = writeNext();
+   }
+
+   while (ok && !pending.empty())
+      ok = writeNext();
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "WorkerPool.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstdint>
+
+/*
+   Decompresses the event payload of a compressed FFD file.
+
+   The payload is decoded on a background thread into a bounded queue of
+   chunks which read() hands out, so the consumer runs at decompression
+   speed rather than waiting on each block. The format is given by the
+   "Compression" header tag written by FlimFileWriter:
+
+      lz4-stream   chained LZ4 blocks, as written by LZ4Stream and LZ4ThreadedStream
+      lz4-block    independent blocks, as written by LZ4BlockStream
+      zstd-block   as lz4-block; the codec is read from the block stream header
+      tcspc-block  as lz4-block, with blocks encoded by TcspcCodec
+
+   Independent blocks are decompressed in parallel on n_threads workers.
+   The payload must stay valid (e.g. mapped) for the lifetime of the reader.
+*/
+class CompressedStreamReader
+{
+public:
+
+   static bool isSupported(const std::string& compression);
+
+   CompressedStreamReader(const char* data, size_t size, const std::string& compression, int n_threads = 0);
+   ~CompressedStreamReader();
+
+   // Copies up to max_bytes of decompressed data, blocking until some is
+   // available. Returns a multiple of granularity bytes, and 0 at the end
+   // of the stream
+   size_t read(char* dest, size_t max_bytes, size_t granularity = 1);
+
+   uint64_t bytesDecompressed();
+
+   bool hasError();
+   std::string errorString();
+
+private:
+
+   void decodeThread();
+   void decodeChainedStream();
+   void decodeBlockStream();
+
+   // Queues a decompressed chunk, blocking while the queue is full.
+   // Returns false if the reader is being destroyed
+   bool pushChunk(std::vector<char>&& chunk);
+   void setError(const std::string& msg);
+
+   const char* data;
+   size_t size;
+   std::string compression;
+   int n_threads;
+
+   std::deque<std::vector<char>> chunks;
+   size_t chunk_pos = 0;
+   size_t bytes_available = 0;
+   uint64_t bytes_decompressed = 0;
+   bool finished = false;
+   bool stopping = false;
+   std::mutex chunk_mutex;
+   std::condition_variable chunk_cv;
+
+   std::thread decode_thread;
+
+   std::string error_string;
+
+   static const size_t max_chunks = 16;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+/*
+   Decay histograms for every pixel of an image, stored as
+   [y][x][channel][bin] so that the histograms of a line are contiguous.
+*/
+class DecayCube
+{
+public:
+
+   DecayCube(int n_x = 0, int n_y = 0, int n_chan = 0, int n_bins = 0) :
+      n_x(n_x), n_y(n_y), n_chan(n_chan), n_bins(n_bins),
+      counts((size_t) n_x * n_y * n_chan * n_bins, 0)
+   {}
+
+   void clear()
+   {
+      std::fill(counts.begin(), counts.end(), 0);
+      first_frame = 0;
+      n_frames = 0;
+   }
+
+   bool hasSameShape(const DecayCube& other) const
+   {
+      return n_x == other.n_x && n_y == other.n_y && n_chan == other.n_chan && n_bins == other.n_bins;
+   }
+
+   size_t lineStride() const { return (size_t) n_x * n_chan * n_bins; }
+   size_t pixelStride() const { return (size_t) n_chan * n_bins; }
+   size_t offset(int x, int y, int chan) const { return y * lineStride() + x * pixelStride() + chan * n_bins; }
+
+   // Histogram of one pixel and channel, n_bins long
+   const uint32_t* decay(int x, int y, int chan) const { return counts.data() + offset(x, y, chan); }
+   uint32_t* decay(int x, int y, int chan) { return counts.data() + offset(x, y, chan); }
+
+   uint64_t intensity(int x, int y, int chan) const
+   {
+      const uint32_t* d = decay(x, y, chan);
+      uint64_t sum = 0;
+      for (int i = 0; i < n_bins; i++)
+         sum += d[i];
+      return sum;
+   }
+
+   int n_x, n_y, n_chan, n_bins;
+   std::vector<uint32_t> counts;
+
+   // Frames accumulated into the cube, counting from the start of the stream
+   uint64_t first_frame = 0;
+   uint64_t n_frames = 0;
+};
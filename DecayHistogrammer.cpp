@@ -0,0 +1,323 @@
+#include "DecayHistogrammer.h"
+
+DecayHistogrammer::DecayHistogrammer(const TcspcAcquisitionParameters& params, int n_x, int n_y) :
+   n_x(n_x), n_y(n_y),
+   n_chan(std::min(params.n_channels, 15)), // channel 0xF is for markers
+   n_timebins(params.n_timebins)
+{
+}
+
+std::shared_ptr<const DecayCube> DecayHistogrammer::getLatestCube()
+{
+   std::lock_guard<std::mutex> lk(cube_mutex);
+   return ready;
+}
+
+void DecayHistogrammer::eventStreamAboutToStart()
+{
+   if (n_threads == 0)
+      pool.reset();
+   else if (!pool || pool->getNumThreads() != n_threads)
+      pool.reset(new WorkStealingPool(n_threads));
+
+   cube_bin_shift = bin_shift;
+   cube_pixel_markers = using_pixel_markers;
+   cube_accumulation_mode = accumulation_mode;
+   cube_frame_accumulation = frame_accumulation;
+   n_bins = std::max(1, n_timebins >> bin_shift);
+
+   filling = std::make_shared<DecayCube>(n_x, n_y, n_chan, n_bins);
+   lines_cleared = n_y;
+
+   size_t cube_size = filling->counts.size();
+   window.clear();
+   window_sum.assign(cube_accumulation_mode == SlidingAccumulation ? cube_size : 0, 0);
+   weighted_sum.assign(cube_accumulation_mode == ExponentialAccumulation ? cube_size : 0, 0.0f);
+   n_weighted_frames = 0;
+   spare.reset();
+
+   photon_weight = 1;
+   macro_time_offset = 0;
+   line_tracker.reset(n_x, n_y, bidirectional, using_pixel_markers);
+   cur_line = Line();
+}
+
+void DecayHistogrammer::eventStreamFinished()
+{
+   // The unfinished cube is never handed out, so drop the current line
+   line_tracker.abandonLine();
+   cur_line = Line();
+
+   if (pool)
+      pool->wait();
+}
+
+void DecayHistogrammer::imageSequenceFinished()
+{
+   // The frame marker ending the last image isn't passed on, so finish here
+   line_tracker.abandonLine();
+   endLine();
+   if (line_tracker.frameIndex() >= 0)
+      frameCompleted(true);
+}
+
+void DecayHistogrammer::processEvents(const TcspcEvent* evts, size_t n, const TcspcEventView* view)
+{
+   scanner.scan(evts, n, scan_result);
+
+   // Pixel markers are left in the line and followed as it is binned
+   const uint8_t line_marks = TcspcEvent::LineStartMarker | TcspcEvent::LineEndMarker | TcspcEvent::FrameMarker;
+
+   size_t begin = 0;
+   for (uint32_t i : scan_result.positions)
+   {
+      const TcspcEvent& evt = evts[i];
+      if (evt.isMacroTimeRollover())
+      {
+         macro_time_offset += ((uint64_t) evt.macro_time) << 16;
+         continue;
+      }
+
+      if (!(evt.mark() & line_marks))
+         continue;
+
+      addToLine(evts, begin, i, view);
+      begin = i + 1;
+
+      processMarker(evt, macro_time_offset + evt.macro_time);
+   }
+
+   addToLine(evts, begin, n, view);
+}
+
+void DecayHistogrammer::addToLine(const TcspcEvent* evts, size_t begin, size_t end, const TcspcEventView* view)
+{
+   if (cur_line.counts == nullptr || end <= begin)
+      return;
+
+   if (!pool)
+      binEvents(cur_line, evts + begin, end - begin, photon_weight);
+   else if (view)
+      cur_line.spans.push_back({ view->subView(begin, end - begin), photon_weight });
+   else
+      cur_line.spans.push_back({ TcspcEventView::copyOf(evts + begin, end - begin), photon_weight });
+}
+
+void DecayHistogrammer::processMarker(const TcspcEvent& evt, uint64_t macro_time)
+{
+   line_tracker.processMarker(evt.mark(), macro_time,
+      [this]() { endLine(); },
+      [this](bool image_completed) { frameCompleted(image_completed); },
+      [this](const ScanLine& scan) { startLine(scan); },
+      [this]() { cur_line.cur_x++; });
+}
+
+void DecayHistogrammer::startLine(const ScanLine& scan)
+{
+   if (!scan.counting)
+      return;
+
+   size_t stride = filling->lineStride();
+   cur_line.counts = filling->counts.data() + scan.y * stride;
+   cur_line.macro_time_offset = macro_time_offset;
+   cur_line.scan = scan;
+
+   // A reused cube is cleared a line at a time by whoever bins the line,
+   // while the line is in cache
+   if (scan.y >= lines_cleared)
+   {
+      cur_line.clear_begin = filling->counts.data() + lines_cleared * stride;
+      cur_line.clear_end = cur_line.counts + stride;
+      lines_cleared = scan.y + 1;
+   }
+
+   if (!pool)
+   {
+      std::fill(cur_line.clear_begin, cur_line.clear_end, 0);
+      cur_line.clear_begin = cur_line.clear_end = nullptr;
+   }
+}
+
+void DecayHistogrammer::endLine()
+{
+   if (cur_line.counts != nullptr && pool)
+   {
+      auto task = std::make_shared<Line>(std::move(cur_line));
+      pool->submit([this, task]() { binLine(*task); });
+   }
+
+   cur_line = Line();
+}
+
+void DecayHistogrammer::binLine(Line& line)
+{
+   std::fill(line.clear_begin, line.clear_end, 0);
+
+   for (auto& span : line.spans)
+      binEvents(line, span.events.data(), span.events.size(), span.photon_weight);
+
+   // Release the packet buffer slots
+   line.spans.clear();
+}
+
+void DecayHistogrammer::binEvents(Line& line, const TcspcEvent* evts, size_t n, uint32_t weight)
+{
+   for (size_t i = 0; i < n; i++)
+   {
+      const TcspcEvent& evt = evts[i];
+      uint8_t chan = evt.channel();
+
+      if (chan < n_chan)
+      {
+         int x = cube_pixel_markers ? line.cur_x : line.scan.timeToX(line.macro_time_offset + evt.macro_time);
+         x = line.scan.column(x);
+         if (x < 0)
+            continue;
+
+         uint32_t bin = evt.microTime() >> cube_bin_shift;
+         if (bin < (uint32_t) n_bins)
+            line.counts[(x * n_chan + chan) * n_bins + bin] += weight;
+      }
+      else if (evt.isMacroTimeRollover())
+      {
+         line.macro_time_offset += ((uint64_t) evt.macro_time) << 16;
+      }
+      else if (evt.isMark() && (evt.mark() & TcspcEvent::PixelMarker) && cube_pixel_markers)
+      {
+         line.cur_x++;
+      }
+   }
+}
+
+void DecayHistogrammer::clearLinesTo(int line)
+{
+   if (line <= lines_cleared)
+      return;
+
+   size_t stride = filling->lineStride();
+   std::fill(filling->counts.begin() + lines_cleared * stride, filling->counts.begin() + line * stride, 0);
+   lines_cleared = line;
+}
+
+void DecayHistogrammer::frameCompleted(bool image_completed)
+{
+   // The next frame writes to the same rows
+   if (pool)
+      pool->wait();
+
+   filling->n_frames++;
+
+   if (cube_accumulation_mode != BlockAccumulation)
+      finishRunningFrame();
+   else if (image_completed || filling->n_frames >= (uint64_t) cube_frame_accumulation)
+      finishCube();
+}
+
+void DecayHistogrammer::finishCube()
+{
+   clearLinesTo(filling->n_y);
+   startNextCube(publishCube(filling));
+}
+
+void DecayHistogrammer::finishRunningFrame()
+{
+   clearLinesTo(filling->n_y);
+
+   std::shared_ptr<DecayCube> out = std::move(spare);
+   if (!out || out.use_count() != 1 || !out->hasSameShape(*filling))
+      out = std::make_shared<DecayCube>(filling->n_x, filling->n_y, filling->n_chan, filling->n_bins);
+
+   size_t n = filling->counts.size();
+   const uint32_t* frame = filling->counts.data();
+   uint32_t* dst = out->counts.data();
+
+   if (cube_accumulation_mode == SlidingAccumulation)
+   {
+      window.push_back(filling);
+
+      // Add the new frame and subtract the one leaving the window, which
+      // is then filled with the next frame
+      std::shared_ptr<DecayCube> oldest;
+      if ((int) window.size() > cube_frame_accumulation)
+      {
+         oldest = std::move(window.front());
+         window.pop_front();
+      }
+
+      uint32_t* sum = window_sum.data();
+      if (oldest)
+      {
+         const uint32_t* old = oldest->counts.data();
+         for (size_t i = 0; i < n; i++)
+            dst[i] = (sum[i] += frame[i] - old[i]);
+      }
+      else
+      {
+         for (size_t i = 0; i < n; i++)
+            dst[i] = (sum[i] += frame[i]);
+      }
+
+      out->first_frame = window.front()->first_frame;
+      out->n_frames = window.size();
+
+      spare = publishCube(out);
+      startNextCube(std::move(oldest));
+   }
+   else
+   {
+      // Frames are weighted by (1 - 1/frame_accumulation) per frame of age,
+      // so the sum settles at frame_accumulation times the mean frame
+      float decay = 1.0f - 1.0f / cube_frame_accumulation;
+      float* sum = weighted_sum.data();
+      for (size_t i = 0; i < n; i++)
+      {
+         sum[i] = sum[i] * decay + frame[i];
+         dst[i] = (uint32_t) (sum[i] + 0.5f);
+      }
+
+      n_weighted_frames++;
+      out->first_frame = 0;
+      out->n_frames = n_weighted_frames;
+
+      spare = publishCube(out);
+
+      // The frame has been folded into the sum, so fill it again
+      lines_cleared = 0;
+      filling->first_frame = line_tracker.frameIndex() + 1;
+      filling->n_frames = 0;
+   }
+}
+
+std::shared_ptr<DecayCube> DecayHistogrammer::publishCube(std::shared_ptr<DecayCube> cube)
+{
+   std::shared_ptr<DecayCube> replaced;
+   {
+      std::lock_guard<std::mutex> lk(cube_mutex);
+      replaced = std::move(ready);
+      ready = cube;
+   }
+
+   if (cube_ready_callback)
+      cube_ready_callback(cube);
+
+   return replaced;
+}
+
+void DecayHistogrammer::startNextCube(std::shared_ptr<DecayCube> recycled)
+{
+   // Nobody can pick up a cube once it has been replaced, so it can be
+   // reused unless a reader is still holding it
+   if (recycled && recycled.use_count() == 1 && recycled->hasSameShape(*filling))
+   {
+      lines_cleared = 0;
+   }
+   else
+   {
+      recycled = std::make_shared<DecayCube>(filling->n_x, filling->n_y, filling->n_chan, filling->n_bins);
+      lines_cleared = filling->n_y;
+   }
+
+   recycled->first_frame = line_tracker.frameIndex() + 1;
+   recycled->n_frames = 0;
+   filling = recycled;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "TcspcEvent.h"
+#include "FifoTcspc.h"
+#include "DecayCube.h"
+#include "MarkerScanner.h"
+#include "ScanLineTracker.h"
+#include "WorkStealingPool.h"
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <deque>
+
+/*
+   Builds a per-pixel decay cube (see DecayCube) directly from the event
+   stream.
+
+   Lines and pixels are located with ScanLineTracker. Micro times are
+   binned as micro_time >> bin_shift.
+
+   A cube is finished after frame_accumulation frames, or at an image
+   marker, and swapped with the one being filled. The finished cube is
+   handed out as a shared pointer, so readers get it without a copy. It
+   is only reused for filling once no reader holds it any more.
+
+   For live focusing a cube can instead be published after every frame,
+   holding either the sum of the last frame_accumulation frames or an
+   exponentially weighted sum with a time constant of frame_accumulation
+   frames. Each frame is binned into its own cube and folded into a
+   running sum. For the sliding window the last frames are kept and the
+   oldest is subtracted as it drops out, so a frame costs the same
+   however long the window is.
+
+   Each span of events is cut at line and frame markers, found with the
+   MarkerScanner, and the events of a line are binned into that line's row
+   of the cube. With setNumThreads the lines are binned on a work stealing
+   pool instead of the consumer thread: each line holds views onto its
+   events until it is binned, and every line writes only its own rows so
+   no atomics are needed. Lines from one frame are all binned before the
+   next frame starts, so the result is the same as binning serially;
+   decay-histogrammer-check (bench/decay_histogrammer_check.cpp) checks
+   this.
+
+   While the processor is decimating photons each photon is counted
+   photon_weight times, so that intensities keep their scale.
+
+   Settings take effect when the event stream next starts.
+*/
+class DecayHistogrammer : public TcspcEventConsumer
+{
+public:
+
+   enum AccumulationMode { BlockAccumulation, SlidingAccumulation, ExponentialAccumulation };
+
+   DecayHistogrammer(const TcspcAcquisitionParameters& params, int n_x, int n_y);
+
+   void setImageSize(int n_x_, int n_y_) { n_x = n_x_; n_y = n_y_; }
+   void setBinShift(int bin_shift_) { bin_shift = bin_shift_; }
+   void setBidirectional(bool bidirectional_) { bidirectional = bidirectional_; }
+   void setUsingPixelMarkers(bool using_pixel_markers_) { using_pixel_markers = using_pixel_markers_; }
+   void setFrameAccumulation(int frame_accumulation_) { frame_accumulation = std::max(1, frame_accumulation_); }
+   void setAccumulationMode(AccumulationMode accumulation_mode_) { accumulation_mode = accumulation_mode_; }
+
+   // Number of threads binning lines in parallel; 0 to bin on the consumer thread
+   void setNumThreads(int n_threads_) { n_threads = std::max(0, n_threads_); }
+
+   int getNumBins() { return n_timebins >> bin_shift; }
+
+   // Latest finished cube, or null if none has been finished yet
+   std::shared_ptr<const DecayCube> getLatestCube();
+
+   // Called from the consumer thread each time a cube is finished
+   void setCubeReadyCallback(std::function<void(std::shared_ptr<const DecayCube>)> cube_ready_callback_) { cube_ready_callback = cube_ready_callback_; }
+
+   void eventStreamAboutToStart();
+   void eventStreamFinished();
+   void imageSequenceFinished();
+   void addEvent(const TcspcEvent& evt) { addEvents(&evt, 1); }
+   void addEvents(const TcspcEvent* evts, size_t n) { processEvents(evts, n, nullptr); }
+   void addEventView(const TcspcEventView& view) { processEvents(view.data(), view.size(), &view); }
+   void photonDecimationChanged(int factor) { photon_weight = factor; }
+   bool acceptsDecimation() { return true; }
+
+protected:
+
+   // Events held for a line, and the counts each photon among them adds
+   struct Span
+   {
+      TcspcEventView events;
+      uint32_t photon_weight;
+   };
+
+   /*
+      A line being counted into the filling cube. Binning starts from the
+      macro time offset and pixel count at the line start marker and
+      follows the rollovers and pixel markers within the line.
+   */
+   struct Line
+   {
+      uint32_t* counts = nullptr;
+      uint64_t macro_time_offset = 0;
+      ScanLine scan;
+      int cur_x = 0;
+
+      // Stale rows up to and including this line, zeroed before binning
+      uint32_t* clear_begin = nullptr;
+      uint32_t* clear_end = nullptr;
+
+      // Events of the line, held until it is binned when using threads
+      std::vector<Span> spans;
+   };
+
+   void processEvents(const TcspcEvent* evts, size_t n, const TcspcEventView* view);
+   void addToLine(const TcspcEvent* evts, size_t begin, size_t end, const TcspcEventView* view);
+   void processMarker(const TcspcEvent& evt, uint64_t macro_time);
+   void startLine(const ScanLine& scan);
+   void endLine();
+   void frameCompleted(bool image_completed);
+   void finishCube();
+   void finishRunningFrame();
+   std::shared_ptr<DecayCube> publishCube(std::shared_ptr<DecayCube> cube);
+   void startNextCube(std::shared_ptr<DecayCube> recycled);
+   void clearLinesTo(int line);
+
+   void binLine(Line& line);
+   void binEvents(Line& line, const TcspcEvent* evts, size_t n, uint32_t weight);
+
+   // Settings
+   int n_x, n_y;
+   int n_chan;
+   int n_timebins;
+   int bin_shift = 0;
+   bool bidirectional = false;
+   bool using_pixel_markers = false;
+   int frame_accumulation = 1;
+   AccumulationMode accumulation_mode = BlockAccumulation;
+   int n_threads = 0;
+
+   // Counts added per photon, the processor's current decimation factor
+   uint32_t photon_weight = 1;
+
+   // Scan state
+   uint64_t macro_time_offset = 0;
+   ScanLineTracker line_tracker;
+
+   // The line being counted; cur_line.counts is null if photons are not
+   // being counted
+   Line cur_line;
+   int cube_bin_shift = 0;
+   bool cube_pixel_markers = false;
+   int n_bins = 1;
+   int lines_cleared = 0; // lines of the filling cube which have been (or are being) zeroed
+   AccumulationMode cube_accumulation_mode = BlockAccumulation;
+   int cube_frame_accumulation = 1;
+
+   // Running sums when publishing every frame. window holds the frames of
+   // the sliding window, oldest first; spare is the cube published before
+   // last, reused once free
+   std::deque<std::shared_ptr<DecayCube>> window;
+   std::vector<uint32_t> window_sum;
+   std::vector<float> weighted_sum;
+   uint64_t n_weighted_frames = 0;
+   std::shared_ptr<DecayCube> spare;
+
+   MarkerScanner scanner;
+   MarkerScanResult scan_result;
+
+   std::shared_ptr<DecayCube> filling;
+   std::shared_ptr<DecayCube> ready;
+   std::mutex cube_mutex;
+
+   std::function<void(std::shared_ptr<const DecayCube>)> cube_ready_callback;
+
+   // Declared last so that no line is still being binned as the rest is destroyed
+   std::unique_ptr<WorkStealingPool> pool;
+};
@@ -1,105 +1,519 @@
 #include "EventProcessor.h"
 #include <iostream>
 
-void EventProcessor::start()
+template<class Event>
+void BasicEventProcessor<Event>::start()
 {
+   // Cursor 0 is always used by the processor thread, in broadcast
+   // mode each consumer additionally gets its own cursor
+   int n_cursors = broadcast_mode ? (int) consumers.size() + 1 : 1;
+   packet_buffer.setNumConsumers(n_cursors);
    packet_buffer.reset();
 
+   n_overflows = 0;
+   dropped_photons = 0;
+   decimated_photons = 0;
+   dropped_buffers = std::vector<std::atomic<uint64_t>>(n_cursors);
+   dropped_events = std::vector<std::atomic<uint64_t>>(n_cursors);
+   marker_backlog.clear();
+   marker_backlog_pos = 0;
+
+   sizing_window_start = std::chrono::steady_clock::now();
+   window_reads = window_full_reads = window_events = window_peak_in_use = 0;
+   window_over_latency = false;
+
+   decimation = 1;
+   decimation_phase = 0;
+   decimation_changed = sizing_window_start;
+
+   // Each stream starts afresh for every consumer, whether or not the
+   // last one ran to the end of an acquisition
+   consumer_state.assign(consumers.size(), ConsumerState());
+
    for (auto& consumer : consumers)
       consumer->eventStreamAboutToStart();
 
    running = true;
-   reader_thread = std::async(std::launch::async, &EventProcessor::readerThread, this);
-   processor_thread = std::async(std::launch::async, &EventProcessor::processorThread, this);
+   reader_thread = std::async(std::launch::async, &BasicEventProcessor::readerThread, this);
+   processor_thread = std::async(std::launch::async, &BasicEventProcessor::processorThread, this);
+
+   consumer_threads.clear();
+   if (broadcast_mode)
+      for (int c = 0; c < (int) consumers.size(); c++)
+         consumer_threads.push_back(std::async(std::launch::async, &BasicEventProcessor::consumerThread, this, c));
 }
 
 
-void EventProcessor::processorThread()
+template<class Event>
+void BasicEventProcessor<Event>::processorThread()
 {
-   int ridx = 0;
    size_t n_consumers = consumers.size();
-   while (running)
+   while (true)
    {
+      skipDroppedBuffers(0);
+
       packet_buffer.waitForNextBuffer();
-      size_t n = packet_buffer.getProcessingBufferSize();
-      auto& buffer = packet_buffer.getNextBufferToProcess();
-      int frame_increment = 0;
-      int image_increment = 0;
+      if (packet_buffer.streamFinished())
+         break;
+
+      size_t slot = packet_buffer.getProcessingSlot();
+      auto& markers = marker_scans[slot];
 
-      for (int c = 0; c < n_consumers; c++)
+      if (!broadcast_mode)
       {
-         frame_increment = 0;
-         image_increment = 0;
-         const auto& consumer = consumers[c];
-         if (consumer->isProcessingEvents())
+         auto dispatch_start = buffer_timing_callback ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+         auto buffer = packet_buffer.getProcessingBufferView();
+         for (int c = 0; c < n_consumers; c++)
+            dispatchBuffer(consumers[c].get(), consumer_state[c], buffer, markers, slot_decimation[slot]);
+
+         if (buffer_timing_callback)
+            reportTiming(slot, 0, dispatch_start);
+      }
+
+      countFrames((int) markers.n_frame);
+
+      packet_buffer.finishedProcessingBuffer();
+   }
+}
+
+template<class Event>
+void BasicEventProcessor<Event>::countFrames(int frame_increment)
+{
+   frame_idx += frame_increment;
+
+   if (frame_increment_callback != nullptr)
+      for (int i = 0; i < frame_increment; i++)
+         frame_increment_callback();
+}
+
+template<class Event>
+void BasicEventProcessor<Event>::skipDroppedBuffers(int cursor)
+{
+   uint64_t n_events = 0;
+   int n_frames = 0;
+   size_t n_skipped = packet_buffer.skipDropped(cursor, [&](size_t slot, const EventView& buffer)
+   {
+      n_events += buffer.size();
+      n_frames += (int) marker_scans[slot].n_frame;
+
+      // Consumers don't get the events, but still start and finish images
+      // at the frame markers, as if the buffer had been dispatched
+      if (cursor > 0)
+         dispatchBuffer(consumers[cursor - 1].get(), consumer_state[cursor - 1], buffer, marker_scans[slot], slot_decimation[slot], true);
+      else if (!broadcast_mode)
+         for (size_t c = 0; c < consumers.size(); c++)
+            dispatchBuffer(consumers[c].get(), consumer_state[c], buffer, marker_scans[slot], slot_decimation[slot], true);
+   });
+
+   if (n_skipped == 0)
+      return;
+
+   dropped_buffers[cursor] += n_skipped;
+   dropped_events[cursor] += n_events;
+
+   // Keep counting frames so that image boundaries still fall on frames
+   if (cursor == 0)
+      countFrames(n_frames);
+}
+
+template<class Event>
+void BasicEventProcessor<Event>::consumerThread(int consumer_idx)
+{
+   int cursor = consumer_idx + 1;
+   auto consumer = consumers[consumer_idx].get();
+   auto& state = consumer_state[consumer_idx];
+
+   while (true)
+   {
+      skipDroppedBuffers(cursor);
+
+      packet_buffer.waitForNextBuffer(cursor);
+      if (packet_buffer.streamFinished(cursor))
+         break;
+
+      size_t slot = packet_buffer.getProcessingSlot(cursor);
+      auto& markers = marker_scans[slot];
+
+      auto dispatch_start = buffer_timing_callback ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+      dispatchBuffer(consumer, state, packet_buffer.getProcessingBufferView(cursor), markers, slot_decimation[slot]);
+
+      if (buffer_timing_callback)
+         reportTiming(slot, cursor, dispatch_start);
+
+      packet_buffer.finishedProcessingBuffer(cursor);
+   }
+}
+
+template<class Event>
+void BasicEventProcessor<Event>::dispatchBuffer(Consumer* consumer, ConsumerState& state, const EventView& buffer, const MarkerScanResult& markers, int photon_decimation, bool dropped)
+{
+   if (!consumer->isProcessingEvents() || state.finished)
+      return;
+
+   if (photon_decimation != state.photon_decimation)
+   {
+      consumer->photonDecimationChanged(photon_decimation);
+      state.photon_decimation = photon_decimation;
+   }
+
+   const Event* evts = buffer.data();
+   size_t n = buffer.size();
+
+   int frame_increment = 0;
+   int image_increment = 0;
+   size_t span_start = 0;
+
+   auto flush = [&](size_t span_end)
+   {
+      if (span_end > span_start && !dropped)
+         consumer->addEventView(buffer.subView(span_start, span_end - span_start));
+      span_start = span_end;
+   };
+
+   // Events are passed to the consumer in spans, cut only at
+   // frame markers which start or finish an image. Of a dropped buffer
+   // only the markers starting images are passed on
+   for (uint32_t i : markers.positions)
+   {
+      if (!(evts[i].mark() & TcspcEvent::FrameMarker))
+         continue;
+
+      frame_increment++;
+
+      if (run_continuously)
+      {
+         if (state.frame_idx + frame_increment == 0)
          {
-            for (int i = 0; i < n; i++)
-            {
-               TcspcEvent evt = buffer[i];
-               if (evt.isMark() && (evt.mark() & TcspcEvent::FrameMarker))
-               {
-                  frame_increment++;
-
-                  if (run_continuously)
-                  {
-                     if (frame_idx == -1)
-                        consumer->nextImageStarted();
-                  }
-                  else
-                  {
-                     if ((frame_idx + frame_increment) % frames_per_image == 0)
-                     {
-                        evt.addMark(TcspcEvent::Mark::ImageMarker);
-                        image_increment++;
-                        if (image_idx + image_increment == n_images)
-                        {
-                           consumer->imageSequenceFinished();
-                           break; // don't send any more events
-                        }
-                        else
-                        {
-                           consumer->nextImageStarted();
-                        }
-                     }
-                  }
-
-               }
-               consumer->addEvent(evt);
-            }
+            flush(i);
+            consumer->nextImageStarted();
          }
       }
+      else if ((state.frame_idx + frame_increment) % frames_per_image == 0)
+      {
+         flush(i);
+         image_increment++;
+         if (state.image_idx + image_increment == n_images)
+         {
+            consumer->imageSequenceFinished();
+            state.finished = true;
+            span_start = n; // don't send any more events
+            break; 
+         }
 
-      frame_idx += frame_increment;
-      image_idx += image_increment;
+         consumer->nextImageStarted();
 
-      if (frame_increment_callback != nullptr)
-         for (int i = 0; i < frame_increment; i++)
-            frame_increment_callback();
+         Event evt = evts[i];
+         evt.addMark(TcspcEvent::Mark::ImageMarker);
+         consumer->addEvent(evt);
+         span_start = i + 1;
+      }
+   }
+   flush(n);
 
-      packet_buffer.finishedProcessingBuffer();
+   state.frame_idx += frame_increment;
+   state.image_idx += image_increment;
+}
 
-   }
+template<class Event>
+void BasicEventProcessor<Event>::reportTiming(size_t slot, int cursor, std::chrono::steady_clock::time_point dispatch_start)
+{
+   EventBufferTiming timing = slot_timing[slot];
+   timing.dispatch_start = dispatch_start;
+   timing.dispatch_end = std::chrono::steady_clock::now();
+   timing.cursor = cursor;
+   buffer_timing_callback(timing);
 }
 
-void EventProcessor::readerThread()
+template<class Event>
+void BasicEventProcessor<Event>::readerThread()
 {
+   bool overflowing = false;
+   int n_passed_pinned = 0;
+
    while (running)
    {
-      std::vector<TcspcEvent>* buffer = packet_buffer.getNextBufferToFill();
+      if (adaptive_sizing)
+         adaptBufferSize();
+
+      // A consumer holding onto a view, perhaps until more events arrive,
+      // must not stall the ring, so pass its slot over empty. Once every
+      // slot has been passed over the ring is as good as full
+      bool lapped = n_passed_pinned >= packet_buffer.getNumBuffers();
+      if (!lapped && packet_buffer.nextSlotPinned())
+      {
+         size_t slot = packet_buffer.getFillSlot();
+         marker_scans[slot].clear();
+         slot_decimation[slot] = decimation;
+         slot_timing[slot].read_time = std::chrono::steady_clock::now();
+         slot_timing[slot].n_events = 0;
+         packet_buffer.finishedFillingBuffer(0);
+         n_passed_pinned++;
+         continue;
+      }
+
+      std::vector<Event>* buffer = bufferQueuedTooLong() ? nullptr : packet_buffer.getNextBufferToFill();
+
+      if (buffer == nullptr) // failed to get buffer
+      {
+         if (!overflowing)
+         {
+            qWarning("Internal buffer overflowed");
+            n_overflows++;
+            overflowing = true;
+         }
+
+         handleOverflow();
+         continue;
+      }
+
+      overflowing = false;
+      n_passed_pinned = 0;
+
+      // Markers kept while the buffers were full go first
+      bool from_backlog = marker_backlog_pos < marker_backlog.size();
+
+      double fill_factor = packet_buffer.fillFactor();
+      if (load_shedding_enabled)
+         updateDecimation(fill_factor);
 
-      if (buffer != nullptr) // failed to get buffer
+      size_t n_read = from_backlog ? readMarkerBacklog(*buffer) : reader_fcn(*buffer, fill_factor);
+
+      if (n_read > 0)
       {
-         size_t n_read = reader_fcn(*buffer, packet_buffer.fillFactor());
+         size_t slot = packet_buffer.getFillSlot();
+
+         if (buffer_timing_callback || adaptive_sizing)
+         {
+            auto& timing = slot_timing[slot];
+            timing.read_time = std::chrono::steady_clock::now();
+            timing.n_events = n_read;
+            timing.fill_factor = fill_factor;
+         }
+
+         if (adaptive_sizing && !from_backlog)
+         {
+            window_reads++;
+            window_events += n_read;
+            if (n_read == buffer->size())
+               window_full_reads++;
+         }
+
+         // Find markers once here rather than once per consumer
+         marker_scanner.scan(buffer->data(), n_read, marker_scans[slot]);
+
+         slot_decimation[slot] = decimation;
+         if (decimation > 1 && !from_backlog)
+            n_read = decimatePhotons(buffer->data(), n_read, marker_scans[slot]);
+
+         packet_buffer.finishedFillingBuffer(n_read);
 
-         if (n_read > 0)
-            packet_buffer.finishedFillingBuffer(n_read);
-         else
-            packet_buffer.failedToFillBuffer();
+         if (adaptive_sizing)
+            window_peak_in_use = std::max(window_peak_in_use, packet_buffer.buffersInUse());
       }
+      else
+         packet_buffer.failedToFillBuffer();
    }
 }
 
-void EventProcessor::stop()
+template<class Event>
+void BasicEventProcessor<Event>::handleOverflow()
+{
+   if (backpressure_policy == DropOldestWhenFull)
+   {
+      packet_buffer.dropOldest();
+   }
+   else if (backpressure_policy == DropPhotonsWhenFull)
+   {
+      // Markers can't be dropped without losing the image geometry, so
+      // block once too many have built up
+      size_t buffer_length = packet_buffer.getBufferLength();
+      if (marker_backlog.size() - marker_backlog_pos < 4 * buffer_length)
+      {
+         overflow_buffer.resize(buffer_length);
+         size_t n_read = reader_fcn(overflow_buffer, 1.0);
+
+         marker_scanner.scan(overflow_buffer.data(), n_read, overflow_scan);
+         for (uint32_t i : overflow_scan.positions)
+            marker_backlog.push_back(overflow_buffer[i]);
+
+         dropped_photons += n_read - overflow_scan.positions.size();
+         return;
+      }
+   }
+
+   packet_buffer.waitForFreeBuffer(std::chrono::milliseconds(1));
+}
+
+template<class Event>
+size_t BasicEventProcessor<Event>::readMarkerBacklog(std::vector<Event>& buffer)
+{
+   size_t n = std::min(buffer.size(), marker_backlog.size() - marker_backlog_pos);
+   std::copy_n(marker_backlog.begin() + marker_backlog_pos, n, buffer.begin());
+   marker_backlog_pos += n;
+
+   if (marker_backlog_pos == marker_backlog.size())
+   {
+      marker_backlog.clear();
+      marker_backlog_pos = 0;
+   }
+
+   return n;
+}
+
+template<class Event>
+bool BasicEventProcessor<Event>::bufferQueuedTooLong()
+{
+   size_t slot;
+   if (!adaptive_sizing || !packet_buffer.getOldestSlot(slot))
+      return false;
+
+   if (std::chrono::steady_clock::now() - slot_timing[slot].read_time < sizing.max_latency)
+      return false;
+
+   window_over_latency = true;
+   return true;
+}
+
+template<class Event>
+void BasicEventProcessor<Event>::adaptBufferSize()
+{
+   auto now = std::chrono::steady_clock::now();
+   if (now - sizing_window_start < std::chrono::milliseconds(100))
+      return;
+
+   if (window_reads > 0)
+   {
+      // Full buffers mean the provider has more waiting, so take more at a
+      // time unless buffers are already queueing for too long. Shrink if
+      // buffers are mostly empty
+      size_t length = packet_buffer.getBufferLength();
+      if (window_full_reads * 10 >= window_reads * 9 && !window_over_latency)
+         length = std::min(2 * length, sizing.max_length);
+      else if (window_events < window_reads * length / 4)
+         length = std::max(length / 2, sizing.min_length);
+      packet_buffer.setBufferLength(length);
+   }
+
+   // Keep as much spare memory as was in use at the busiest point
+   packet_buffer.trimFreeBuffers(window_peak_in_use);
+
+   sizing_window_start = now;
+   window_reads = window_full_reads = window_events = 0;
+   window_peak_in_use = packet_buffer.buffersInUse();
+   window_over_latency = false;
+}
+
+template<class Event>
+void BasicEventProcessor<Event>::updateDecimation(double fill_factor)
+{
+   if (!consumersAcceptDecimation())
+   {
+      if (decimation > 1)
+         qWarning("Consumer needs every photon, keeping every photon");
+      decimation = 1;
+      return;
+   }
+
+   auto now = std::chrono::steady_clock::now();
+   if (now - decimation_changed < load_shedding.interval)
+      return;
+
+   int factor = decimation;
+   if (fill_factor > load_shedding.high_fill_factor && 2 * factor <= load_shedding.max_decimation)
+      factor *= 2;
+   else if (fill_factor < load_shedding.low_fill_factor && factor > 1)
+      factor /= 2;
+   else
+      return;
+
+   if (factor == 2 && decimation == 1)
+      qWarning("Consumers falling behind, decimating photons");
+   else if (factor == 1)
+      qWarning("Consumers caught up, keeping every photon");
+
+   decimation = factor;
+   decimation_changed = now;
+}
+
+template<class Event>
+bool BasicEventProcessor<Event>::consumersAcceptDecimation()
+{
+   for (auto& consumer : consumers)
+      if (!consumer->acceptsDecimation())
+         return false;
+   return true;
+}
+
+template<class Event>
+size_t BasicEventProcessor<Event>::decimatePhotons(Event* evts, size_t n, MarkerScanResult& markers)
+{
+   // Keep every marker and rollover, and every decimation'th photon counting
+   // on from the last buffer, moving them down in place
+   size_t factor = decimation;
+   size_t mask = factor - 1;
+   size_t n_kept = 0;
+   size_t begin = 0;
+
+   auto keepPhotons = [&](size_t end)
+   {
+      for (size_t i = begin + ((factor - decimation_phase) & mask); i < end; i += factor)
+         evts[n_kept++] = evts[i];
+      decimation_phase = (decimation_phase + end - begin) & mask;
+   };
+
+   for (uint32_t& pos : markers.positions)
+   {
+      keepPhotons(pos);
+      begin = pos + 1;
+      evts[n_kept] = evts[pos];
+      pos = (uint32_t) n_kept++;
+   }
+   keepPhotons(n);
+
+   decimated_photons += n - n_kept;
+   return n_kept;
+}
+
+template<class Event>
+void BasicEventProcessor<Event>::setAdaptiveBufferSizing(const AdaptiveBufferSizing& sizing_)
+{
+   sizing = sizing_;
+   adaptive_sizing = true;
+
+   size_t length = std::min(std::max(packet_buffer.getBufferLength(), sizing.min_length), sizing.max_length);
+   packet_buffer.setAdaptive(sizing.max_buffers, sizing.max_bytes);
+   packet_buffer.setBufferLength(length);
+
+   marker_scans.resize(sizing.max_buffers);
+   slot_timing.resize(sizing.max_buffers);
+   slot_decimation.resize(sizing.max_buffers, 1);
+}
+
+template<class Event>
+EventBufferStats BasicEventProcessor<Event>::getBufferStats()
+{
+   EventBufferStats stats;
+   stats.n_overflows = n_overflows;
+   stats.dropped_photons = dropped_photons;
+   stats.decimated_photons = decimated_photons;
+   stats.photon_decimation = decimation;
+
+   for (size_t c = 0; c < dropped_buffers.size(); c++)
+   {
+      stats.dropped_buffers = std::max(stats.dropped_buffers, dropped_buffers[c].load());
+      stats.dropped_events = std::max(stats.dropped_events, dropped_events[c].load());
+   }
+
+   stats.buffers_in_use = packet_buffer.buffersInUse();
+   stats.buffer_length = packet_buffer.getBufferLength();
+   stats.allocated_bytes = packet_buffer.getAllocatedBytes();
+   return stats;
+}
+
+template<class Event>
+void BasicEventProcessor<Event>::stop()
 {
    running = false;
 
@@ -109,9 +523,15 @@ void EventProcessor::stop()
    packet_buffer.setStreamFinished();
 
    processor_thread.get();
+   for (auto& t : consumer_threads)
+      t.get();
+   consumer_threads.clear();
 
    for (auto& consumer : consumers)
       consumer->eventStreamFinished();
 
    packet_buffer.reset();
 }
+
+template class BasicEventProcessor<TcspcEvent>;
+template class BasicEventProcessor<WideTcspcEvent>;
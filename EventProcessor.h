@@ -5,19 +5,109 @@
 #include <functional>
 #include <memory>
 #include <vector>
+#include <atomic>
+#include <chrono>
 #include "PacketBuffer.h"
 #include "TcspcEvent.h"
+#include "MarkerScanner.h"
 
-class EventProcessor
+// Passage of one packet buffer through the processor, see setBufferTimingCallback
+struct EventBufferTiming
 {
-   typedef std::function<size_t(std::vector<TcspcEvent>& buffer, double buffer_fill_factor)> ReaderFcn;
+   std::chrono::steady_clock::time_point read_time;      // reader function returned
+   std::chrono::steady_clock::time_point dispatch_start;
+   std::chrono::steady_clock::time_point dispatch_end;   // consumers returned
+   size_t n_events;
+   double fill_factor; // packet buffer fill factor passed to the reader function
+   int cursor;         // 0 for the processor thread, consumer index + 1 in broadcast mode
+};
+
+// What the reader thread does when every packet buffer is in use
+enum BackpressurePolicy
+{
+   BlockWhenFull       = 0, // wait for a free buffer, leaving events in the hardware FIFO
+   DropOldestWhenFull  = 1, // have the slowest consumers skip the oldest buffer queued for them
+   DropPhotonsWhenFull = 2  // keep reading, but keep only marker and rollover words
+};
+
+// Limits for adaptive packet buffer sizing, see setAdaptiveBufferSizing
+struct AdaptiveBufferSizing
+{
+   size_t max_bytes = 512 << 20;
+   int max_buffers = 1024;
+   size_t min_length = 1000;
+   size_t max_length = 1 << 20;
+
+   // Buffers are not allowed to queue for longer than this
+   std::chrono::milliseconds max_latency = std::chrono::milliseconds(500);
+};
+
+// When to thin out photons as consumers fall behind, see setLoadShedding
+struct LoadShedding
+{
+   double high_fill_factor = 0.5; // decimate harder while the packet buffer is fuller than this
+   double low_fill_factor = 0.1;  // and ease off while it is emptier than this
+   int max_decimation = 64;
+
+   // Minimum time between changes of the decimation factor
+   std::chrono::milliseconds interval = std::chrono::milliseconds(100);
+};
+
+// Packet buffer counters since the processor was last started
+struct EventBufferStats
+{
+   uint64_t n_overflows = 0;     // times the reader found every buffer in use
+   uint64_t dropped_buffers = 0; // buffers skipped by the consumer which skipped most
+   uint64_t dropped_events = 0;
+   uint64_t dropped_photons = 0; // photons discarded while keeping markers
+   uint64_t decimated_photons = 0;
+   int photon_decimation = 1;    // one photon in this many is being kept
+   size_t buffers_in_use = 0;
+   size_t buffer_length = 0;
+   size_t allocated_bytes = 0;
+};
+
+/*
+   Reads events from a provider into a packet buffer on a reader thread and
+   dispatches them, cut at image boundaries, to the registered consumers.
+   Templated on the event type; EventProcessor handles the hardware
+   TcspcEvent format and WideEventProcessor absolute time WideTcspcEvents.
+
+   When every buffer is in use the reader follows the BackpressurePolicy,
+   counting what is lost in the EventBufferStats. With adaptive sizing,
+   buffer memory is taken as buffers are filled, up to a cap. Buffers are
+   lengthened while the provider keeps filling them and shortened while
+   it doesn't. Spare memory beyond the recent peak use is freed, and a
+   buffer which has queued for longer than max_latency counts as the ring
+   being full.
+
+   With load shedding the reader thins photons out before the buffers
+   fill up. While the packet buffer is fuller than high_fill_factor it
+   keeps one photon in 2, 4, 8... and relaxes again once it has drained.
+   Photons are only thinned while every consumer accepts it, so a consumer
+   recording the stream keeps every photon.
+   Marker and rollover words are always kept, so the image geometry and
+   macro time survive. The factor is recorded for every buffer, and
+   consumers are told of each change before the first event it applies
+   to, so that they can weight photons to keep intensities to scale.
+*/
+template<class Event>
+class BasicEventProcessor
+{
+   typedef std::function<size_t(std::vector<Event>& buffer, double buffer_fill_factor)> ReaderFcn;
 
 
 public:
 
-   EventProcessor(ReaderFcn reader_fcn, int n_buffers, int buffer_length) :
+   typedef EventConsumer<Event> Consumer;
+   typedef PacketBufferView<Event> EventView;
+
+   BasicEventProcessor(ReaderFcn reader_fcn, int n_buffers, int buffer_length) :
       packet_buffer(n_buffers, buffer_length),
-      reader_fcn(reader_fcn)
+      marker_scans(n_buffers),
+      slot_timing(n_buffers),
+      reader_fcn(reader_fcn),
+      slot_decimation(n_buffers, 1)
    {
 
    }
@@ -28,13 +118,34 @@ public:
    template<typename evt>
    std::vector<evt> getNextBufferToFill();
 
-   void addTcspcEventConsumer(std::shared_ptr<TcspcEventConsumer> consumer)
+   void addTcspcEventConsumer(std::shared_ptr<Consumer> consumer)
    {
       consumers.push_back(consumer);
    };
 
    void setFrameIncrementCallback(std::function<void(void)> frame_increment_callback_) { frame_increment_callback = frame_increment_callback_; };
 
+   // Called from the dispatching thread after each buffer has been passed to
+   // the consumers, for benchmarking. No timing is taken if unset. Must be
+   // set before start()
+   void setBufferTimingCallback(std::function<void(const EventBufferTiming&)> buffer_timing_callback_) { buffer_timing_callback = buffer_timing_callback_; }
+
+   // Must be set before start()
+   void setBackpressurePolicy(BackpressurePolicy backpressure_policy_) { backpressure_policy = backpressure_policy_; }
+   BackpressurePolicy getBackpressurePolicy() { return backpressure_policy; }
+
+   // Switches to adaptive buffer sizing, starting from the buffer length
+   // given at construction. Must be set before the first start(), while no
+   // views onto the packet buffer are held
+   void setAdaptiveBufferSizing(const AdaptiveBufferSizing& sizing);
+
+   // Must be set before start()
+   void setLoadShedding(bool enabled, const LoadShedding& settings = LoadShedding()) { load_shedding_enabled = enabled; load_shedding = settings; }
+   bool isLoadShedding() { return load_shedding_enabled; }
+
+   // May be called from any thread
+   EventBufferStats getBufferStats();
+
    void setNumImages(int n_images_) { n_images = n_images_; run_continuously = false; }
    void setFramesPerImage(int frames_per_image_) { frames_per_image = frames_per_image_; }
   
@@ -42,41 +153,116 @@ public:
 
    bool isRunningContinuously() { return run_continuously; }
 
+   // In broadcast mode each consumer is fed from its own cursor on the packet
+   // buffer by its own thread, so a slow consumer cannot stall the others.
+   // Must be set before start()
+   void setBroadcastMode(bool broadcast_mode_) { broadcast_mode = broadcast_mode_; }
+   bool isBroadcastMode() { return broadcast_mode; }
+
    void reset()
    { 
       frame_idx = -1;
-      image_idx = -1; // goes to zero on first frame marker
+      consumer_state.assign(consumers.size(), ConsumerState());
    }
 
 protected:
 
+   struct ConsumerState
+   {
+      int frame_idx = -1;
+      int image_idx = -1; // goes to zero on first frame marker
+      int photon_decimation = 1;
+      bool finished = false;
+   };
+
    void processorThread();
+   void consumerThread(int consumer_idx);
    void readerThread();
 
-   PacketBuffer<TcspcEvent> packet_buffer;
+   void dispatchBuffer(Consumer* consumer, ConsumerState& state, const EventView& buffer, const MarkerScanResult& markers, int photon_decimation, bool dropped = false);
+   void skipDroppedBuffers(int cursor);
+   void countFrames(int frame_increment);
+
+   void handleOverflow();
+   size_t readMarkerBacklog(std::vector<Event>& buffer);
+   bool bufferQueuedTooLong();
+   void adaptBufferSize();
+   void updateDecimation(double fill_factor);
+   bool consumersAcceptDecimation();
+   size_t decimatePhotons(Event* evts, size_t n, MarkerScanResult& markers);
+   void reportTiming(size_t slot, int cursor, std::chrono::steady_clock::time_point dispatch_start);
+
+   PacketBuffer<Event> packet_buffer;
+
+   // Marker positions for each packet buffer slot, filled by the reader thread
+   MarkerScanner marker_scanner;
+   std::vector<MarkerScanResult> marker_scans;
+
+   // Read time and fill factor for each slot, filled by the reader thread
+   std::vector<EventBufferTiming> slot_timing;
+   std::function<void(const EventBufferTiming&)> buffer_timing_callback;
+
    ReaderFcn reader_fcn;
 
+   BackpressurePolicy backpressure_policy = BlockWhenFull;
+
+   // Marker and rollover words kept while dropping photons, reader thread only
+   std::vector<Event> overflow_buffer;
+   std::vector<Event> marker_backlog;
+   size_t marker_backlog_pos = 0;
+   MarkerScanResult overflow_scan;
+
+   // Adaptive sizing, reader thread only apart from the settings
+   bool adaptive_sizing = false;
+   AdaptiveBufferSizing sizing;
+   std::chrono::steady_clock::time_point sizing_window_start;
+   size_t window_reads = 0;
+   size_t window_full_reads = 0;
+   size_t window_events = 0;
+   size_t window_peak_in_use = 0;
+   bool window_over_latency = false;
+
+   // Load shedding, reader thread only apart from the settings and the
+   // current factor
+   bool load_shedding_enabled = false;
+   LoadShedding load_shedding;
+   std::atomic<int> decimation = { 1 };
+   size_t decimation_phase = 0; // photons since the last one kept, modulo decimation
+   std::chrono::steady_clock::time_point decimation_changed;
+
+   // Decimation applied to each slot, filled by the reader thread
+   std::vector<int> slot_decimation;
+
+   // Counters, see getBufferStats
+   std::atomic<uint64_t> n_overflows = { 0 };
+   std::atomic<uint64_t> dropped_photons = { 0 };
+   std::atomic<uint64_t> decimated_photons = { 0 };
+   std::vector<std::atomic<uint64_t>> dropped_buffers; // per cursor
+   std::vector<std::atomic<uint64_t>> dropped_events;
+
    std::future<void> processor_thread;
    std::future<void> reader_thread;
+   std::vector<std::future<void>> consumer_threads;
 
-   std::vector<std::shared_ptr<TcspcEventConsumer>> consumers;
+   std::vector<std::shared_ptr<Consumer>> consumers;
+   std::vector<ConsumerState> consumer_state;
    std::function<void(void)> frame_increment_callback;
 
-   bool running;
+   std::atomic<bool> running = { false };
    int frames_per_image = 1;
    int frame_idx = -1;
-   int image_idx = -1;
    int n_images = 1;
    bool run_continuously = true;
-
-   template<class Provider>
-   friend std::shared_ptr<EventProcessor> createEventProcessor(Provider* obj, int n_buffers, int buffer_length);
+   bool broadcast_mode = false;
 };
 
+typedef BasicEventProcessor<TcspcEvent> EventProcessor;
+typedef BasicEventProcessor<WideTcspcEvent> WideEventProcessor;
 
-template<class Provider>
-std::shared_ptr<EventProcessor> createEventProcessor(Provider* obj, int n_buffers, int buffer_length)
+// Provider::readPackets must fill a std::vector<Event>
+template<class Provider, class Event = TcspcEvent>
+std::shared_ptr<BasicEventProcessor<Event>> createEventProcessor(Provider* obj, int n_buffers, int buffer_length)
 {
    auto read_fcn = std::bind(&Provider::readPackets, obj, std::placeholders::_1, std::placeholders::_2);
-   return std::make_shared<EventProcessor>(read_fcn, n_buffers, buffer_length);
+   return std::make_shared<BasicEventProcessor<Event>>(read_fcn, n_buffers, buffer_length);
 }
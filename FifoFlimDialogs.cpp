@@ -0,0 +1,41 @@
+#include "FifoFlimDialogs.h"
+
+#include <QStandardPaths>
+#include <QFileDialog>
+#include <QInputDialog>
+#include <QMessageBox>
+
+QString FifoFlimDialogs::getRecordingFileName(QWidget* parent)
+{
+   QString folder = QStandardPaths::writableLocation(QStandardPaths::DocumentsLocation);
+   folder.append("/FLIM data.ffd");
+   return QFileDialog::getSaveFileName(parent, "Choose a file name", folder, "FFD file (*.ffd)");
+}
+
+QString FifoFlimDialogs::getReplayFileName(QWidget* parent)
+{
+   QString folder = QStandardPaths::writableLocation(QStandardPaths::DocumentsLocation);
+   return QFileDialog::getOpenFileName(parent, "Choose a file to replay", folder, "FFD file (*.ffd)");
+}
+
+QString FifoFlimDialogs::getImagingMode(QWidget* parent)
+{
+   return QInputDialog::getItem(parent, "Choose Imaging Mode", "Imaging Mode", { "FLIM", "PLIM" }, 0, false);
+}
+
+QString FifoFlimDialogs::getSpcModuleType(QWidget* parent)
+{
+   QStringList types = { "SPC-130", "SPC-140", "SPC-150", "SPC-160", "SPC-600", "SPC-630", "SPC-830" };
+   bool ok = false;
+   QString type = QInputDialog::getItem(parent, "Choose SPC Module", "SPC Module", types, types.indexOf("SPC-830"), false, &ok);
+   return ok ? type : QString();
+}
+
+bool FifoFlimDialogs::confirmForceSpcConnection(QWidget* parent)
+{
+   QMessageBox msgbox(QMessageBox::Warning, "Force SPC card connection?", "Some SPC cards are in use, would you like to try and connect to them anyway?", QMessageBox::NoButton, parent);
+   msgbox.addButton(QMessageBox::Yes);
+   msgbox.addButton(QMessageBox::No);
+
+   return msgbox.exec() == QMessageBox::Yes;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <QString>
+
+class QWidget;
+
+/*
+   Dialogs used by the Qt front-end to fill in choices which the headless
+   core takes as arguments
+*/
+class FifoFlimDialogs
+{
+public:
+
+   // Returns an empty string if cancelled
+   static QString getRecordingFileName(QWidget* parent = nullptr);
+   static QString getReplayFileName(QWidget* parent = nullptr);
+
+   // "FLIM" or "PLIM"
+   static QString getImagingMode(QWidget* parent = nullptr);
+
+   // For BH, e.g. "SPC-830"; returns an empty string if cancelled
+   static QString getSpcModuleType(QWidget* parent = nullptr);
+
+   // For BH, when some SPC cards are in use by another program
+   static bool confirmForceSpcConnection(QWidget* parent = nullptr);
+};
@@ -1,6 +1,3 @@
-#include <QMessageBox>
-#include <QStandardPaths>
-#include <QFileDialog>
 #include <chrono>
 #include <cassert>
 #include "FifoTcspc.h"
@@ -21,13 +18,39 @@ void FifoTcspc::setLive(bool live_)
    processor->runContinuously();
 
    if (live_ && !live)
+   {
+      processor->setLoadShedding(live_load_shedding_enabled, live_load_shedding);
       startScanning();
+   }
    else if (!live_ && live)
       stopScanning();
 
    live = live_;
 }
 
+FlimStatus FifoTcspc::getStatus()
+{
+   EventBufferStats stats = processor->getBufferStats();
+
+   FlimStatus status = flim_status;
+   status.counters["Host Buffer Overflows"] = stats.n_overflows;
+   status.counters["Dropped Events"] = stats.dropped_events;
+   status.counters["Dropped Photons"] = stats.dropped_photons;
+   status.counters["Host Buffer Bytes"] = stats.allocated_bytes;
+   status.counters["Decimated Photons"] = stats.decimated_photons;
+   status.counters["Photon Decimation"] = stats.photon_decimation;
+
+   // Decimating keeps the buffer from filling, so warn on it directly
+   if (stats.photon_decimation > 1)
+   {
+      FlimWarningStatus buffer_status = (2 * stats.photon_decimation > live_load_shedding.max_decimation) ? Critical : Warning;
+      if (status.warnings["Host Buffer"].getStatus() < buffer_status)
+         status.warnings["Host Buffer"] = FlimWarning(buffer_status);
+   }
+
+   return status;
+}
+
 void FifoTcspc::setFrameAccumulation(int frame_accumulation_)
 {
    if (frame_accumulation_ != frame_accumulation)
@@ -54,6 +77,7 @@ void FifoTcspc::startAcquisition(bool indeterminate)
    }
 
    processor->reset();
+   processor->setLoadShedding(false);
 
    acq_in_progress = true;
    acq_idx = 0;
@@ -76,6 +76,9 @@ public:
 
    QMap<QString, float> rates;
    QMap<QString, FlimWarning> warnings;
+
+   // Totals since the FIFO was last started, e.g. of events lost to host buffer overflows
+   QMap<QString, quint64> counters;
 };
 
 
@@ -95,6 +98,15 @@ public:
    Q_INVOKABLE void cancelAcquisition();
 
    void addTcspcEventConsumer(std::shared_ptr<TcspcEventConsumer> consumer) { processor->addTcspcEventConsumer(consumer); }
+   void setConsumerBroadcastMode(bool broadcast_mode) { processor->setBroadcastMode(broadcast_mode); }
+   void setBufferTimingCallback(std::function<void(const EventBufferTiming&)> callback) { processor->setBufferTimingCallback(callback); }
+   void setBackpressurePolicy(BackpressurePolicy policy) { processor->setBackpressurePolicy(policy); }
+   void setAdaptiveBufferSizing(const AdaptiveBufferSizing& sizing) { processor->setAdaptiveBufferSizing(sizing); }
+
+   // Off by default. Photons are only ever decimated in live mode, never
+   // while acquiring, and only while every consumer accepts it (see
+   // EventConsumer::acceptsDecimation), so never while recording
+   void setLiveLoadShedding(bool enabled, const LoadShedding& settings = LoadShedding()) { live_load_shedding_enabled = enabled; live_load_shedding = settings; }
 
    void setFrameAccumulation(int frame_accumulation_);
    int getFrameAccumulation() { return frame_accumulation; }
@@ -106,7 +118,7 @@ public:
    bool isLive() { return live; };
    bool acquisitionInProgress() { return acq_in_progress; }
 
-   FlimStatus getStatus() { return flim_status; };
+   FlimStatus getStatus();
 
    virtual TcspcAcquisitionParameters getAcquisitionParameters() = 0;
 
@@ -161,6 +173,9 @@ protected:
    bool acq_in_progress = false;
    int acq_idx = 0;
 
+   bool live_load_shedding_enabled = false;
+   LoadShedding live_load_shedding;
+
    uint64_t packets_read = 0;
    uint64_t packets_processed = 0;
 
@@ -2,13 +2,16 @@
 
 #include "FifoTcspc.h"
 #include "SimTcspc.h"
+#include "ReplayTcspc.h"
+#include "FifoFlimDialogs.h"
 #include <QString>
+#include <map>
 
 #ifdef USE_CRONOLOGIC
 #include "cronologic.h"
 #endif
 #ifdef USE_BECKERHICKL
-#include "bh.h"
+#include "BH.h"
 #endif
 
 class FifoTcspcFactory
@@ -21,22 +24,51 @@ public:
          return new SimTcspc(parent);
       }
 
+      if (type.toLower() == "replay")
+      {
+         return new ReplayTcspc(parent, FifoFlimDialogs::getReplayFileName());
+      }
+
       if (type.toLower() == "cronologic")
       {
 #ifdef USE_CRONOLOGIC
-         return new Cronologic(parent);
+         auto mode = (FifoFlimDialogs::getImagingMode() == "PLIM") ? Cronologic::PLIM : Cronologic::FLIM;
+         return new Cronologic(parent, mode);
 #endif
          throw(std::runtime_error("Cronologic support was not compiled"));
       }
       if (type.toLower() == "bh")
       {
 #ifdef USE_BECKERHICKL
-         return new BH(parent);
+         short module_type = spcModuleType(FifoFlimDialogs::getSpcModuleType());
+         return new BH(parent, module_type, [] { return FifoFlimDialogs::confirmForceSpcConnection(); });
 #endif
          throw(std::runtime_error("Becker&Hickl support was not compiled"));
       }
 
       throw(std::runtime_error("Unsupported TCSPC type requested"));
    }
+
+private:
+
+#ifdef USE_BECKERHICKL
+   static short spcModuleType(const QString& name)
+   {
+      static const std::map<QString, short> module_types = {
+         { "SPC-130", M_SPC130 },
+         { "SPC-140", M_SPC140 },
+         { "SPC-150", M_SPC150 },
+         { "SPC-160", M_SPC160 },
+         { "SPC-600", M_SPC600 },
+         { "SPC-630", M_SPC630 },
+         { "SPC-830", M_SPC830 },
+      };
+
+      auto it = module_types.find(name);
+      if (it == module_types.end())
+         throw(std::runtime_error("No supported SPC module type chosen"));
+      return it->second;
+   }
+#endif
 };
 
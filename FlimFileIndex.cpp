@@ -0,0 +1,141 @@
+#include "FlimFileIndex.h"
+#include <fstream>
+
+static_assert(sizeof(FlimFileIndexEntry) == 24, "FlimFileIndexEntry must be packed");
+
+std::string FlimFileIndex::sidecarFileName(const std::string& ffd_file_name)
+{
+   std::string name = ffd_file_name;
+   size_t ext = name.rfind(".ffd");
+   if (ext != std::string::npos && ext == name.size() - 4)
+      name.resize(ext);
+   return name + ".ffi";
+}
+
+void FlimFileIndex::reset(uint64_t data_offset_, bool index_lines_)
+{
+   data_offset = data_offset_;
+   index_lines = index_lines_;
+
+   frames.clear();
+   lines.clear();
+
+   n_events = 0;
+   last_marker = -1;
+   macro_time_offset = 0;
+   line_active = false;
+}
+
+void FlimFileIndex::addPhotons(uint64_t n)
+{
+   if (n == 0)
+      return;
+   if (!frames.empty())
+      frames.back().n_photons += (uint32_t) n;
+   if (line_active && !lines.empty())
+      lines.back().n_photons += (uint32_t) n;
+}
+
+void FlimFileIndex::addEvents(const TcspcEvent* evts, size_t n)
+{
+   scanner.scan(evts, n, markers);
+
+   for (uint32_t pos : markers.positions)
+   {
+      uint64_t idx = n_events + pos;
+
+      // Everything between two markers is a photon
+      addPhotons(idx - last_marker - 1);
+      last_marker = idx;
+
+      const TcspcEvent& evt = evts[pos];
+      if (evt.isMacroTimeRollover())
+      {
+         macro_time_offset += ((uint64_t) evt.macro_time) << 16;
+         continue;
+      }
+
+      uint8_t mark = evt.mark();
+      FlimFileIndexEntry entry = { data_offset + idx * sizeof(TcspcEvent), macro_time_offset + evt.macro_time, 0, mark };
+
+      if (mark & TcspcEvent::FrameMarker)
+      {
+         frames.push_back(entry);
+         line_active = false;
+      }
+      if (mark & TcspcEvent::LineStartMarker)
+      {
+         if (index_lines)
+            lines.push_back(entry);
+         line_active = true;
+      }
+      if (mark & TcspcEvent::LineEndMarker)
+         line_active = false;
+   }
+
+   n_events += n;
+   addPhotons(n_events - last_marker - 1);
+   last_marker = n_events - 1;
+}
+
+bool FlimFileIndex::write(const std::string& filename) const
+{
+   std::ofstream fs(filename, std::ofstream::binary);
+   if (!fs.is_open())
+      return false;
+
+   uint32_t file_magic = magic;
+   uint32_t file_version = version;
+   uint32_t flags = index_lines ? IndexLines : 0;
+   uint32_t reserved = 0;
+   uint64_t n_frames = frames.size();
+   uint64_t n_lines = lines.size();
+
+   fs.write(reinterpret_cast<const char*>(&file_magic), sizeof(file_magic));
+   fs.write(reinterpret_cast<const char*>(&file_version), sizeof(file_version));
+   fs.write(reinterpret_cast<const char*>(&flags), sizeof(flags));
+   fs.write(reinterpret_cast<const char*>(&reserved), sizeof(reserved));
+   fs.write(reinterpret_cast<const char*>(&n_frames), sizeof(n_frames));
+   fs.write(reinterpret_cast<const char*>(&n_lines), sizeof(n_lines));
+   fs.write(reinterpret_cast<const char*>(frames.data()), n_frames * sizeof(FlimFileIndexEntry));
+   fs.write(reinterpret_cast<const char*>(lines.data()), n_lines * sizeof(FlimFileIndexEntry));
+
+   return fs.good();
+}
+
+bool FlimFileIndex::read(const std::string& filename)
+{
+   std::ifstream fs(filename, std::ifstream::binary);
+   if (!fs.is_open())
+      return false;
+
+   uint32_t file_magic, file_version, flags, reserved;
+   uint64_t n_frames, n_lines;
+
+   fs.read(reinterpret_cast<char*>(&file_magic), sizeof(file_magic));
+   fs.read(reinterpret_cast<char*>(&file_version), sizeof(file_version));
+   fs.read(reinterpret_cast<char*>(&flags), sizeof(flags));
+   fs.read(reinterpret_cast<char*>(&reserved), sizeof(reserved));
+   fs.read(reinterpret_cast<char*>(&n_frames), sizeof(n_frames));
+   fs.read(reinterpret_cast<char*>(&n_lines), sizeof(n_lines));
+
+   if (!fs.good() || file_magic != magic || file_version > version)
+      return false;
+
+   // Check the counts are consistent with the file size before allocating
+   std::streamoff header_end = fs.tellg();
+   fs.seekg(0, std::ifstream::end);
+   std::streamoff file_size = fs.tellg();
+   fs.seekg(header_end);
+
+   if ((uint64_t) (file_size - header_end) != (n_frames + n_lines) * sizeof(FlimFileIndexEntry))
+      return false;
+
+   frames.resize(n_frames);
+   lines.resize(n_lines);
+   fs.read(reinterpret_cast<char*>(frames.data()), n_frames * sizeof(FlimFileIndexEntry));
+   fs.read(reinterpret_cast<char*>(lines.data()), n_lines * sizeof(FlimFileIndexEntry));
+
+   index_lines = (flags & IndexLines) != 0;
+   return fs.good();
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "TcspcEvent.h"
+#include "MarkerScanner.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+
+struct FlimFileIndexEntry
+{
+   uint64_t byte_offset; // offset of the marker event from the start of the file
+   uint64_t macro_time;  // absolute macro time of the marker, including rollovers
+   uint32_t n_photons;   // photons until the next entry of the same kind
+   uint32_t mark;        // marker bits of the event
+};
+
+/*
+   Frame (and optionally line) index for an FFD event stream.
+
+   FlimFileWriter builds the index while recording and saves it as a sidecar
+   file next to the .ffd; FlimFileReader loads it to seek without scanning,
+   or builds it itself if no sidecar is present. Because each entry records
+   the absolute macro time, frames can be decoded independently in parallel.
+
+   Sidecar layout (little-endian):
+      uint32 magic, uint32 version, uint32 flags, uint32 reserved,
+      uint64 n_frames, uint64 n_lines,
+      FlimFileIndexEntry frames[n_frames], FlimFileIndexEntry lines[n_lines]
+*/
+class FlimFileIndex
+{
+public:
+
+   enum Flags { IndexLines = 1 };
+
+   static std::string sidecarFileName(const std::string& ffd_file_name);
+
+   // Start a new index for an event stream starting at data_offset bytes
+   void reset(uint64_t data_offset, bool index_lines = false);
+
+   // Add the next span of the event stream
+   void addEvents(const TcspcEvent* evts, size_t n);
+
+   bool write(const std::string& filename) const;
+   bool read(const std::string& filename);
+
+   bool isIndexingLines() const { return index_lines; }
+
+   std::vector<FlimFileIndexEntry> frames;
+   std::vector<FlimFileIndexEntry> lines;
+
+private:
+
+   void addPhotons(uint64_t n);
+
+   MarkerScanner scanner;
+   MarkerScanResult markers;
+
+   uint64_t data_offset = 0;
+   uint64_t n_events = 0;
+   uint64_t last_marker = 0;
+   uint64_t macro_time_offset = 0;
+   bool index_lines = false;
+   bool line_active = false;
+
+   static const uint32_t magic = 0xF1F1;
+   static const uint32_t version = 1;
+};
@@ -3,58 +3,242 @@
 #include "EventProcessor.h"
 #include "TcspcEvent.h"
 #include "FlimFileWriter.h"
-#include <fstream>
-
-#define READ(fs, x) fs.read(reinterpret_cast<char *>(&x), sizeof(x))
-
+#include "FlimFileIndex.h"
+#include "CompressedStreamReader.h"
+#include <future>
+#include <functional>
+#include <thread>
+#include <QFile>
+#include <cstring>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/*
+   Reads FFD files through a memory mapping of the whole file. Event data is
+   handed out as spans pointing straight into the mapping; no per-event reads
+   are made. The frame index is loaded from the sidecar .ffi file written
+   alongside the recording, or built by scanning the file if there is none,
+   so that callers can seek to, or directly access, any frame or image
+   without decoding from the start.
+
+   Compressed recordings are decompressed on a background thread by
+   CompressedStreamReader and can only be read sequentially; frame counts
+   are still available if the sidecar index is present.
+
+   With build_image set the events are read into a FLIMage straight away;
+   otherwise the reader is left at the start for the caller to read from,
+   as ReplayTcspc does.
+*/
 class FlimFileReader
 {
 public:
 
-   FlimFileReader(QString filename) 
+   FlimFileReader(QString filename, bool build_image = true) :
+      file(filename)
    {
-      fs = std::ifstream(filename.toStdString(), std::ifstream::binary);
+      if (!file.open(QIODevice::ReadOnly))
+         throw std::runtime_error("Could not open file");
+
+      file_size = file.size();
+      map = file.map(0, file_size);
+      if (map == nullptr)
+         throw std::runtime_error("Could not map file");
+
       readHeader();
-      fs.seekg(data_position);
+
+      if (isCompressed())
+      {
+         openDecoder();
+      }
+      else
+      {
+         n_events = (file_size - data_position) / sizeof(TcspcEvent);
+
+         // Older files have headers of any length, which can leave the
+         // events misaligned in the mapping; copy those out instead
+         const uchar* data = map + data_position;
+         if (reinterpret_cast<uintptr_t>(data) % alignof(TcspcEvent) == 0)
+         {
+            events = reinterpret_cast<const TcspcEvent*>(data);
+         }
+         else
+         {
+            aligned_events.resize(n_events);
+            memcpy(aligned_events.data(), data, n_events * sizeof(TcspcEvent));
+            events = aligned_events.data();
+         }
+      }
+
+      adviseSequential();
+      loadFrameIndex(filename.toStdString());
+
+      if (!build_image)
+         return;
 
       image = std::make_shared<FLIMage>(using_pixel_markers, microtime_resolution, macrotime_resolution, 0, n_chan);
       image->setBidirectionalScan(bidirectional);
 
-      processor = createEventProcessor<FlimFileReader>(this, 10000, 10000);
+      processor = createEventProcessor<FlimFileReader>(this, 100, 100000);
       processor->addTcspcEventConsumer(image);
       processor->start();
    }
 
+   ~FlimFileReader()
+   {
+      if (processor)
+         processor->stop();
+      decoder.reset();
+      if (map)
+         file.unmap(map);
+   }
+
    std::shared_ptr<FLIMage> getFLIMage() { return image; }
 
+   const TcspcEvent* getEvents() { return events; }
+   size_t getNumEvents() { return n_events; }
+
+   bool isCompressed() { return compression != "none"; }
+
+   // Acquisition settings from the file header
+   double getMicrotimeResolution() { return microtime_resolution; }
+   double getMacrotimeResolution() { return macrotime_resolution; }
+   int getNumTimebins() { return (int) n_timebins_native; }
+   int getNumChannels() { return (int) n_chan; }
+   double getSyncRateHz() { return sync_rate_hz; }
+   bool usingPixelMarkers() { return using_pixel_markers; }
+   bool isBidirectional() { return bidirectional; }
+   const std::string& getTcspcSystem() { return tcspc_system; }
+
+   size_t getNumFrames() { return frame_start.size(); }
+   size_t getNumImages() { return image_start.size(); }
 
-   size_t readPackets(std::vector<TcspcEvent>& buffer)
+   const FlimFileIndex& getIndex() { return index; }
+
+   // Macro time to add to events in a frame to get absolute macro time
+   uint64_t getFrameMacroTimeOffset(size_t frame)
    {
-      if (!fs.is_open())
+      if (events == nullptr)
          return 0;
+      return index.frames[frame].macro_time - events[frame_start[frame]].macro_time;
+   }
+
+   // Calls fcn(frame, events, n_events, macro_time_offset) for every frame,
+   // spread over n_threads. Frames are independent so fcn must be thread safe
+   void processFramesParallel(std::function<void(size_t, const TcspcEvent*, size_t, uint64_t)> fcn, int n_threads = 0)
+   {
+      if (n_threads <= 0)
+         n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+      std::atomic<size_t> next_frame(0);
+      auto worker = [&]()
+      {
+         size_t frame;
+         while ((frame = next_frame++) < getNumFrames())
+         {
+            size_t n;
+            const TcspcEvent* evts = getFrameEvents(frame, n);
+            fcn(frame, evts, n, getFrameMacroTimeOffset(frame));
+         }
+      };
+
+      std::vector<std::future<void>> threads;
+      for (int i = 0; i < n_threads; i++)
+         threads.push_back(std::async(std::launch::async, worker));
+      for (auto& t : threads)
+         t.get();
+   }
 
-      size_t idx = 0;
-      size_t buffer_size = buffer.size();
-      while (idx < buffer_size && !fs.eof())
-         fs.read(reinterpret_cast<char*>(&buffer[idx++]), sizeof(TcspcEvent));
+   // Returns pointer to the events of a frame, starting at its frame marker
+   const TcspcEvent* getFrameEvents(size_t frame, size_t& n)
+   {
+      if (frame >= frame_start.size() || events == nullptr)
+      {
+         n = 0;
+         return nullptr;
+      }
+
+      size_t begin = frame_start[frame];
+      size_t end = (frame + 1 < frame_start.size()) ? frame_start[frame + 1] : n_events;
+      n = end - begin;
+      return events + begin;
+   }
 
-      if (fs.eof())
-         fs.close();
+   // Back to the first event; compressed files are decompressed again
+   void rewind()
+   {
+      read_pos = 0;
+      if (decoder)
+         openDecoder();
+   }
 
-      return idx;
+   void seekToFrame(size_t frame)
+   {
+      if (decoder)
+      {
+         qWarning("Cannot seek in a compressed file");
+         return;
+      }
+      read_pos = (frame < frame_start.size()) ? frame_start[frame] : n_events;
+      adviseWillNeed(read_pos);
+   }
+
+   void seekToImage(size_t image_idx)
+   {
+      if (decoder)
+      {
+         qWarning("Cannot seek in a compressed file");
+         return;
+      }
+      read_pos = (image_idx < image_start.size()) ? image_start[image_idx] : n_events;
+      adviseWillNeed(read_pos);
+   }
+
+   // Hands out the next span of at most max_events directly from the mapping
+   const TcspcEvent* nextSpan(size_t max_events, size_t& n)
+   {
+      n = std::min(max_events, n_events - read_pos);
+      const TcspcEvent* span = events + read_pos;
+      read_pos += n;
+      return span;
+   }
+
+   size_t readPackets(std::vector<TcspcEvent>& buffer, double buffer_fill_factor)
+   {
+      if (decoder)
+         return decoder->read(reinterpret_cast<char*>(buffer.data()), buffer.size() * sizeof(TcspcEvent), sizeof(TcspcEvent)) / sizeof(TcspcEvent);
+
+      size_t n;
+      const TcspcEvent* span = nextSpan(buffer.size(), n);
+      if (n > 0)
+         memcpy(buffer.data(), span, n * sizeof(TcspcEvent));
+      return n;
    }
 
    void readHeader()
    {
+      const uchar* ptr = map;
+      const uchar* map_end = map + file_size;
+
+      auto read = [&](void* x, size_t size)
+      {
+         if (ptr + size > map_end)
+            throw std::runtime_error("Unexpected end of file while reading header");
+         memcpy(x, ptr, size);
+         ptr += size;
+      };
+
       uint32_t magic;
 
-      READ(fs, magic);
+      read(&magic, sizeof(magic));
 
       if (magic != 0xF1F0)
          throw std::runtime_error("Wrong magic string, this is not a valid FFD file");
 
-      READ(fs, version);
-      READ(fs, data_position);
+      read(&version, sizeof(version));
+      read(&data_position, sizeof(data_position));
 
 
       char tag_name[255];
@@ -65,30 +249,38 @@ public:
 
       do
       {
-         READ(fs, tag_name_length);
+         read(&tag_name_length, sizeof(tag_name_length));
 
+         uint32_t stored_name_length = tag_name_length;
          tag_name_length = std::min(tag_name_length, (uint32_t)255);
-         fs.read(tag_name, tag_name_length);
-         
-         READ(fs, tag_type);
-         READ(fs, tag_data_length);
+         read(tag_name, tag_name_length);
+         ptr += stored_name_length - tag_name_length;
 
-         std::vector<char> data(tag_data_length);
-         char* data_ptr = data.data();
-         fs.read(data_ptr, tag_data_length);
+         read(&tag_type, sizeof(tag_type));
+         read(&tag_data_length, sizeof(tag_data_length));
+
+         if (ptr + tag_data_length > map_end)
+            throw std::runtime_error("Unexpected end of file while reading header");
+
+         const char* data_ptr = reinterpret_cast<const char*>(ptr);
+         ptr += tag_data_length;
 
          if (tag_type == TagDouble)
          {
-            double value = *(double*)data_ptr;
+            double value;
+            memcpy(&value, data_ptr, sizeof(value));
 
             if (isTag("MicrotimeResolutionUnit_ps"))
                microtime_resolution = value;
             if (isTag("MacrotimeResolutionUnit_ps"))
                macrotime_resolution = value;
+            if (isTag("SyncRate_Hz"))
+               sync_rate_hz = value;
          }
          else if (tag_type == TagInt64)
          {
-            int64_t value = *(int64_t*)data_ptr;
+            int64_t value;
+            memcpy(&value, data_ptr, sizeof(value));
 
             if (isTag("NumChannels"))
                n_chan = value;
@@ -97,7 +289,8 @@ public:
          }
          else if (tag_type == TagUInt64)
          {
-            uint64_t value = *(uint64_t*)data_ptr;
+            uint64_t value;
+            memcpy(&value, data_ptr, sizeof(value));
          }
          else if (tag_type == TagBool)
          {
@@ -110,27 +303,113 @@ public:
          }
          else if (tag_type == TagDate)
          {
-            std::string value;
-            value.resize(tag_data_length);
-            memcpy(&value[0], data_ptr, tag_data_length);
+            std::string value(data_ptr, tag_data_length);
          }
          else if (tag_type == TagString)
          {
-            std::string value;
-            value.resize(tag_data_length);
-            memcpy(&value[0], data_ptr, tag_data_length);
+            std::string value(data_ptr, tag_data_length);
+
+            if (isTag("Compression"))
+               compression = value;
+            if (isTag("TcspcSystem"))
+               tcspc_system = value;
          }
 
 
       } while (tag_type != TagEndHeader);
 
-      data_position = fs.tellg();
+      data_position = (uint32_t) (ptr - map);
    }
 
 protected:
 
+   void openDecoder()
+   {
+      decoder.reset();
+      decoder.reset(new CompressedStreamReader(reinterpret_cast<const char*>(map + data_position), file_size - data_position, compression));
+   }
+
+   void loadFrameIndex(const std::string& filename)
+   {
+      bool have_index = index.read(FlimFileIndex::sidecarFileName(filename));
+
+      // Compressed event data can't be scanned or checked in place
+      if (isCompressed())
+      {
+         if (!have_index)
+            index.reset(data_position);
+      }
+      else if (!have_index || !isIndexValid())
+      {
+         // Scan in PacketBuffer sized chunks so the marker list stays small
+         const size_t chunk_size = 1024 * 1024;
+         index.reset(data_position);
+         for (size_t offset = 0; offset < n_events; offset += chunk_size)
+            index.addEvents(events + offset, std::min(chunk_size, n_events - offset));
+      }
+
+      frame_start.clear();
+      image_start.clear();
+
+      for (auto& f : index.frames)
+      {
+         size_t idx = (f.byte_offset - data_position) / sizeof(TcspcEvent);
+         frame_start.push_back(idx);
+         if (f.mark & TcspcEvent::ImageMarker)
+            image_start.push_back(idx);
+      }
+   }
+
+   bool isIndexValid()
+   {
+      // Every entry must point at a frame marker inside this file
+      for (auto& f : index.frames)
+      {
+         if (f.byte_offset < data_position || f.byte_offset >= data_position + n_events * sizeof(TcspcEvent))
+            return false;
+
+         const TcspcEvent& evt = events[(f.byte_offset - data_position) / sizeof(TcspcEvent)];
+         if (!evt.isMark() || !(evt.mark() & TcspcEvent::FrameMarker))
+            return false;
+      }
+      return true;
+   }
+
+   void adviseSequential()
+   {
+#ifndef _WIN32
+      madvise(map, file_size, MADV_SEQUENTIAL);
+#endif
+   }
+
+   void adviseWillNeed(size_t event_idx)
+   {
+#ifndef _WIN32
+      // madvise needs a page aligned address
+      size_t page_size = 4096;
+      size_t offset = (data_position + event_idx * sizeof(TcspcEvent)) & ~(page_size - 1);
+      if (offset < file_size)
+         madvise(map + offset, std::min((size_t)file_size - offset, (size_t) 64 * 1024 * 1024), MADV_WILLNEED);
+#endif
+   }
+
    std::shared_ptr<EventProcessor> processor;
-   std::ifstream fs;
+
+   QFile file;
+   qint64 file_size = 0;
+   uchar* map = nullptr;
+
+   std::string compression = "none";
+   std::unique_ptr<CompressedStreamReader> decoder;
+
+   const TcspcEvent* events = nullptr;
+   std::vector<TcspcEvent> aligned_events; // copy of misaligned mapped events
+   size_t n_events = 0;
+   size_t read_pos = 0;
+
+   FlimFileIndex index;
+   std::vector<size_t> frame_start;
+   std::vector<size_t> image_start;
 
    uint32_t version = 1;
    uint32_t data_position = 0;
@@ -138,8 +417,10 @@ protected:
    uint64_t n_chan = 1;
    double microtime_resolution;
    double macrotime_resolution;
+   double sync_rate_hz = 0;
+   std::string tcspc_system;
    bool using_pixel_markers = false;
    bool bidirectional = false;
 
    std::shared_ptr<FLIMage> image;
-};
\ No newline at end of file
+};
@@ -1,13 +1,10 @@
 #include "FlimFileWriter.h"
-#include <QStandardPaths>
-#include <QFileDialog>
 #include <QBuffer>
-#include <QMessageBox>
+#include <cstring>
 
 void FlimFileWriter::eventStreamAboutToStart()
 {
    running = true;
-   buffer.resize(1024); // buffer size must be multiple of 2!
 };
 
 void FlimFileWriter::eventStreamFinished()
@@ -23,8 +20,7 @@ void FlimFileWriter::nextImageStarted()
 
 void FlimFileWriter::imageSequenceFinished()
 {
-   if (file.isOpen())
-      file.close();
+   closeFile();
 
    recording = false;
    file_name = "";
@@ -32,12 +28,63 @@ void FlimFileWriter::imageSequenceFinished()
 
 void FlimFileWriter::addEvent(const TcspcEvent& evt)
 {
-   if (recording && (image_index > 0))
+   addEvents(&evt, 1);
+} 
+
+void FlimFileWriter::addEvents(const TcspcEvent* evts, size_t n)
+{
+   // TcspcEvent is laid out as little-endian macro_time, micro_time
+   // which matches the on-disk format, so write the span directly
+   if (recording && (image_index > 0) && writer.isOpen())
    {
-      data_stream.writeRawData(reinterpret_cast<const char*>(&evt.macro_time), sizeof(evt.macro_time));
-      data_stream.writeRawData(reinterpret_cast<const char*>(&evt.micro_time), sizeof(evt.micro_time));
+      writeEventData(reinterpret_cast<const char*>(evts), n * sizeof(TcspcEvent));
+      index.addEvents(evts, n);
+      file_has_events |= (n > 0);
    }
-} 
+}
+
+void FlimFileWriter::writeEventData(const char* data, size_t size)
+{
+   if (compressor)
+      compressor->write(data, size);
+   else
+      writer.write(data, size);
+}
+
+const char* FlimFileWriter::compressionTag(FlimCompression compression)
+{
+   switch (compression)
+   {
+   case LZ4BlockCompression:   return "lz4-block";
+   case ZstdBlockCompression:  return "zstd-block";
+   case TcspcBlockCompression: return "tcspc-block";
+   default:                    return "none";
+   }
+}
+
+void FlimFileWriter::setCompression(FlimCompression compression_, int compression_level, int n_threads)
+{
+   compression = compression_;
+
+   if (compression == NoCompression)
+   {
+      compressor.reset();
+      return;
+   }
+
+   if (compression == ZstdBlockCompression && !LZ4BlockStream::isCodecSupported(LZ4BlockStream::CodecZstd))
+   {
+      emit error("zstd compression is not available in this build, using LZ4");
+      compression = LZ4BlockCompression;
+   }
+
+   compressor.reset(new LZ4BlockStream(nullptr, n_threads, compression_level));
+   if (compression == ZstdBlockCompression)
+      compressor->setCodec(LZ4BlockStream::CodecZstd);
+   else if (compression == TcspcBlockCompression)
+      compressor->setCodec(LZ4BlockStream::CodecTcspc);
+   compressor->setOutput([this](const char* data, size_t size) { writer.write(data, size); });
+}
 
 
 void FlimFileWriter::writeFileHeader()
@@ -62,17 +109,33 @@ void FlimFileWriter::writeFileHeader()
    writeTag("MicrotimeResolutionUnit_ps", tcspc_params.time_resolution_ps);
    writeTag("MacrotimeResolutionUnit_ps", tcspc_params.macro_resolution_ps);
    writeTag("UsingPixelMarkers", tcspc->usingPixelMarkers());
+   writeTag("Compression", QString(compressionTag(compression)));
 
    for(auto&& m : metadata)
       writeTag(m.first, m.second);
-   
+
+   // Pad with an empty string tag, which readers skip, so that the events
+   // start 8 byte aligned in the file and so in a memory mapping of it
+   auto tagSize = [](const char* tag, uint32_t length) { return 4 + strlen(tag) + 1 + 2 + 4 + length; };
+   size_t end_position = 12 + buffer.pos() + tagSize("Padding", 0) + tagSize("EndHeader", 0);
+   std::vector<char> padding((8 - end_position % 8) % 8, 0);
+   writeTag("Padding", TagString, padding.data(), (uint32_t) padding.size());
+
    writeEndTag();
 
    buffer.close();
 
+   QByteArray preamble;
+   QDataStream preamble_stream(&preamble, QIODevice::WriteOnly);
+   preamble_stream.setByteOrder(QDataStream::LittleEndian);
+
    quint32 header_size = header.size();
-   data_stream << magic_number << format_version << (header_size + 12); // + 12 for first three numbers 
-   data_stream.writeRawData(header.data(), header.size());
+   preamble_stream << magic_number << format_version << (header_size + 12); // + 12 for first three numbers 
+
+   writer.write(preamble.data(), preamble.size());
+   writer.write(header.data(), header.size());
+
+   index.reset(writer.bytesWritten(), index_lines);
 }
 
 
@@ -82,23 +145,21 @@ void FlimFileWriter::startRecording(const QString& specified_file_name)
    if (recording)
       return;
 
-   file_name = specified_file_name;
-
-   if (file_name == "")
+   if (specified_file_name.isEmpty())
    {
-      QString folder = QStandardPaths::writableLocation(QStandardPaths::DocumentsLocation);
-      folder.append("/FLIM data.ffd");
-      file_name = QFileDialog::getSaveFileName(nullptr, "Choose a file name", folder, "FFD file (*.ffd)");
+      emit error("No file name given for recording");
+      return;
    }
 
+   file_name = specified_file_name;
+
    recording = true;
    image_index = 0;
 }
 
 void FlimFileWriter::openFile()
 {
-   if (file.isOpen())
-      file.close();
+   closeFile();
 
    QString new_ext = QString(" _%1.ffd").arg(image_index, 3, 10, QChar('0'));
    QString file_name_with_number = file_name;
@@ -111,8 +172,8 @@ void FlimFileWriter::openFile()
    }
 
 
-   file.setFileName(file_name_with_number);
-   bool success = file.open(QIODevice::WriteOnly);
+   cur_file_name = file_name_with_number;
+   bool success = writer.open(cur_file_name.toStdString());
 
    if (!success)
    {
@@ -120,10 +181,26 @@ void FlimFileWriter::openFile()
       return;
    }
 
-   data_stream.setDevice(&file);
-   data_stream.setByteOrder(QDataStream::LittleEndian);
-
    writeFileHeader();
+   file_has_events = false;
+}
+
+void FlimFileWriter::closeFile()
+{
+   if (!writer.isOpen())
+      return;
+
+   if (compressor)
+      compressor->close();
+
+   writer.close();
+
+   if (writer.hasError())
+      emit error(QString::fromStdString(writer.errorString()));
+
+   std::string index_file_name = FlimFileIndex::sidecarFileName(cur_file_name.toStdString());
+   if (!index.write(index_file_name))
+      emit error("Could not write index file");
 }
 
 
@@ -132,12 +209,11 @@ void FlimFileWriter::stopRecording()
 {
    recording = false;
 
-   data_stream.setDevice(nullptr);
-
-   if (file.isOpen() && file.size() == 0)
+   // The header is always written, so look for events rather than bytes
+   if (writer.isOpen() && !file_has_events)
       emit error("Written file is empty");
    
-   file.close();
+   closeFile();
 }
 
 void FlimFileWriter::writeTag(const QString& tag_string, const QVariant& value)
@@ -7,6 +7,10 @@
 #include <QDateTime>
 #include "TcspcEvent.h"
 #include "FifoTcspc.h"
+#include "StreamingFileWriter.h"
+#include "FlimFileIndex.h"
+#include "LZ4BlockStream.h"
+#include <memory>
 #include <map>
 
 enum FlimMetadataTag
@@ -20,6 +24,14 @@ enum FlimMetadataTag
    TagEndHeader = 7
 };
 
+enum FlimCompression
+{
+   NoCompression         = 0,
+   LZ4BlockCompression   = 1,
+   ZstdBlockCompression  = 2, // requires USE_ZSTD
+   TcspcBlockCompression = 3  // delta/bit-packed, see TcspcCodec
+};
+
 class FlimFileWriter : public QObject, public TcspcEventConsumer
 {
    Q_OBJECT
@@ -30,7 +42,8 @@ public:
 
    void setFifoTcspc(FifoTcspc* tcspc_) { tcspc = tcspc_; }
 
-   void startRecording(const QString& filename = "");
+   // See FifoFlimDialogs::getRecordingFileName to ask the user for a file name
+   void startRecording(const QString& filename);
    void stopRecording();
    bool isRecording() { return recording; }
 
@@ -41,6 +54,7 @@ public:
    void imageSequenceFinished();
 
    void addEvent(const TcspcEvent& evt);
+   void addEvents(const TcspcEvent* evts, size_t n);
 
    void addMetadata(const QString& tag, const QVariant& value) { metadata[tag] = value; };
    void removeMetadata(const QString& tag) { metadata.erase(tag); }
@@ -48,6 +62,22 @@ public:
 
    bool isProcessingEvents() { return recording; }
 
+   // Unbuffered writes bypass the OS page cache; preallocation reserves
+   // file extents up front. Both take effect from the next file opened
+   void setDirectIO(bool direct_io) { writer.setDirectIO(direct_io); }
+   void setPreallocationSize(uint64_t bytes) { writer.setPreallocationSize(bytes); }
+
+   // A frame index is written to a sidecar .ffi file next to each recording;
+   // optionally it also indexes every line
+   void setIndexLines(bool index_lines_) { index_lines = index_lines_; }
+
+   // Compress the event stream in independent blocks on n_threads workers.
+   // See LZ4BlockStream for the meaning of compression_level
+   void setCompression(FlimCompression compression_, int compression_level = 0, int n_threads = 0);
+
+   // Value of the "Compression" header tag, as understood by CompressedStreamReader
+   static const char* compressionTag(FlimCompression compression);
+
 signals:
 
    void error(QString);
@@ -56,8 +86,14 @@ protected:
 
    QString folder;
    QString file_name;
-   QFile file;
-   QDataStream data_stream;
+   QString cur_file_name;
+   StreamingFileWriter writer;
+   FlimFileIndex index;
+   bool index_lines = false;
+
+   FlimCompression compression = NoCompression;
+   std::unique_ptr<LZ4BlockStream> compressor;
+
    QByteArray header;
    QDataStream header_stream;
 
@@ -65,9 +101,12 @@ protected:
 
    bool recording = false;
    bool running = false;
+   bool file_has_events = false; // since the current file was opened
 
    void writeFileHeader();
    void openFile();
+   void closeFile();
+   void writeEventData(const char* data, size_t size);
 
    void writeTag(const QString& tag, const QVariant& value);
 
@@ -81,7 +120,5 @@ protected:
    void writeTag(const char* tag, uint16_t type, const char* data, uint32_t length);
 
    FifoTcspc* tcspc = nullptr;
-   std::vector<uint16_t> buffer;
-   int buffer_pos = 0;
    int image_index = 0;
 };
@@ -0,0 +1,332 @@
+#pragma once
+
+#include "lz4.h"
+#include "lz4hc.h"
+#include "WorkerPool.h"
+#include "TcspcCodec.h"
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <QIODevice>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+   Compressed stream made of independent blocks, compressed in parallel.
+
+   Input is cut into blocks of block_bytes which are compressed on a worker
+   pool; finished blocks are written out in order by the writing thread,
+   which only blocks if too many blocks are in flight. Since blocks do not
+   share a dictionary they can also be decompressed in parallel, using the
+   block table written when the stream is closed.
+
+   Stream layout (little-endian, offsets relative to the start of the stream):
+      LZ4BlockStreamHeader
+      for each block: uint32 stored_size, uint32 raw_size, data[stored_size]
+      LZ4BlockTableEntry table[n_blocks]
+      LZ4BlockStreamFooter
+
+   If the top bit of stored_size is set the block was stored uncompressed.
+   Blocks are LZ4 compressed by default. setCodec selects zstd (if built
+   with USE_ZSTD) or TcspcCodec, which is specific to TcspcEvent data.
+*/
+
+struct LZ4BlockStreamHeader
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t block_bytes;
+   uint32_t codec;
+};
+
+struct LZ4BlockTableEntry
+{
+   uint64_t offset; // offset of block size words
+   uint32_t stored_size;
+   uint32_t raw_size;
+};
+
+struct LZ4BlockStreamFooter
+{
+   uint64_t table_offset;
+   uint64_t n_blocks;
+   uint32_t magic;
+   uint32_t reserved;
+};
+
+class LZ4BlockStream
+{
+public:
+
+   enum Codec { CodecLZ4 = 1, CodecZstd = 2, CodecTcspc = 3 };
+
+   static const uint32_t header_magic = 0x425A4C46; // "FLZB"
+   static const uint32_t footer_magic = 0x545A4C46; // "FLZT"
+   static const uint32_t stored_flag = 0x80000000;
+   static const size_t default_block_bytes = 1024 * 1024;
+
+   LZ4BlockStream(QIODevice* output_device = nullptr, int n_workers = 0, int compression_level = 0) :
+      compression_level(compression_level)
+   {
+      setDevice(output_device);
+      pool.reset(new WorkerPool(n_workers));
+      max_in_flight = 2 * pool->getNumThreads();
+   }
+
+   ~LZ4BlockStream()
+   {
+      close();
+   }
+
+   void setDevice(QIODevice* output_device)
+   {
+      if (output_device == nullptr)
+         output = nullptr;
+      else
+         output = [output_device](const char* data, size_t size) { output_device->write(data, size); };
+   }
+
+   // Alternative to setDevice for writing to something other than a QIODevice
+   void setOutput(std::function<void(const char*, size_t)> output_) { output = output_; }
+
+   static bool isCodecSupported(uint32_t codec)
+   {
+#ifdef USE_ZSTD
+      if (codec == CodecZstd)
+         return true;
+#endif
+      return codec == CodecLZ4 || codec == CodecTcspc;
+   }
+
+   // Applies from the next stream, i.e. after the current one is closed
+   void setCodec(Codec codec_)
+   {
+      if (!isCodecSupported(codec_))
+      {
+         qWarning("Compression codec not supported in this build, using LZ4");
+         codec_ = CodecLZ4;
+      }
+      next_codec = codec_;
+   }
+
+   // For LZ4, levels <= 0 use fast LZ4 with acceleration (1 - level), higher levels use LZ4HC.
+   // For zstd, levels <= 0 use level 1. Takes effect from the next block
+   void setCompressionLevel(int compression_level_) { compression_level = compression_level_; }
+   int getCompressionLevel() { return compression_level; }
+
+   // Waits for any blocks in flight to be written before resizing the pool
+   void setNumWorkers(int n_workers)
+   {
+      flushPending(0);
+      pool.reset(new WorkerPool(n_workers));
+      max_in_flight = 2 * pool->getNumThreads();
+   }
+   int getNumWorkers() { return pool->getNumThreads(); }
+
+   void write(const char* data, size_t size)
+   {
+      if (output == nullptr)
+      {
+         qWarning("No output stream set");
+         return;
+      }
+
+      if (!started)
+         start();
+
+      while (size > 0)
+      {
+         if (cur_block.empty())
+            cur_block.reserve(block_bytes);
+
+         size_t n_copy = std::min(size, block_bytes - cur_block.size());
+         cur_block.insert(cur_block.end(), data, data + n_copy);
+         data += n_copy;
+         size -= n_copy;
+
+         if (cur_block.size() == block_bytes)
+            submitBlock();
+      }
+   }
+
+   // Flushes remaining data and writes the block table. The stream
+   // can be reused for a new output after closing
+   void close()
+   {
+      if (!started)
+         return;
+
+      if (!cur_block.empty())
+         submitBlock();
+      flushPending(0);
+
+      LZ4BlockStreamFooter footer = { bytes_written, (uint64_t) table.size(), footer_magic, 0 };
+      writeOutput(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(LZ4BlockTableEntry));
+      writeOutput(reinterpret_cast<const char*>(&footer), sizeof(footer));
+
+      table.clear();
+      started = false;
+   }
+
+   uint64_t getTotalIn() { return total_in; }
+   uint64_t getTotalOut() { return bytes_written; }
+
+   // Decompresses a block as written by writeBlock, returns false if it is corrupt
+   static bool decompressBlock(uint32_t codec, const char* src, uint32_t stored_size, char* dest, uint32_t raw_size)
+   {
+      if (stored_size & stored_flag)
+      {
+         if ((stored_size & ~stored_flag) != raw_size)
+            return false;
+         memcpy(dest, src, raw_size);
+         return true;
+      }
+
+#ifdef USE_ZSTD
+      if (codec == CodecZstd)
+         return ZSTD_decompress(dest, raw_size, src, stored_size) == raw_size;
+#endif
+      if (codec == CodecTcspc)
+         return (raw_size % sizeof(TcspcEvent) == 0) &&
+            TcspcCodec::decode(src, stored_size, reinterpret_cast<TcspcEvent*>(dest), raw_size / sizeof(TcspcEvent));
+      if (codec == CodecLZ4)
+         return LZ4_decompress_safe(src, dest, (int) stored_size, (int) raw_size) == (int) raw_size;
+
+      return false;
+   }
+
+protected:
+
+   struct CompressedBlock
+   {
+      std::vector<char> data;
+      uint32_t stored_size;
+      uint32_t raw_size;
+   };
+
+   void start()
+   {
+      bytes_written = 0;
+      total_in = 0;
+      table.clear();
+
+      codec = next_codec;
+      LZ4BlockStreamHeader header = { header_magic, 1, (uint32_t) block_bytes, (uint32_t) codec };
+      writeOutput(reinterpret_cast<const char*>(&header), sizeof(header));
+      started = true;
+   }
+
+   void submitBlock()
+   {
+      // Bound memory use if the workers are falling behind
+      flushPending(max_in_flight - 1);
+
+      auto input = std::make_shared<std::vector<char>>();
+      input->swap(cur_block);
+      total_in += input->size();
+
+      int level = compression_level;
+      Codec block_codec = codec;
+      pending.push_back(pool->submit([input, level, block_codec]() { return compressBlock(*input, level, block_codec); }));
+
+      // Write out any blocks which are already finished
+      while (!pending.empty() && pending.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+      {
+         writeBlock(pending.front().get());
+         pending.pop_front();
+      }
+   }
+
+   void flushPending(size_t max_pending)
+   {
+      while (pending.size() > max_pending)
+      {
+         writeBlock(pending.front().get());
+         pending.pop_front();
+      }
+   }
+
+   static CompressedBlock compressBlock(const std::vector<char>& input, int level, Codec codec)
+   {
+      CompressedBlock block;
+      int raw_size = (int) input.size();
+      block.raw_size = raw_size;
+
+      int cmp_size;
+      if (codec == CodecTcspc)
+      {
+         // Input is whole events, as written by FlimFileWriter
+         bool encoded = (raw_size % sizeof(TcspcEvent) == 0) &&
+            TcspcCodec::encode(reinterpret_cast<const TcspcEvent*>(input.data()), raw_size / sizeof(TcspcEvent), block.data);
+         cmp_size = encoded ? (int) std::min(block.data.size(), (size_t) INT32_MAX) : 0;
+      }
+#ifdef USE_ZSTD
+      else if (codec == CodecZstd)
+      {
+         block.data.resize(ZSTD_compressBound(raw_size));
+         size_t zstd_size = ZSTD_compress(block.data.data(), block.data.size(), input.data(), raw_size, std::max(level, 1));
+         cmp_size = ZSTD_isError(zstd_size) ? 0 : (int) zstd_size;
+      }
+#endif
+      else
+      {
+         block.data.resize(LZ4_compressBound(raw_size));
+         if (level <= 0)
+            cmp_size = LZ4_compress_fast(input.data(), block.data.data(), raw_size, (int) block.data.size(), 1 - level);
+         else
+            cmp_size = LZ4_compress_HC(input.data(), block.data.data(), raw_size, (int) block.data.size(), level);
+      }
+
+      if (cmp_size <= 0 || cmp_size >= raw_size)
+      {
+         // Incompressible, store raw
+         block.data.assign(input.begin(), input.end());
+         block.stored_size = raw_size | stored_flag;
+      }
+      else
+      {
+         block.stored_size = cmp_size;
+         block.data.resize(cmp_size);
+      }
+
+      return block;
+   }
+
+   void writeBlock(const CompressedBlock& block)
+   {
+      table.push_back({ bytes_written, block.stored_size, block.raw_size });
+
+      writeOutput(reinterpret_cast<const char*>(&block.stored_size), sizeof(block.stored_size));
+      writeOutput(reinterpret_cast<const char*>(&block.raw_size), sizeof(block.raw_size));
+      writeOutput(block.data.data(), block.data.size());
+   }
+
+   void writeOutput(const char* data, size_t size)
+   {
+      output(data, size);
+      bytes_written += size;
+   }
+
+   std::function<void(const char*, size_t)> output;
+   std::unique_ptr<WorkerPool> pool;
+   std::deque<std::future<CompressedBlock>> pending;
+   size_t max_in_flight;
+
+   std::atomic<int> compression_level;
+   Codec codec = CodecLZ4;
+   Codec next_codec = CodecLZ4;
+   const size_t block_bytes = default_block_bytes;
+
+   std::vector<char> cur_block;
+   std::vector<LZ4BlockTableEntry> table;
+
+   bool started = false;
+   uint64_t bytes_written = 0;
+   uint64_t total_in = 0;
+};
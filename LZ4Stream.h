@@ -5,10 +5,13 @@
 
 #include <vector>
 #include <algorithm>
+#include <cstring>
 #include <QIODevice>
 
-
-
+/*
+   Chained LZ4HC stream, written as a sequence of int32 compressed size
+   followed by the compressed message; the same format as LZ4ThreadedStream.
+*/
 class LZ4Stream
 {
 public:
@@ -51,12 +54,12 @@ public:
       {
          int msg_bytes = (int) std::min(max_message_bytes, remaining_bytes);
          
-         for(size_t i=0; i<msg_bytes; i++)
-            ring_buf[cur_pos_ring+i] = data[cur_pos_input + i];
-         
+         // The ring keeps the previous message in place as the LZ4 dictionary
          char* ring_ptr = ring_buf.data() + cur_pos_ring;
+         memcpy(ring_ptr, data + cur_pos_input, msg_bytes);
          
          const int cmp_bytes = LZ4_compress_HC_continue(stream, ring_ptr, cmp_buf.data(), (int)msg_bytes, (int)cmp_buf_bytes);
+         output_device->write(reinterpret_cast<const char*>(&cmp_bytes), sizeof(cmp_bytes));
          output_device->write(cmp_buf.data(), cmp_bytes);
          
          remaining_bytes -= msg_bytes;
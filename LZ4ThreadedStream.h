@@ -1,12 +1,11 @@
 #pragma once
 
-#pragma once
-
 #include "lz4.h"
 #include "lz4hc.h"
 
 #include <vector>
 #include <algorithm>
+#include <cstring>
 #include <QIODevice>
 #include <thread>
 #include <mutex>
@@ -27,20 +26,26 @@ public:
       cmp_buf_bytes = LZ4_COMPRESSBOUND(max_message_bytes);
       cmp_buf.resize(cmp_buf_bytes);
 
-      cur_buffer = buffer.getNextBufferToFill();
-
       output_thread = std::thread(&LZ4ThreadedStream::outputThread, this);
    }
 
    ~LZ4ThreadedStream()
    {
-      buffer.setStreamFinished();
-      output_thread.join();
+      close();
       LZ4_freeStreamHC(stream);
    }
 
+   // Compresses any partially filled buffer and waits for the output thread to finish
    void close()
    {
+      if (closed)
+         return;
+
+      if (bytes_in_buffer > 0)
+         buffer.finishedFillingBuffer(bytes_in_buffer);
+      bytes_in_buffer = 0;
+      cur_buffer = nullptr;
+
       buffer.setStreamFinished();
       closed = true;
       output_thread.join();
@@ -50,18 +55,24 @@ public:
 
    void outputThread()
    {
+      // LZ4 uses the previous block as its dictionary, so it is kept
+      // pinned until the next block has been compressed
+      PacketBufferView<char> dict_view;
+
       while (true)
       {
          buffer.waitForNextBuffer();
          if (buffer.streamFinished())
             return;
 
-         size_t n = buffer.getProcessingBufferSize();
+         // Compress straight from the ring buffer slot
+         PacketBufferView<char> b = buffer.getProcessingBufferView();
+         buffer.finishedProcessingBuffer();
 
-         std::vector<char> b = buffer.getNextBufferToProcess();
+         size_t n = b.size();
 
          const int cmp_bytes = LZ4_compress_HC_continue(stream, b.data(), cmp_buf.data(), (int)n, (int)cmp_buf_bytes);
-         buffer.finishedProcessingBuffer();
+         dict_view = std::move(b);
 
          output_device->write(reinterpret_cast<const char*>(&cmp_bytes), sizeof(cmp_bytes));
          output_device->write(cmp_buf.data(), cmp_bytes);
@@ -88,29 +99,29 @@ public:
          return;
       }
 
-      if (cur_buffer == nullptr)
+      while (size > 0)
       {
-         cur_buffer = buffer.getNextBufferToFill();
          if (cur_buffer == nullptr)
          {
-            qWarning("Warning, bytes may be lost due to buffer overflow");
-            return;
+            cur_buffer = buffer.getNextBufferToFill();
+            if (cur_buffer == nullptr)
+            {
+               qWarning("Warning, bytes may be lost due to buffer overflow");
+               return;
+            }
          }
-      }
 
-      int idx = 0;
-      while (size - idx > 0)
-      {
-         char* cb = cur_buffer->data(); // work around for slow STL checks in debug mode
+         size_t num_to_copy = std::min(size, max_message_bytes - bytes_in_buffer);
+         memcpy(cur_buffer->data() + bytes_in_buffer, data, num_to_copy);
 
-         size_t num_to_copy = std::min(size - idx, max_message_bytes);
-         for (int i = 0; i < num_to_copy; i++)
-            cb[bytes_in_buffer++] = data[idx++];
+         bytes_in_buffer += num_to_copy;
+         data += num_to_copy;
+         size -= num_to_copy;
 
          if (bytes_in_buffer == max_message_bytes)
          {
             buffer.finishedFillingBuffer(bytes_in_buffer);
-            cur_buffer = buffer.getNextBufferToFill();
+            cur_buffer = nullptr;
             bytes_in_buffer = 0;
          }
       }
@@ -134,6 +145,6 @@ protected:
    bool closed = false;
 
    PacketBuffer<char> buffer;
-   std::vector<char>* cur_buffer;
+   std::vector<char>* cur_buffer = nullptr;
    size_t bytes_in_buffer = 0;
 };
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+   Intensity, mean arrival time and phasor coordinates for every pixel of
+   an image, stored as [y][x][channel]. Pixels without photons are zero.
+   No instrument response is taken out, so phasors and phase lifetimes
+   include the delay of the IRF.
+*/
+class LifetimeImage
+{
+public:
+
+   LifetimeImage(int n_x = 0, int n_y = 0, int n_chan = 0) :
+      n_x(n_x), n_y(n_y), n_chan(n_chan),
+      intensity(size()), mean_arrival_time(size()), g(size()), s(size()), phase_lifetime(size())
+   {}
+
+   size_t size() const { return (size_t) n_x * n_y * n_chan; }
+   size_t index(int x, int y, int chan) const { return ((size_t) y * n_x + x) * n_chan + chan; }
+
+   int n_x, n_y, n_chan;
+
+   std::vector<uint32_t> intensity;
+   std::vector<float> mean_arrival_time; // ps from the start of the micro time range
+   std::vector<float> g;
+   std::vector<float> s;
+   std::vector<float> phase_lifetime;    // ps, s / (g * omega)
+
+   // Frames accumulated into the image, counting from the start of the stream
+   uint64_t first_frame = 0;
+   uint64_t n_frames = 0;
+};
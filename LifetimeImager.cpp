@@ -0,0 +1,182 @@
+#include "LifetimeImager.h"
+#include <cmath>
+
+LifetimeImager::LifetimeImager(const TcspcAcquisitionParameters& params, int n_x, int n_y) :
+   n_x(n_x), n_y(n_y),
+   n_chan(std::min(params.n_channels, 15)), // channel 0xF is for markers
+   n_timebins(params.n_timebins),
+   time_resolution_ps(params.time_resolution_ps)
+{
+}
+
+std::shared_ptr<const LifetimeImage> LifetimeImager::getLatestImage()
+{
+   std::lock_guard<std::mutex> lk(image_mutex);
+   return ready;
+}
+
+void LifetimeImager::eventStreamAboutToStart()
+{
+   image_n_x = n_x;
+   image_n_y = n_y;
+   image_pixel_markers = using_pixel_markers;
+
+   size_t n_px = (size_t) n_x * n_y * n_chan;
+   photon_count.assign(n_px, 0);
+   sum_time.assign(n_px, 0);
+   phasor_sums.assign(2 * n_px, 0.0f);
+
+   // Phasor of each micro time bin centre
+   const double pi = 3.14159265358979323846;
+   double period_ps = n_timebins * time_resolution_ps;
+   omega = 2 * pi * harmonic / period_ps;
+
+   phasor_table.resize(2 * n_timebins);
+   for (int i = 0; i < n_timebins; i++)
+   {
+      double phi = omega * (i + 0.5) * time_resolution_ps;
+      phasor_table[2 * i] = (float) cos(phi);
+      phasor_table[2 * i + 1] = (float) sin(phi);
+   }
+
+   photon_weight = 1;
+   macro_time_offset = 0;
+   line_tracker.reset(n_x, n_y, bidirectional, using_pixel_markers);
+   cur_line = ScanLine();
+   cur_x = 0;
+   n_frames = 0;
+   first_frame = 0;
+   line_idx = -1;
+}
+
+void LifetimeImager::imageSequenceFinished()
+{
+   // The frame marker ending the last image isn't passed on, so publish here
+   line_tracker.abandonLine();
+   if (line_tracker.frameIndex() >= 0)
+   {
+      line_idx = -1;
+      n_frames++;
+      publishImage();
+   }
+}
+
+void LifetimeImager::addEvents(const TcspcEvent* evts, size_t n)
+{
+   const float* table = phasor_table.data();
+   float* gs = phasor_sums.data();
+   uint32_t weight = photon_weight;
+   float weight_f = (float) weight;
+
+   for (size_t i = 0; i < n; i++)
+   {
+      const TcspcEvent& evt = evts[i];
+      uint8_t chan = evt.channel();
+
+      if (chan < n_chan)
+      {
+         if (line_idx < 0)
+            continue;
+
+         int x = image_pixel_markers ? cur_x : cur_line.timeToX(macro_time_offset + evt.macro_time);
+         x = cur_line.column(x);
+         if (x < 0)
+            continue;
+
+         uint16_t bin = evt.microTime();
+         if (bin >= n_timebins)
+            continue;
+
+         size_t p = line_idx + x * n_chan + chan;
+         photon_count[p] += weight;
+         sum_time[p] += (uint64_t) bin * weight;
+         gs[2 * p] += table[2 * bin] * weight_f;
+         gs[2 * p + 1] += table[2 * bin + 1] * weight_f;
+      }
+      else if (evt.isMacroTimeRollover())
+      {
+         macro_time_offset += ((uint64_t) evt.macro_time) << 16;
+      }
+      else if (evt.isMark())
+      {
+         processMarker(evt, macro_time_offset + evt.macro_time);
+      }
+   }
+}
+
+void LifetimeImager::processMarker(const TcspcEvent& evt, uint64_t macro_time)
+{
+   auto frameCompleted = [this](bool image_completed)
+   {
+      n_frames++;
+      if (image_completed || n_frames >= (uint64_t) frame_accumulation)
+         publishImage();
+   };
+
+   line_tracker.processMarker(evt.mark(), macro_time,
+      [this]() { line_idx = -1; },
+      frameCompleted,
+      [this](const ScanLine& line) { startLine(line); },
+      [this]() { cur_x++; });
+}
+
+void LifetimeImager::startLine(const ScanLine& line)
+{
+   cur_line = line;
+   cur_x = 0;
+   line_idx = line.counting ? (int64_t) line.y * image_n_x * n_chan : -1;
+}
+
+void LifetimeImager::publishImage()
+{
+   // Reuse the image published before last unless a reader still holds it
+   std::shared_ptr<LifetimeImage> image = std::move(spare);
+   if (!image || image.use_count() != 1 || image->n_x != image_n_x || image->n_y != image_n_y || image->n_chan != n_chan)
+      image = std::make_shared<LifetimeImage>(image_n_x, image_n_y, n_chan);
+
+   size_t n_px = image->size();
+   float inv_omega = (float) (1.0 / omega);
+   float res = (float) time_resolution_ps;
+
+   for (size_t i = 0; i < n_px; i++)
+   {
+      uint32_t count = photon_count[i];
+      image->intensity[i] = count;
+
+      if (count == 0)
+      {
+         image->mean_arrival_time[i] = 0;
+         image->g[i] = 0;
+         image->s[i] = 0;
+         image->phase_lifetime[i] = 0;
+         continue;
+      }
+
+      float inv_count = 1.0f / count;
+      float g = phasor_sums[2 * i] * inv_count;
+      float s = phasor_sums[2 * i + 1] * inv_count;
+
+      image->mean_arrival_time[i] = ((float) sum_time[i] * inv_count + 0.5f) * res;
+      image->g[i] = g;
+      image->s[i] = s;
+      image->phase_lifetime[i] = (g > 0) ? s / g * inv_omega : 0;
+   }
+
+   image->first_frame = first_frame;
+   image->n_frames = n_frames;
+
+   std::fill(photon_count.begin(), photon_count.end(), 0);
+   std::fill(sum_time.begin(), sum_time.end(), 0);
+   std::fill(phasor_sums.begin(), phasor_sums.end(), 0.0f);
+   first_frame = line_tracker.frameIndex() + 1;
+   n_frames = 0;
+
+   {
+      std::lock_guard<std::mutex> lk(image_mutex);
+      spare = std::move(ready);
+      ready = image;
+   }
+
+   if (image_ready_callback)
+      image_ready_callback(image);
+}
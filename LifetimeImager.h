@@ -0,0 +1,104 @@
+#pragma once
+
+#include "TcspcEvent.h"
+#include "FifoTcspc.h"
+#include "LifetimeImage.h"
+#include "ScanLineTracker.h"
+#include <memory>
+#include <mutex>
+#include <functional>
+
+/*
+   Builds a live lifetime image (see LifetimeImage) from the event stream
+   without keeping a decay histogram for every pixel.
+
+   For each pixel and channel only the photon count, the sum of micro
+   times and the phasor sums are kept. Each photon adds cos and sin of
+   its micro time bin, read from a lookup table that holds each (cos, sin)
+   pair next to each other. That way the pair is loaded and added to the
+   interleaved g, s sums in one go. The phasor is taken at the
+   given harmonic of the micro time range, which is assumed to be one
+   laser period. Mean arrival times, phasor coordinates and phase
+   lifetimes are only calculated when an image is published.
+
+   Pixels are located with ScanLineTracker, as in DecayHistogrammer, and
+   photons are weighted by the processor's decimation factor likewise. An image is
+   published after frame_accumulation frames, or at an image marker, and
+   handed out as a shared pointer. Settings take effect when the event
+   stream next starts.
+*/
+class LifetimeImager : public TcspcEventConsumer
+{
+public:
+
+   LifetimeImager(const TcspcAcquisitionParameters& params, int n_x, int n_y);
+
+   void setImageSize(int n_x_, int n_y_) { n_x = n_x_; n_y = n_y_; }
+   void setBidirectional(bool bidirectional_) { bidirectional = bidirectional_; }
+   void setUsingPixelMarkers(bool using_pixel_markers_) { using_pixel_markers = using_pixel_markers_; }
+   void setFrameAccumulation(int frame_accumulation_) { frame_accumulation = std::max(1, frame_accumulation_); }
+   void setHarmonic(int harmonic_) { harmonic = std::max(1, harmonic_); }
+
+   // Latest published image, or null if none has been published yet
+   std::shared_ptr<const LifetimeImage> getLatestImage();
+
+   // Called from the consumer thread each time an image is published
+   void setImageReadyCallback(std::function<void(std::shared_ptr<const LifetimeImage>)> image_ready_callback_) { image_ready_callback = image_ready_callback_; }
+
+   void eventStreamAboutToStart();
+   void imageSequenceFinished();
+   void addEvent(const TcspcEvent& evt) { addEvents(&evt, 1); }
+   void addEvents(const TcspcEvent* evts, size_t n);
+   void photonDecimationChanged(int factor) { photon_weight = factor; }
+   bool acceptsDecimation() { return true; }
+
+protected:
+
+   void processMarker(const TcspcEvent& evt, uint64_t macro_time);
+   void startLine(const ScanLine& line);
+   void publishImage();
+
+   // Settings
+   int n_x, n_y;
+   int n_chan;
+   int n_timebins;
+   double time_resolution_ps;
+   bool bidirectional = false;
+   bool using_pixel_markers = false;
+   int frame_accumulation = 1;
+   int harmonic = 1;
+
+   // Each photon is counted this many times, see DecayHistogrammer
+   uint32_t photon_weight = 1;
+
+   // Scan state
+   uint64_t macro_time_offset = 0;
+   ScanLineTracker line_tracker;
+   ScanLine cur_line;
+   int cur_x = 0;
+   uint64_t n_frames = 0;
+   uint64_t first_frame = 0;
+
+   // Index of the current line's first pixel, or -1 if photons are not
+   // being counted
+   int64_t line_idx = -1;
+   int image_n_x = 0;
+   int image_n_y = 0;
+   bool image_pixel_markers = false;
+
+   // Per pixel and channel sums, [y][x][channel]; phasor_sums holds g, s pairs
+   std::vector<uint32_t> photon_count;
+   std::vector<uint64_t> sum_time;
+   std::vector<float> phasor_sums;
+
+   // cos, sin pairs for each micro time bin
+   std::vector<float> phasor_table;
+   double omega = 0; // rad/ps
+
+   // The latest image, and the one before it which is reused once free
+   std::shared_ptr<LifetimeImage> ready;
+   std::shared_ptr<LifetimeImage> spare;
+   std::mutex image_mutex;
+
+   std::function<void(std::shared_ptr<const LifetimeImage>)> image_ready_callback;
+};
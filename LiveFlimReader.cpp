@@ -5,23 +5,29 @@
 LiveEventReader::LiveEventReader() : 
    AbstractEventReader(sizeof(TcspcEvent))
 {
-   block.resize(block_size * packet_size);
-   writer_block_it = block.begin();
 }
 
 void LiveEventReader::addEvent(const TcspcEvent& evt)
 {
-   std::copy_n((char*)&evt, packet_size, writer_block_it);
-   writer_block_it += packet_size;
-   if (writer_block_it == block.end())
-   {
-      //std::unique_lock<std::mutex> lk(m);
-      data.push_back(block);
-      cv.notify_one();
-      writer_block_it = block.begin();
-   }
+   addEvents(&evt, 1);
+};
+
+void LiveEventReader::addEvents(const TcspcEvent* evts, size_t n)
+{
+   // Events which don't come from a packet buffer need to be copied
+   addEventView(TcspcEventView::copyOf(evts, n));
 };
 
+void LiveEventReader::addEventView(const TcspcEventView& view)
+{
+   if (view.empty())
+      return;
+
+   std::lock_guard<std::mutex> lk(view_mutex);
+   views.push_back(view);
+   view_cv.notify_one();
+}
+
 double LiveEventReader::getProgress() 
 { 
    return 0; 
@@ -29,29 +35,63 @@ double LiveEventReader::getProgress()
 
 bool LiveEventReader::hasMoreData() 
 { 
-   return has_more_data; 
+   std::lock_guard<std::mutex> lk(view_mutex);
+   return has_more_data || (cur_view_idx < cur_view.size()) || !views.empty();
 };
 
 void LiveEventReader::setEventStreamAboutToStart() 
 { 
    clear();
+
+   std::lock_guard<std::mutex> lk(view_mutex);
+   views.clear();
+   cur_view = TcspcEventView();
+   cur_view_idx = 0;
    has_more_data = true;
 }
 
 void LiveEventReader::setEventStreamFinished()
 { 
+   std::lock_guard<std::mutex> lk(view_mutex);
    has_more_data = false; 
-   cv.notify_one();
+   view_cv.notify_one();
+}
+
+bool LiveEventReader::nextEvent(TcspcEvent& evt)
+{
+   if (cur_view_idx >= cur_view.size())
+   {
+      std::unique_lock<std::mutex> lk(view_mutex);
+      view_cv.wait(lk, [this] { return !views.empty() || !has_more_data; });
+
+      // Drop the finished view first so its buffer slot is released
+      cur_view = TcspcEventView();
+      cur_view_idx = 0;
+
+      if (views.empty())
+         return false;
+
+      cur_view = std::move(views.front());
+      views.pop_front();
+   }
+
+   evt = cur_view[cur_view_idx++];
+   return true;
 }
 
 
 std::tuple<class FifoEvent, uint64_t> LiveEventReader::getRawEvent()
 {
-   TcspcEvent evt = getPacket<TcspcEvent>();
-
+   TcspcEvent evt;
    FifoEvent e;
    uint64_t macro_time_offset = 0;
 
+   if (!nextEvent(evt))
+   {
+      e.valid = false;
+      return std::tuple<FifoEvent, uint64_t>(e, macro_time_offset);
+   }
+
    e.micro_time = evt.microTime();
    e.macro_time = evt.macro_time;
    e.channel = evt.channel();
@@ -88,6 +128,16 @@ void LiveFlimReader::addEvent(const TcspcEvent& evt)
    live_event_reader->addEvent(evt);
 }
 
+void LiveFlimReader::addEvents(const TcspcEvent* evts, size_t n)
+{
+   live_event_reader->addEvents(evts, n);
+}
+
+void LiveFlimReader::addEventView(const TcspcEventView& view)
+{
+   live_event_reader->addEventView(view);
+}
+
 void LiveFlimReader::setImageSize(int n_x_, int n_y_)
 {
    n_x = n_x_;
@@ -8,6 +8,8 @@
 #include <fstream>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <condition_variable>
 
 #include "TcspcEvent.h"
 #include "AbstractFifoReader.h"
@@ -19,6 +21,8 @@ public:
 
    LiveEventReader();
    void addEvent(const TcspcEvent& evt);
+   void addEvents(const TcspcEvent* evts, size_t n);
+   void addEventView(const TcspcEventView& view);
 
    // Event reader functions
    double getProgress();
@@ -30,9 +34,17 @@ public:
 
 protected:
 
+   bool nextEvent(TcspcEvent& evt);
+
    bool has_more_data = true;
-   std::vector<char> block;
-   std::vector<char>::iterator writer_block_it;
+
+   // Views onto the EventProcessor's packet buffers, read in place
+   std::deque<TcspcEventView> views;
+   TcspcEventView cur_view;
+   size_t cur_view_idx = 0;
+
+   std::mutex view_mutex;
+   std::condition_variable view_cv;
 };
 
 
@@ -49,6 +61,8 @@ public:
 
    // TCSPC event consumer functions
    void addEvent(const TcspcEvent& evt);
+   void addEvents(const TcspcEvent* evts, size_t n);
+   void addEventView(const TcspcEventView& view);
    void eventStreamAboutToStart() { live_event_reader->setEventStreamAboutToStart(); };
    void eventStreamFinished() { live_event_reader->setEventStreamFinished(); };
    void nextImageStarted() {};
@@ -0,0 +1,229 @@
+#include "MarkerScanner.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MARKER_SCANNER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+static_assert(sizeof(TcspcEvent) == sizeof(uint32_t), "TcspcEvent must be packed into 32 bits");
+
+namespace
+{
+   // An event is a marker or rollover word when the channel nibble,
+   // bits 16-19 of the little-endian event word, is 0xF
+   const uint32_t channel_mask = 0xF << 16;
+
+   inline int countTrailingZeros(uint32_t x)
+   {
+#ifdef _MSC_VER
+      unsigned long idx;
+      _BitScanForward(&idx, x);
+      return (int) idx;
+#else
+      return __builtin_ctz(x);
+#endif
+   }
+
+   inline void addPositions(uint32_t mask, uint32_t base, std::vector<uint32_t>& positions)
+   {
+      while (mask)
+      {
+         positions.push_back(base + countTrailingZeros(mask));
+         mask &= mask - 1;
+      }
+   }
+
+   template<class Event>
+   size_t scanScalar(const Event* evts, size_t start, size_t n, std::vector<uint32_t>& positions)
+   {
+      for (size_t i = start; i < n; i++)
+         if (evts[i].isMark())
+            positions.push_back((uint32_t) i);
+      return n;
+   }
+
+   // Markers are sparse, so classify them individually
+   template<class Event>
+   void classifyMarkers(const Event* evts, MarkerScanResult& result)
+   {
+      for (uint32_t pos : result.positions)
+      {
+         const Event& evt = evts[pos];
+         if (evt.isMacroTimeRollover())
+         {
+            result.n_rollover++;
+            continue;
+         }
+
+         uint8_t mark = evt.mark();
+         if (mark & TcspcEvent::PixelMarker)
+            result.n_pixel++;
+         if (mark & TcspcEvent::LineStartMarker)
+            result.n_line_start++;
+         if (mark & TcspcEvent::LineEndMarker)
+            result.n_line_end++;
+         if (mark & TcspcEvent::FrameMarker)
+            result.n_frame++;
+      }
+   }
+
+#ifdef MARKER_SCANNER_X86
+
+   size_t scanSSE2(const TcspcEvent* evts, size_t n, std::vector<uint32_t>& positions)
+   {
+      const __m128i mask = _mm_set1_epi32(channel_mask);
+      const __m128i* p = reinterpret_cast<const __m128i*>(evts);
+
+      size_t i = 0;
+      for (; i + 16 <= n; i += 16, p += 4)
+      {
+         __m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128(p + 0), mask), mask);
+         __m128i m1 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128(p + 1), mask), mask);
+         __m128i m2 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128(p + 2), mask), mask);
+         __m128i m3 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128(p + 3), mask), mask);
+
+         __m128i any = _mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3));
+         if (_mm_movemask_epi8(any) == 0)
+            continue;
+
+         uint32_t bits = _mm_movemask_ps(_mm_castsi128_ps(m0))
+                      | (_mm_movemask_ps(_mm_castsi128_ps(m1)) << 4)
+                      | (_mm_movemask_ps(_mm_castsi128_ps(m2)) << 8)
+                      | (_mm_movemask_ps(_mm_castsi128_ps(m3)) << 12);
+         addPositions(bits, (uint32_t) i, positions);
+      }
+      return i;
+   }
+
+   size_t scanWideSSE2(const WideTcspcEvent* evts, size_t n, std::vector<uint32_t>& positions)
+   {
+      // Two events per vector; the channel nibble is the bottom of each 64-bit lane
+      const __m128i mask = _mm_set1_epi64x(0xF);
+      const __m128i* p = reinterpret_cast<const __m128i*>(evts);
+
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8, p += 4)
+      {
+         __m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128(p + 0), mask), mask);
+         __m128i m1 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128(p + 1), mask), mask);
+         __m128i m2 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128(p + 2), mask), mask);
+         __m128i m3 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128(p + 3), mask), mask);
+
+         // Only the low dword of each lane is meaningful, bits 0 and 2 of the mask
+         uint32_t b0 = _mm_movemask_ps(_mm_castsi128_ps(m0)) & 0x5;
+         uint32_t b1 = _mm_movemask_ps(_mm_castsi128_ps(m1)) & 0x5;
+         uint32_t b2 = _mm_movemask_ps(_mm_castsi128_ps(m2)) & 0x5;
+         uint32_t b3 = _mm_movemask_ps(_mm_castsi128_ps(m3)) & 0x5;
+         if ((b0 | b1 | b2 | b3) == 0)
+            continue;
+
+         auto compact = [](uint32_t b) { return (b & 1) | ((b >> 1) & 2); };
+         uint32_t bits = compact(b0) | (compact(b1) << 2) | (compact(b2) << 4) | (compact(b3) << 6);
+         addPositions(bits, (uint32_t) i, positions);
+      }
+      return i;
+   }
+
+   TARGET_AVX2
+   size_t scanAVX2(const TcspcEvent* evts, size_t n, std::vector<uint32_t>& positions)
+   {
+      const __m256i mask = _mm256_set1_epi32(channel_mask);
+      const __m256i* p = reinterpret_cast<const __m256i*>(evts);
+
+      size_t i = 0;
+      for (; i + 32 <= n; i += 32, p += 4)
+      {
+         __m256i m0 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256(p + 0), mask), mask);
+         __m256i m1 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256(p + 1), mask), mask);
+         __m256i m2 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256(p + 2), mask), mask);
+         __m256i m3 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256(p + 3), mask), mask);
+
+         __m256i any = _mm256_or_si256(_mm256_or_si256(m0, m1), _mm256_or_si256(m2, m3));
+         if (_mm256_testz_si256(any, any))
+            continue;
+
+         uint32_t bits = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(m0))
+                      | ((uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(m1)) << 8)
+                      | ((uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(m2)) << 16)
+                      | ((uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(m3)) << 24);
+         addPositions(bits, (uint32_t) i, positions);
+      }
+      return i;
+   }
+
+   bool cpuSupportsAVX2()
+   {
+#ifdef _MSC_VER
+      int info[4];
+      __cpuid(info, 0);
+      if (info[0] < 7)
+         return false;
+
+      __cpuid(info, 1);
+      bool osxsave = (info[2] & (1 << 27)) != 0;
+      bool avx = (info[2] & (1 << 28)) != 0;
+      if (!osxsave || !avx)
+         return false;
+
+      // Check OS saves YMM state
+      if ((_xgetbv(0) & 0x6) != 0x6)
+         return false;
+
+      __cpuidex(info, 7, 0);
+      return (info[1] & (1 << 5)) != 0;
+#else
+      return __builtin_cpu_supports("avx2");
+#endif
+   }
+
+#endif
+}
+
+MarkerScanner::Implementation MarkerScanner::bestImplementation()
+{
+#ifdef MARKER_SCANNER_X86
+   static const Implementation best = cpuSupportsAVX2() ? AVX2 : SSE2;
+   return best;
+#else
+   return Scalar;
+#endif
+}
+
+void MarkerScanner::scan(const TcspcEvent* evts, size_t n, MarkerScanResult& result)
+{
+   result.clear();
+
+   size_t scanned = 0;
+#ifdef MARKER_SCANNER_X86
+   if (implementation == AVX2)
+      scanned = scanAVX2(evts, n, result.positions);
+   else if (implementation == SSE2)
+      scanned = scanSSE2(evts, n, result.positions);
+#endif
+   scanScalar(evts, scanned, n, result.positions);
+
+   classifyMarkers(evts, result);
+}
+
+void MarkerScanner::scan(const WideTcspcEvent* evts, size_t n, MarkerScanResult& result)
+{
+   result.clear();
+
+   size_t scanned = 0;
+#ifdef MARKER_SCANNER_X86
+   if (implementation != Scalar)
+      scanned = scanWideSSE2(evts, n, result.positions);
+#endif
+   scanScalar(evts, scanned, n, result.positions);
+
+   classifyMarkers(evts, result);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "TcspcEvent.h"
+#include <vector>
+#include <cstdint>
+
+class MarkerScanResult
+{
+public:
+
+   void clear()
+   {
+      positions.clear();
+      n_pixel = 0;
+      n_line_start = 0;
+      n_line_end = 0;
+      n_frame = 0;
+      n_rollover = 0;
+   }
+
+   std::vector<uint32_t> positions; // index of every marker and rollover word, in order
+
+   size_t n_pixel = 0;
+   size_t n_line_start = 0;
+   size_t n_line_end = 0;
+   size_t n_frame = 0;
+   size_t n_rollover = 0;
+};
+
+/*
+   Finds all marker and rollover words (channel == 0xF) in a packet buffer.
+   The AVX2 or SSE2 implementation is chosen at runtime depending on the CPU,
+   with a scalar fallback for other architectures.
+*/
+class MarkerScanner
+{
+public:
+
+   enum Implementation { Scalar, SSE2, AVX2 };
+
+   MarkerScanner() :
+      implementation(bestImplementation())
+   {}
+
+   static Implementation bestImplementation();
+
+   void setImplementation(Implementation implementation_) { implementation = implementation_; }
+   Implementation getImplementation() { return implementation; }
+
+   void scan(const TcspcEvent* evts, size_t n, MarkerScanResult& result);
+   void scan(const WideTcspcEvent* evts, size_t n, MarkerScanResult& result);
+
+private:
+
+   Implementation implementation;
+};
@@ -1,137 +1,437 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include "PacketBufferView.h"
 
-template<class T> 
-class PacketBuffer
-{
-   typedef
-   enum { BufferEmpty, BufferFilling, BufferFilled, BufferProcessing }
-   BufferState;
+/*
+   Lock-free ring of packet buffers with a single producer and one or more
+   consumer cursors.
 
+   head counts buffers published by the producer, each cursor's tail counts
+   buffers it has released; all counters increase monotonically and are
+   reduced modulo n_buffers to get a slot index. Every cursor sees every
+   buffer, and a slot is only recycled once all cursors have passed it and
+   no PacketBufferView onto it remains.
+   Each counter is only ever written by one thread so no locking is
+   required on the fast path. The mutex and condition variable are only
+   touched when a consumer or the producer has parked itself waiting.
 
+   In adaptive mode (see setAdaptive) slots only hold memory while they
+   are in use. The producer takes memory for a slot from a pool as it
+   fills it. Once every cursor has passed the slot and no view pins it,
+   the memory goes back to the pool. So the memory used follows the number
+   of buffers in flight, up to a cap, and the buffer length can change
+   from one buffer to the next.
+*/
+template<class T>
+class PacketBuffer
+{
 public:
    PacketBuffer(int n_buffers, size_t buffer_length) :
-      n_buffers(n_buffers), buffer_length(buffer_length)
+      buffer_length(buffer_length)
    {
-      // Allocate buffers
-      buffer = std::vector<std::vector<T>>(n_buffers, std::vector<T>(buffer_length));
-      buffer_state = std::vector<BufferState>(n_buffers, BufferEmpty);
-      buffer_size = std::vector<size_t>(n_buffers, 0);
+      allocateSlots(n_buffers);
+      for (auto& slot : slots)
+         slot->events.resize(buffer_length);
+      allocated_bytes.store(n_buffers * buffer_length * sizeof(T));
+      setNumConsumers(1);
+   }
+
+   // Switch to adaptive mode with max_buffers slots and at most max_bytes
+   // of buffer memory. Any existing buffers are freed, so no views may be
+   // held. Must only be called while neither producer nor consumers are active
+   void setAdaptive(int max_buffers, size_t max_bytes_)
+   {
+      adaptive = true;
+      max_bytes = max_bytes_;
+      allocateSlots(max_buffers);
+      allocated_bytes.store(0);
    }
 
+   bool isAdaptive() { return adaptive; }
+
+   // Length of buffers handed out from now on. Only used in adaptive mode
+   void setBufferLength(size_t buffer_length_) { buffer_length = buffer_length_; }
+   size_t getBufferLength() { return buffer_length; }
+
+   size_t getAllocatedBytes() { return allocated_bytes.load(std::memory_order_relaxed); }
+
+   // Number of buffers published but not yet released by every cursor
+   size_t buffersInUse() { return head.load(std::memory_order_acquire) - minTail(); }
+
+   // Slot of the oldest buffer in use; false if there is none
+   bool getOldestSlot(size_t& slot)
+   {
+      size_t t = minTail();
+      if (head.load(std::memory_order_acquire) == t)
+         return false;
+      slot = t % n_buffers;
+      return true;
+   }
+
+   // Must only be called while neither producer nor consumers are active
+   void setNumConsumers(int n_consumers_)
+   {
+      n_consumers = n_consumers_;
+      cursors.reset(new Cursor[n_consumers]);
+   }
+
+   int getNumConsumers() { return n_consumers; }
+   int getNumBuffers() { return (int) n_buffers; }
+
+   // Slot index of the buffer returned by getNextBufferToFill
+   size_t getFillSlot() { return head.load(std::memory_order_relaxed) % n_buffers; }
+
+   // Slot index of the buffer returned by getNextBufferToProcess
+   size_t getProcessingSlot(int cursor = 0) { return cursors[cursor].tail.load(std::memory_order_relaxed) % n_buffers; }
+
+   // Must only be called while neither producer nor consumers are active
    void reset()
    {
-      std::fill(buffer_state.begin(), buffer_state.end(), BufferEmpty);
       std::fill(buffer_size.begin(), buffer_size.end(), 0);
-      for (auto& b : buffer)
-         b.resize(buffer_length);
+      if (adaptive)
+      {
+         for (auto& slot : slots)
+            if (slot->pins.load() == 0 && slot->events.capacity() > 0)
+               free_buffers.push_back(std::move(slot->events));
+      }
+      else
+      {
+         for (auto& slot : slots)
+            slot->events.resize(buffer_length);
+      }
 
-      fill_idx = 0;
-      process_idx = 0;
-      stream_finished = false;
+      head.store(0);
+      for (int c = 0; c < n_consumers; c++)
+         cursors[c].tail.store(0);
+      drop_to.store(0);
+      reclaimed = 0;
+      stream_finished.store(false);
    }
 
    double fillFactor()
    {
-      return ((fill_idx - process_idx + n_buffers) % n_buffers) / static_cast<double>(n_buffers);
+      size_t t = minTail();
+      size_t h = head.load(std::memory_order_acquire);
+      double fill = (h - t) / static_cast<double>(n_buffers);
+
+      // In adaptive mode memory usually runs out before slots do
+      if (adaptive)
+         fill = std::max(fill, std::min(1.0, (h - t) * buffer_length * sizeof(T) / static_cast<double>(max_bytes)));
+      return fill;
    }
 
+   // Returns nullptr if there is no free buffer
    std::vector<T>* getNextBufferToFill()
    {
-      // return an empty vector if there is no valid buffer
-      if (buffer_state[fill_idx] != BufferEmpty)
-      {
-         qWarning("Internal buffer overflowed");
+      size_t h = head.load(std::memory_order_relaxed);
+
+      size_t idx = h % n_buffers;
+
+      if ((h - minTail() >= n_buffers) || (slots[idx]->pins.load(std::memory_order_acquire) > 0))
          return nullptr;
+
+      if (adaptive && !takeMemory(slots[idx]->events))
+         return nullptr;
+
+      buffer_size[idx] = 0;
+      return &(slots[idx]->events);
+   }
+
+   // True if every cursor has passed the next slot to fill but a view
+   // still pins it. The producer can publish it empty, with
+   // finishedFillingBuffer(0), rather than wait for the view to go
+   bool nextSlotPinned()
+   {
+      size_t h = head.load(std::memory_order_relaxed);
+      return (h - minTail() < n_buffers) && (slots[h % n_buffers]->pins.load(std::memory_order_acquire) > 0);
+   }
+
+   // Called by the producer while no buffer is free. Returns when one may
+   // have become free or after timeout. Cursors passing a buffer wake the
+   // producer; slots freed by unpinning or memory freed are picked up at
+   // the timeout
+   void waitForFreeBuffer(std::chrono::microseconds timeout)
+   {
+      std::unique_lock<std::mutex> lk(buffer_mutex);
+      producer_parked.store(true);
+      buffer_cv.wait_for(lk, timeout, [this] { return nextSlotFree(); });
+      producer_parked.store(false, std::memory_order_relaxed);
+   }
+
+   // Called by the producer to have the slowest cursors skip the oldest
+   // buffer waiting for them, see skipDropped. The buffer at the slowest
+   // tail may already be being processed, so the one after it is dropped.
+   // Calling again before the slowest cursor has moved on drops nothing more
+   void dropOldest()
+   {
+      size_t h = head.load(std::memory_order_relaxed);
+      size_t d = std::min(minTail() + 2, h);
+      if (d > drop_to.load(std::memory_order_relaxed))
+         drop_to.store(d, std::memory_order_release);
+   }
+
+   // Called by a cursor between buffers. Releases any buffers dropped by the
+   // producer, calling skipped(slot, view) for each, and returns how many
+   // were skipped
+   template<class F>
+   size_t skipDropped(int cursor, F skipped)
+   {
+      size_t d = drop_to.load(std::memory_order_acquire);
+      size_t t = cursors[cursor].tail.load(std::memory_order_relaxed);
+      if (d <= t)
+         return 0;
+
+      for (size_t c = t; c < d; c++)
+      {
+         size_t idx = c % n_buffers;
+         skipped(idx, PacketBufferView<T>(slots[idx], buffer_size[idx]));
       }
 
-      // Get buffer and increment index of next buffer
-      buffer_state[fill_idx] = BufferFilling;
-      buffer_size[fill_idx] = 0;
-      return &(buffer[fill_idx]);
+      cursors[cursor].tail.store(d, std::memory_order_release);
+      wakeProducer();
+      return d - t;
+   }
+
+   // Called by the producer in adaptive mode to free pooled memory beyond
+   // n_keep spare buffers
+   void trimFreeBuffers(size_t n_keep)
+   {
+      reclaimMemory();
+      while (free_buffers.size() > n_keep)
+      {
+         allocated_bytes.fetch_sub(free_buffers.back().capacity() * sizeof(T), std::memory_order_relaxed);
+         free_buffers.pop_back();
+      }
    }
 
    void finishedFillingBuffer(size_t size)
    {
-      // Set state of buffer to filled and increment pointer
-      buffer_size[fill_idx] = size;
-      buffer_state[fill_idx] = BufferFilled;
-      fill_idx = (fill_idx + 1) % n_buffers;
-	   buffer_cv.notify_all();
+      size_t h = head.load(std::memory_order_relaxed);
+      buffer_size[h % n_buffers] = size;
+
+      // Publish buffer; sequentially consistent so that it is ordered
+      // against the parked checks below
+      head.store(h + 1);
+
+      for (int c = 0; c < n_consumers; c++)
+         if (cursors[c].parked.load())
+         {
+            std::lock_guard<std::mutex> lk(buffer_mutex);
+            buffer_cv.notify_all();
+            break;
+         }
    }
 
    void failedToFillBuffer()
    {
-      buffer_state[fill_idx] = BufferEmpty;
+      // Nothing was published, the same slot will be handed out next time
    }
 
-   std::vector<T>& getNextBufferToProcess()
+   std::vector<T>& getNextBufferToProcess(int cursor = 0)
    {
       // return an empty vector if there is no valid buffer
-      if (buffer_state[process_idx] != BufferFilled)
+      size_t t = cursors[cursor].tail.load(std::memory_order_relaxed);
+      if (head.load(std::memory_order_acquire) == t)
          return empty_buffer;
 
-      // Get buffer and increment index of next buffer
-      buffer_state[process_idx] = BufferProcessing;
-      return buffer[process_idx];
+      return slots[t % n_buffers]->events;
    }
 
-   size_t getProcessingBufferSize()
+   // Returns a view of the buffer being processed, which keeps the slot
+   // from being refilled until the view (and any copies) are destroyed
+   PacketBufferView<T> getProcessingBufferView(int cursor = 0)
    {
-      if (buffer_state[process_idx] != BufferFilled)
+      size_t t = cursors[cursor].tail.load(std::memory_order_relaxed);
+      if (head.load(std::memory_order_acquire) == t)
+         return PacketBufferView<T>();
+
+      size_t idx = t % n_buffers;
+      return PacketBufferView<T>(slots[idx], buffer_size[idx]);
+   }
+
+   size_t getProcessingBufferSize(int cursor = 0)
+   {
+      size_t t = cursors[cursor].tail.load(std::memory_order_relaxed);
+      if (head.load(std::memory_order_acquire) == t)
          return 0;
-      return buffer_size[process_idx];
+      return buffer_size[t % n_buffers];
    }
 
-   bool streamFinished()
+   bool streamFinished(int cursor = 0)
    {
-      return stream_finished && (buffer_state[process_idx] != BufferFilled);
+      return stream_finished.load(std::memory_order_acquire) && !bufferAvailable(cursor);
    }
 
-   void waitForNextBuffer()
+   void waitForNextBuffer(int cursor = 0)
    {
-	   if (buffer_state[process_idx] != BufferFilled)
-	   {
-		   std::unique_lock<std::mutex> lk(buffer_mutex);
-		   buffer_cv.wait(lk, [this] { return stream_finished || (buffer_state[process_idx] == BufferFilled); });
-	   }
+      if (bufferAvailable(cursor) || stream_finished.load(std::memory_order_acquire))
+         return;
+
+      std::unique_lock<std::mutex> lk(buffer_mutex);
+      cursors[cursor].parked.store(true);
+      buffer_cv.wait(lk, [this, cursor] { return stream_finished.load() || bufferAvailable(cursor); });
+      cursors[cursor].parked.store(false, std::memory_order_relaxed);
    }
 
-   void finishedProcessingBuffer()
+   void finishedProcessingBuffer(int cursor = 0)
    {
-      // Set state of buffer to empty
-      buffer_state[process_idx] = BufferEmpty;
+      size_t t = cursors[cursor].tail.load(std::memory_order_relaxed);
+      if (head.load(std::memory_order_acquire) == t)
+         return; // no buffer was being processed
 
-      // Increment index of point to next buffer
-      process_idx = (process_idx + 1) % n_buffers;
+      // Release buffer; the producer can reuse it once all cursors have passed
+      cursors[cursor].tail.store(t + 1, std::memory_order_release);
+      wakeProducer();
    }
 
    void setStreamFinished()
    {
-      stream_finished = true;
+      stream_finished.store(true);
+
+      std::lock_guard<std::mutex> lk(buffer_mutex);
       buffer_cv.notify_all();
    }
 
 
 private:
 
-   int fill_idx = 0;
-   int process_idx = 0;
+   // Consumer cursors are aligned to a cache line each
+   // to avoid false sharing between consumer threads
+   struct alignas(64) Cursor
+   {
+      std::atomic<size_t> tail = { 0 };
+      std::atomic<bool> parked = { false };
+   };
+
+   void allocateSlots(size_t n_buffers_)
+   {
+      n_buffers = n_buffers_;
+      slots.clear();
+      for (size_t i = 0; i < n_buffers; i++)
+         slots.push_back(std::make_shared<PacketBufferSlot<T>>());
+      buffer_size = std::vector<size_t>(n_buffers, 0);
+      free_buffers.clear();
+      reclaimed = 0;
+   }
+
+   // Producer only: make sure slot memory of buffer_length is held in b,
+   // taking it from the pool or allocating it within max_bytes
+   bool takeMemory(std::vector<T>& b)
+   {
+      if (b.capacity() == 0)
+      {
+         reclaimMemory();
+         if (!free_buffers.empty())
+         {
+            b = std::move(free_buffers.back());
+            free_buffers.pop_back();
+         }
+      }
+
+      if (b.size() == buffer_length)
+         return true;
+
+      size_t old_bytes = b.capacity() * sizeof(T);
+      size_t new_bytes = buffer_length * sizeof(T);
+      if (new_bytes > old_bytes && allocated_bytes.load(std::memory_order_relaxed) - old_bytes + new_bytes > max_bytes)
+      {
+         trimFreeBuffers(0);
+         if (allocated_bytes.load(std::memory_order_relaxed) - old_bytes + new_bytes > max_bytes)
+            return false;
+      }
+
+      b.resize(buffer_length);
+      if (b.capacity() > 2 * buffer_length)
+         b.shrink_to_fit();
+
+      allocated_bytes.fetch_add(b.capacity() * sizeof(T), std::memory_order_relaxed);
+      allocated_bytes.fetch_sub(old_bytes, std::memory_order_relaxed);
+      return true;
+   }
+
+   // Producer only: return the memory of buffers every cursor has passed to
+   // the pool, stopping at the first one still pinned by a view
+   void reclaimMemory()
+   {
+      size_t h = head.load(std::memory_order_relaxed);
+      size_t t = minTail();
+
+      // Slots of older buffers have since been refilled, and the slot of
+      // buffer h - n_buffers is the next to be filled
+      if (reclaimed + n_buffers <= h)
+         reclaimed = h + 1 - n_buffers;
+
+      for (; reclaimed < t; reclaimed++)
+      {
+         auto& slot = *slots[reclaimed % n_buffers];
+         if (slot.pins.load(std::memory_order_acquire) > 0)
+            break;
+         if (slot.events.capacity() > 0)
+            free_buffers.push_back(std::move(slot.events));
+      }
+   }
+
+   void wakeProducer()
+   {
+      if (producer_parked.load())
+      {
+         std::lock_guard<std::mutex> lk(buffer_mutex);
+         buffer_cv.notify_all();
+      }
+   }
+
+   bool nextSlotFree()
+   {
+      size_t h = head.load();
+      return (h - minTail() < n_buffers) && (slots[h % n_buffers]->pins.load(std::memory_order_acquire) == 0);
+   }
+
+   bool bufferAvailable(int cursor)
+   {
+      return head.load() != cursors[cursor].tail.load(std::memory_order_relaxed);
+   }
+
+   size_t minTail()
+   {
+      size_t t = cursors[0].tail.load(std::memory_order_acquire);
+      for (int c = 1; c < n_consumers; c++)
+         t = std::min(t, cursors[c].tail.load(std::memory_order_acquire));
+      return t;
+   }
+
+   // Producer counter lives on its own cache line
+   alignas(64) std::atomic<size_t> head = { 0 };
+   alignas(64) std::atomic<bool> stream_finished = { false };
+   std::atomic<size_t> drop_to = { 0 };
+   std::atomic<bool> producer_parked = { false };
 
-   int n_buffers;
-   size_t buffer_length;
+   int n_consumers = 0;
+   std::unique_ptr<Cursor[]> cursors;
 
+
+   size_t n_buffers;
+   std::atomic<size_t> buffer_length;
+
+   // Adaptive mode; the pool and the reclaim counter belong to the producer
+   bool adaptive = false;
+   size_t max_bytes = 0;
+   std::atomic<size_t> allocated_bytes = { 0 };
+   std::vector<std::vector<T>> free_buffers;
+   size_t reclaimed = 0;
+
+   // Slot events and pin counts, shared with the views onto them
+   std::vector<std::shared_ptr<PacketBufferSlot<T>>> slots;
    std::vector<T> empty_buffer;
-   std::vector<BufferState> buffer_state;
-   std::vector<std::vector<T>> buffer;
    std::vector<size_t> buffer_size;
 
    std::mutex buffer_mutex;
    std::condition_variable buffer_cv;
-
-   bool stream_finished = false;
-
 };
+
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <cstddef>
+
+template<class T>
+class PacketBuffer;
+
+/*
+   Events of one packet buffer slot, and the number of views onto them.
+   Shared between the PacketBuffer and its views so that a view stays
+   valid even after the buffer has gone.
+*/
+template<class T>
+struct PacketBufferSlot
+{
+   std::vector<T> events;
+   std::atomic<int> pins = { 0 };
+};
+
+/*
+   Read-only, reference counted view onto part of a filled PacketBuffer slot.
+   While any view onto a slot is alive the producer will not reuse that slot,
+   so consumers can hold onto event data after releasing their cursor without
+   copying it. Views share ownership of the slot, so they may outlive the
+   PacketBuffer they were taken from.
+
+   A view can also own a private copy of its data (see copyOf) for the rare
+   case where events need to be modified before being passed on.
+*/
+template<class T>
+class PacketBufferView
+{
+public:
+
+   PacketBufferView() {}
+
+   PacketBufferView(const PacketBufferView& other) :
+      slot(other.slot), ptr(other.ptr), n(other.n)
+   {
+      pin();
+   }
+
+   PacketBufferView(PacketBufferView&& other) :
+      slot(std::move(other.slot)), ptr(other.ptr), n(other.n)
+   {
+      other.ptr = nullptr;
+      other.n = 0;
+   }
+
+   PacketBufferView& operator=(PacketBufferView other)
+   {
+      std::swap(slot, other.slot);
+      std::swap(ptr, other.ptr);
+      std::swap(n, other.n);
+      return *this;
+   }
+
+   ~PacketBufferView()
+   {
+      unpin();
+   }
+
+   static PacketBufferView copyOf(const T* data, size_t size)
+   {
+      auto copy = std::make_shared<PacketBufferSlot<T>>();
+      copy->events.assign(data, data + size);
+      return PacketBufferView(std::move(copy), size);
+   }
+
+   PacketBufferView subView(size_t offset, size_t size) const
+   {
+      PacketBufferView view(*this);
+      view.ptr += offset;
+      view.n = size;
+      return view;
+   }
+
+   const T* data() const { return ptr; }
+   size_t size() const { return n; }
+   bool empty() const { return n == 0; }
+
+   const T* begin() const { return ptr; }
+   const T* end() const { return ptr + n; }
+   const T& operator[](size_t i) const { return ptr[i]; }
+
+private:
+
+   PacketBufferView(std::shared_ptr<PacketBufferSlot<T>> slot_, size_t n) :
+      slot(std::move(slot_)), ptr(slot->events.data()), n(n)
+   {
+      pin();
+   }
+
+   void pin()
+   {
+      if (slot)
+         slot->pins.fetch_add(1, std::memory_order_acq_rel);
+   }
+
+   void unpin()
+   {
+      if (slot)
+         slot->pins.fetch_sub(1, std::memory_order_release);
+      slot.reset();
+   }
+
+   std::shared_ptr<PacketBufferSlot<T>> slot;
+   const T* ptr = nullptr;
+   size_t n = 0;
+
+   friend class PacketBuffer<T>;
+};
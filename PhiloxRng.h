@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PHILOX_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+   Philox4x32-10 counter-based random number generator (Salmon et al.,
+   "Parallel random numbers: as easy as 1, 2, 3", SC'11).
+
+   Each (key, counter) pair maps to four independent 32-bit words, so any
+   part of a sequence can be generated directly from its index, in any
+   order and on any thread. Here the 128-bit counter is split into a
+   64-bit stream index and a 64-bit block index within the stream.
+*/
+class PhiloxRng
+{
+public:
+
+   PhiloxRng(uint64_t seed = 0) :
+      key0((uint32_t) seed),
+      key1((uint32_t) (seed >> 32))
+   {}
+
+   // Writes 4 * n_blocks words for blocks [first_block, first_block + n_blocks) of stream
+   void fill(uint64_t stream, uint64_t first_block, uint32_t* out, size_t n_blocks) const
+   {
+      size_t b = 0;
+
+#ifdef PHILOX_SSE2
+      for (; b + 4 <= n_blocks; b += 4)
+         generate4(stream, first_block + b, out + 4 * b);
+#endif
+
+      for (; b < n_blocks; b++)
+         generate(stream, first_block + b, out + 4 * b);
+   }
+
+   void generate(uint64_t stream, uint64_t block, uint32_t* out) const
+   {
+      uint32_t c0 = (uint32_t) block, c1 = (uint32_t) (block >> 32);
+      uint32_t c2 = (uint32_t) stream, c3 = (uint32_t) (stream >> 32);
+      uint32_t k0 = key0, k1 = key1;
+
+      for (int r = 0; r < n_rounds; r++)
+      {
+         uint64_t p0 = (uint64_t) m0 * c0;
+         uint64_t p1 = (uint64_t) m1 * c2;
+
+         uint32_t n0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+         uint32_t n2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+         c1 = (uint32_t) p1;
+         c3 = (uint32_t) p0;
+         c0 = n0;
+         c2 = n2;
+
+         k0 += w0;
+         k1 += w1;
+      }
+
+      out[0] = c0;
+      out[1] = c1;
+      out[2] = c2;
+      out[3] = c3;
+   }
+
+private:
+
+#ifdef PHILOX_SSE2
+   // Four consecutive blocks, one per lane
+   void generate4(uint64_t stream, uint64_t block, uint32_t* out) const
+   {
+      uint32_t lo[4], hi[4];
+      for (int i = 0; i < 4; i++)
+      {
+         lo[i] = (uint32_t) (block + i);
+         hi[i] = (uint32_t) ((block + i) >> 32);
+      }
+
+      __m128i c0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo));
+      __m128i c1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hi));
+      __m128i c2 = _mm_set1_epi32((int) (uint32_t) stream);
+      __m128i c3 = _mm_set1_epi32((int) (uint32_t) (stream >> 32));
+      __m128i k0 = _mm_set1_epi32((int) key0);
+      __m128i k1 = _mm_set1_epi32((int) key1);
+
+      const __m128i vm0 = _mm_set1_epi32((int) m0);
+      const __m128i vm1 = _mm_set1_epi32((int) m1);
+      const __m128i vw0 = _mm_set1_epi32((int) w0);
+      const __m128i vw1 = _mm_set1_epi32((int) w1);
+
+      for (int r = 0; r < n_rounds; r++)
+      {
+         __m128i hi0, lo0, hi1, lo1;
+         mulhilo(c0, vm0, hi0, lo0);
+         mulhilo(c2, vm1, hi1, lo1);
+
+         c0 = _mm_xor_si128(_mm_xor_si128(hi1, c1), k0);
+         c2 = _mm_xor_si128(_mm_xor_si128(hi0, c3), k1);
+         c1 = lo1;
+         c3 = lo0;
+
+         k0 = _mm_add_epi32(k0, vw0);
+         k1 = _mm_add_epi32(k1, vw1);
+      }
+
+      // Transpose so that each block's four words are contiguous
+      __m128i t0 = _mm_unpacklo_epi32(c0, c1);
+      __m128i t1 = _mm_unpacklo_epi32(c2, c3);
+      __m128i t2 = _mm_unpackhi_epi32(c0, c1);
+      __m128i t3 = _mm_unpackhi_epi32(c2, c3);
+
+      __m128i* dst = reinterpret_cast<__m128i*>(out);
+      _mm_storeu_si128(dst + 0, _mm_unpacklo_epi64(t0, t1));
+      _mm_storeu_si128(dst + 1, _mm_unpackhi_epi64(t0, t1));
+      _mm_storeu_si128(dst + 2, _mm_unpacklo_epi64(t2, t3));
+      _mm_storeu_si128(dst + 3, _mm_unpackhi_epi64(t2, t3));
+   }
+
+   // 32 x 32 -> 64 bit multiply of each lane, split into high and low words
+   static void mulhilo(__m128i a, __m128i m, __m128i& hi, __m128i& lo)
+   {
+      const __m128i low_mask = _mm_set1_epi64x(0xFFFFFFFF);
+
+      __m128i p02 = _mm_mul_epu32(a, m);
+      __m128i p13 = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);
+
+      lo = _mm_or_si128(_mm_and_si128(p02, low_mask), _mm_slli_epi64(p13, 32));
+      hi = _mm_or_si128(_mm_srli_epi64(p02, 32), _mm_andnot_si128(low_mask, p13));
+   }
+#endif
+
+   static const int n_rounds = 10;
+   static const uint32_t m0 = 0xD2511F53;
+   static const uint32_t m1 = 0xCD9E8D57;
+   static const uint32_t w0 = 0x9E3779B9;
+   static const uint32_t w1 = 0xBB67AE85;
+
+   uint32_t key0;
+   uint32_t key1;
+};
@@ -0,0 +1,154 @@
+#include "ReplayTcspc.h"
+
+#include <thread>
+#include <algorithm>
+#include <iostream>
+
+ReplayTcspc::ReplayTcspc(QObject* parent, const QString& filename) :
+   FifoTcspc(FlimStatus({ "SYNC" }, {"FIFO Buffer", "Host Buffer"}), parent)
+{
+   openFile(filename);
+
+   processor = createEventProcessor<ReplayTcspc>(this, 1000, 2000);
+   startThread();
+}
+
+void ReplayTcspc::openFile(const QString& filename)
+{
+   // The reader thread may be reading from the current file
+   if (scanning)
+   {
+      pending_file_name = filename;
+      file_pending = true;
+      return;
+   }
+
+   openReader(filename);
+}
+
+void ReplayTcspc::openReader(const QString& filename)
+{
+   file_name = filename;
+   reader.reset();
+
+   if (filename.isEmpty())
+      return;
+
+   try
+   {
+      reader.reset(new FlimFileReader(filename, false));
+   }
+   catch (std::runtime_error e)
+   {
+      std::cout << "Error opening file to replay" << std::endl;
+      std::cout << e.what() << std::endl;
+   }
+
+   flim_status.rates["SYNC"] = getSyncRateHz();
+}
+
+void ReplayTcspc::startModule()
+{
+   if (file_pending)
+   {
+      file_pending = false;
+      openReader(pending_file_name);
+   }
+
+   if (reader)
+      reader->rewind();
+
+   staged.clear();
+   staged_pos = 0;
+   macro_time_offset = 0;
+   have_first_macro_time = false;
+   finished = false;
+   start_time = Clock::now();
+
+   flim_status.rates["SYNC"] = getSyncRateHz();
+   flim_status.warnings["FIFO Buffer"] = FlimWarning(OK);
+}
+
+size_t ReplayTcspc::readPackets(std::vector<TcspcEvent>& buffer, double buffer_fill_factor)
+{
+   FlimWarningStatus buffer_status = OK;
+
+   if (buffer_fill_factor > 0.8)
+      buffer_status = Critical;
+   else if (buffer_fill_factor > 0.5)
+      buffer_status = Warning;
+
+   flim_status.warnings["Host Buffer"] = FlimWarning(buffer_status);
+
+   if (staged_pos == staged.size())
+   {
+      if (reader && !finished)
+      {
+         staged.resize(buffer.size());
+         staged.resize(reader->readPackets(staged, buffer_fill_factor));
+         staged_pos = 0;
+
+         if (staged.empty())
+            finished = true;
+      }
+
+      // Nothing more to send, don't spin the reader thread
+      if (staged.empty())
+      {
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+         return 0;
+      }
+   }
+
+   if (replay_rate <= 0)
+   {
+      size_t n = std::min(buffer.size(), staged.size() - staged_pos);
+      std::copy(staged.begin() + staged_pos, staged.begin() + staged_pos + n, buffer.begin());
+      staged_pos += n;
+      return n;
+   }
+
+   double elapsed_ps = std::chrono::duration<double>(Clock::now() - start_time).count() * replay_rate * 1e12;
+   uint64_t due_macro_time = (uint64_t) (elapsed_ps / reader->getMacrotimeResolution());
+
+   size_t n = copyDueEvents(buffer.data(), buffer.size(), due_macro_time);
+
+   // Wait for the next event to fall due
+   if (n == 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+   return n;
+}
+
+size_t ReplayTcspc::copyDueEvents(TcspcEvent* buffer, size_t n, uint64_t due_macro_time)
+{
+   size_t idx = 0;
+
+   while (idx < n && staged_pos < staged.size())
+   {
+      const TcspcEvent& evt = staged[staged_pos];
+
+      if (evt.isMacroTimeRollover())
+      {
+         macro_time_offset += ((uint64_t) evt.macro_time) << 16;
+      }
+      else
+      {
+         // Time is measured from the first event in the file
+         uint64_t macro_time = macro_time_offset + evt.macro_time;
+         if (!have_first_macro_time)
+         {
+            first_macro_time = macro_time;
+            have_first_macro_time = true;
+         }
+
+         if (macro_time - first_macro_time > due_macro_time)
+            break;
+      }
+
+      buffer[idx++] = evt;
+      staged_pos++;
+   }
+
+   return idx;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "FifoTcspc.h"
+#include "FlimFileReader.h"
+#include <memory>
+#include <atomic>
+#include <chrono>
+
+
+/*
+   Replays a recorded FFD file as if it were coming from the card, to
+   reproduce acquisitions offline or load consumers realistically.
+
+   Events are handed out at the pace of their macro times scaled by
+   ReplayRate (1 for real time, 2 for twice as fast), or as fast as the
+   processor takes them if ReplayRate is 0. The file is set with the
+   "File" parameter; acquisition parameters and the sync rate come from
+   its header. It is replayed from the start each time the FIFO is
+   started, and the stream goes quiet at its end.
+*/
+class ReplayTcspc : public FifoTcspc
+{
+   Q_OBJECT
+
+public:
+   ReplayTcspc(QObject* parent, const QString& filename = "");
+
+   size_t readPackets(std::vector<TcspcEvent>& buffer, double buffer_fill_factor);
+
+   double getSyncRateHz() { return reader ? reader->getSyncRateHz() : 0; }
+
+   TcspcAcquisitionParameters getAcquisitionParameters()
+   {
+      if (!reader)
+         return TcspcAcquisitionParameters{ 1, 1, 1, 1 };
+
+      return TcspcAcquisitionParameters{
+         reader->getMicrotimeResolution(),
+         reader->getMacrotimeResolution(),
+         reader->getNumTimebins(),
+         reader->getNumChannels(),
+      };
+   }
+
+   bool usingPixelMarkers() { return reader ? reader->usingPixelMarkers() : false; }
+
+   const QString describe()
+   {
+      if (reader && !reader->getTcspcSystem().empty())
+         return QString("Replay of %1 (%2)").arg(file_name).arg(QString::fromStdString(reader->getTcspcSystem()));
+      return QString("Replay of %1").arg(file_name);
+   }
+
+   // True once every event in the file has been read
+   bool isFinished() { return finished; }
+
+   void setParameter(const QString& parameter, ParameterType type, QVariant value)
+   {
+      if (parameter == "File")
+         openFile(value.toString());
+      if (parameter == "ReplayRate")
+         replay_rate = value.toDouble();
+   };
+
+   QVariant getParameter(const QString& parameter, ParameterType type)
+   {
+      if (parameter == "File")
+         return file_name;
+      if (parameter == "ReplayRate")
+         return replay_rate;
+
+      return QVariant();
+   };
+
+   QVariant getParameterLimit(const QString& parameter, ParameterType type, Limit limit)
+   {
+      if (limit == Limit::Min)
+         return 0;
+      else if (parameter == "ReplayRate")
+         return 1e3;
+
+      return QVariant();
+   };
+
+private:
+
+   void openFile(const QString& filename);
+   void openReader(const QString& filename);
+
+   void startModule();
+   void configureModule() {};
+
+   // Copy events from the staging buffer which are due by due_macro_time
+   size_t copyDueEvents(TcspcEvent* buffer, size_t n, uint64_t due_macro_time);
+
+   typedef std::chrono::steady_clock Clock;
+
+   QString file_name;
+   std::unique_ptr<FlimFileReader> reader;
+
+   // A file chosen while scanning is opened when the next acquisition starts
+   QString pending_file_name;
+   bool file_pending = false;
+
+   double replay_rate = 1;
+   std::atomic<bool> finished = { false };
+
+   // Events read from the file but not yet handed out
+   std::vector<TcspcEvent> staged;
+   size_t staged_pos = 0;
+
+   // Absolute macro time tracking for pacing
+   uint64_t macro_time_offset = 0;
+   uint64_t first_macro_time = 0;
+   bool have_first_macro_time = false;
+   Clock::time_point start_time;
+};
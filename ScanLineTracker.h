@@ -0,0 +1,144 @@
+#pragma once
+
+#include "TcspcEvent.h"
+#include <cstdint>
+
+/*
+   A scan line as placed in the image by ScanLineTracker.
+*/
+struct ScanLine
+{
+   int y = -1;
+   int n_x = 0;
+   uint64_t start_time = 0;
+   uint64_t x_scale = 0;
+   bool reverse = false;
+
+   // False if photons in the line can't be placed: before the first frame,
+   // below the image, or for time based x before a line has been timed
+   bool counting = false;
+
+   // x from the time since the line started, for time based x
+   int timeToX(uint64_t macro_time) const
+   {
+      return (int) (((macro_time - start_time) * x_scale) >> 32);
+   }
+
+   // Image column of x, or -1 if x lies outside the line
+   int column(int x) const
+   {
+      if ((unsigned) x >= (unsigned) n_x)
+         return -1;
+      return reverse ? n_x - 1 - x : x;
+   }
+};
+
+/*
+   Follows the raster scan through its line, frame and pixel markers, for
+   the consumers building images from the event stream.
+
+   Lines are counted from each frame marker. Within a line, x is either
+   advanced by pixel markers or computed from the time since the line
+   started, using the duration of the last complete line. With
+   bidirectional scanning every other line runs backwards.
+
+   processMarker handles one marker word, which can carry several marks,
+   and calls back in scan order:
+      end_line()                  the line ends, or a frame or line starts
+      frame_completed(bool image) a frame ends, before frameIndex() moves
+                                  on; image if the marker also ends an image
+      start_line(const ScanLine&) a line starts
+      next_pixel()                a pixel marker, when using pixel markers
+*/
+class ScanLineTracker
+{
+public:
+
+   void reset(int n_x_, int n_y_, bool bidirectional_, bool using_pixel_markers_)
+   {
+      n_x = n_x_;
+      n_y = n_y_;
+      bidirectional = bidirectional_;
+      using_pixel_markers = using_pixel_markers_;
+
+      frame_idx = -1;
+      cur_y = -1;
+      line_active = false;
+      line_start_time = 0;
+      line_duration = 0;
+      x_scale = 0;
+   }
+
+   // -1 until the first frame marker
+   int64_t frameIndex() const { return frame_idx; }
+
+   // Don't time the current line, e.g. as the stream ends part way through it
+   void abandonLine() { line_active = false; }
+
+   template<class EndLine, class FrameCompleted, class StartLine, class NextPixel>
+   void processMarker(uint8_t mark, uint64_t macro_time, EndLine end_line, FrameCompleted frame_completed, StartLine start_line, NextPixel next_pixel)
+   {
+      // End the last line before starting a frame or a new line
+      if ((mark & TcspcEvent::LineEndMarker) && line_active)
+      {
+         uint64_t this_line_duration = macro_time - line_start_time;
+         if (this_line_duration > 0)
+         {
+            line_duration = this_line_duration;
+            x_scale = ((uint64_t) n_x << 32) / line_duration;
+         }
+
+         line_active = false;
+         end_line();
+      }
+
+      if (mark & TcspcEvent::FrameMarker)
+      {
+         line_active = false;
+         end_line();
+
+         if (frame_idx >= 0)
+            frame_completed((mark & TcspcEvent::ImageMarker) != 0);
+
+         frame_idx++;
+         cur_y = -1;
+      }
+
+      if (mark & TcspcEvent::LineStartMarker)
+      {
+         end_line();
+
+         cur_y++;
+         line_active = true;
+         line_start_time = macro_time;
+
+         ScanLine line;
+         line.y = cur_y;
+         line.n_x = n_x;
+         line.start_time = macro_time;
+         line.x_scale = x_scale;
+         line.reverse = bidirectional && (cur_y % 2 == 1);
+         line.counting = (frame_idx >= 0) && (cur_y < n_y) && (using_pixel_markers || line_duration > 0);
+         start_line(line);
+      }
+
+      if ((mark & TcspcEvent::PixelMarker) && using_pixel_markers)
+         next_pixel();
+   }
+
+private:
+
+   int n_x = 0;
+   int n_y = 0;
+   bool bidirectional = false;
+   bool using_pixel_markers = false;
+
+   int64_t frame_idx = -1;
+   int cur_y = -1;
+   bool line_active = false;
+   uint64_t line_start_time = 0;
+   uint64_t line_duration = 0;
+
+   // x = ((t - line_start_time) * x_scale) >> 32 when not using pixel markers
+   uint64_t x_scale = 0;
+};
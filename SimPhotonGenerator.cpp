@@ -0,0 +1,228 @@
+#include "SimPhotonGenerator.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+   const double pi = 3.141592653589793238463;
+
+   const int table_bits = 16;
+   const size_t table_size = 1 << table_bits;
+
+   // The first two random words of each pixel set the photon count
+   const size_t count_words = 2;
+   const size_t max_batch_blocks = 4;
+
+   double normalCdf(double z)
+   {
+      return 0.5 * std::erfc(-z / std::sqrt(2.0));
+   }
+
+   // CDF of an exponential with lifetime tau convolved with N(mu, sigma)
+   double exGaussianCdf(double x, double tau, double mu, double sigma)
+   {
+      double z = (x - mu) / sigma;
+      double lambda_sigma = sigma / tau;
+      double tail = std::exp(-(x - mu) / tau + 0.5 * lambda_sigma * lambda_sigma) * normalCdf(z - lambda_sigma);
+      return normalCdf(z) - tail;
+   }
+
+   // Largest mean sampled exactly, and the search limit there; above
+   // this the normal approximation is used
+   const double max_search_mean = 1024;
+   const size_t max_search_count = 2048;
+
+   // 1/n, to keep divisions out of the Poisson search
+   struct ReciprocalTable
+   {
+      ReciprocalTable()
+      {
+         for (size_t n = 1; n <= max_search_count; n++)
+            r[n] = 1.0 / n;
+      }
+
+      double r[max_search_count + 1];
+   };
+
+   const ReciprocalTable reciprocal;
+
+   double uniform(uint32_t u)
+   {
+      return (u + 0.5) * (1.0 / 4294967296.0);
+   }
+}
+
+void SimPhotonGenerator::setDecayModel(double period_ps, int n_bins, const std::vector<SimScenario::Channel>& channels)
+{
+   size_t n_chan = channels.size();
+   micro_table.resize(table_size);
+
+   std::vector<double> cdf(n_bins);
+   for (size_t c = 0; c < n_chan; c++)
+   {
+      const auto& channel = channels[c];
+      std::vector<double> p(n_bins, 0.0);
+
+      double fraction_total = 0;
+      for (auto& component : channel.components)
+         fraction_total += component.fraction;
+
+      for (auto& component : channel.components)
+      {
+         double tau = component.tau_ps;
+         double fraction = component.fraction / fraction_total;
+
+         // Fold the decay back into one period until the tail is negligible
+         int n_periods = (int) std::ceil((channel.irf_mean_ps + 10 * channel.irf_sigma_ps + 40 * tau) / period_ps) + 1;
+
+         for (int k = 0; k < n_periods; k++)
+         {
+            double last = exGaussianCdf(k * period_ps, tau, channel.irf_mean_ps, channel.irf_sigma_ps);
+            for (int b = 0; b < n_bins; b++)
+            {
+               double next = exGaussianCdf((k + (b + 1.0) / n_bins) * period_ps, tau, channel.irf_mean_ps, channel.irf_sigma_ps);
+               p[b] += fraction * (next - last);
+               last = next;
+            }
+         }
+      }
+
+      double total = 0;
+      for (int b = 0; b < n_bins; b++)
+      {
+         total += std::max(p[b], 0.0);
+         cdf[b] = total;
+      }
+
+      // Table entries are split evenly between channels; entry j of
+      // channel c samples the quantile u within the channel's decay
+      size_t first = (c * table_size + n_chan - 1) / n_chan;
+      size_t last = ((c + 1) * table_size + n_chan - 1) / n_chan;
+      int b = 0;
+      for (size_t j = first; j < last; j++)
+      {
+         double u = (j * n_chan - c * table_size + 0.5 * n_chan) / table_size * total;
+         while (b < n_bins - 1 && cdf[b] <= u)
+            b++;
+         micro_table[j] = (uint16_t) ((b << 4) | c);
+      }
+   }
+}
+
+SimPhotonGenerator::Rate SimPhotonGenerator::makeRate(double mean)
+{
+   Rate rate = { mean, (mean > 0) ? 1.0 / mean : 0.0, 0, 1.0, 1.0 };
+
+   if (mean <= 0 || mean > max_search_mean)
+      return rate;
+
+   rate.mode = (size_t) mean;
+   rate.p_mode = std::exp(rate.mode * std::log(mean) - mean - std::lgamma(rate.mode + 1.0));
+
+   double p = rate.p_mode;
+   double cdf = p;
+   for (size_t n = rate.mode; n > 0 && p > 1e-20 * cdf; n--)
+   {
+      p *= n * rate.inv_mean;
+      cdf += p;
+   }
+   rate.cdf_mode = cdf;
+
+   return rate;
+}
+
+size_t SimPhotonGenerator::samplePhotonCount(const Rate& rate, uint32_t u0, uint32_t u1) const
+{
+   if (rate.mean > max_search_mean)
+   {
+      // Normal approximation, by Box-Muller
+      double z = std::sqrt(-2.0 * std::log(uniform(u0))) * std::cos(2.0 * pi * uniform(u1));
+      double n = std::floor(rate.mean + std::sqrt(rate.mean) * z + 0.5);
+      return (n > 0) ? (size_t) n : 0;
+   }
+
+   // Inverse CDF, searching from the mode for the smallest n with u <= P(n)
+   double u = uniform(u0);
+   double p = rate.p_mode;
+   double cdf = rate.cdf_mode;
+   size_t n = rate.mode;
+
+   if (u > cdf)
+   {
+      while (u > cdf && n < max_search_count)
+      {
+         n++;
+         p *= rate.mean * reciprocal.r[n];
+         cdf += p;
+      }
+   }
+   else
+   {
+      while (n > 0 && u <= cdf - p)
+      {
+         cdf -= p;
+         p *= n * rate.inv_mean;
+         n--;
+      }
+   }
+   return n;
+}
+
+size_t SimPhotonGenerator::samplePixel(uint64_t pixel_seq, const Rate& rate, std::vector<uint16_t>& micro_words) const
+{
+   // Draw the first block to find the photon count, then only as many
+   // further blocks as the photons need, two per 32-bit word
+   uint32_t words[4 * max_batch_blocks];
+   rng.generate(pixel_seq, 0, words);
+
+   size_t n = samplePhotonCount(rate, words[0], words[1]);
+
+   // Photons are written in pairs, so allow for one past the end
+   if (micro_words.size() < n + 1)
+      micro_words.resize(n + 1);
+
+   const uint16_t* table = micro_table.data();
+   uint16_t* out = micro_words.data();
+
+   size_t i = 0;
+   for (size_t w = count_words; w < 4 && i < n; w++, i += 2)
+   {
+      out[i] = table[words[w] & 0xFFFF];
+      out[i + 1] = table[words[w] >> 16];
+   }
+
+   uint64_t block = 1;
+   while (i < n)
+   {
+      size_t n_blocks = std::min((n - i + 7) / 8, max_batch_blocks);
+      rng.fill(pixel_seq, block, words, n_blocks);
+      block += n_blocks;
+
+      for (size_t w = 0; w < 4 * n_blocks && i < n; w++, i += 2)
+      {
+         out[i] = table[words[w] & 0xFFFF];
+         out[i + 1] = table[words[w] >> 16];
+      }
+   }
+
+   return n;
+}
+
+void SimPhotonGenerator::sampleArrivals(uint64_t pixel_seq, size_t n, uint32_t n_periods, uint32_t* periods) const
+{
+   // Separate stream index so the draws don't overlap samplePixel's
+   uint64_t stream = pixel_seq | (1ull << 63);
+   uint32_t words[4 * max_batch_blocks];
+
+   uint64_t block = 0;
+   size_t i = 0;
+   while (i < n)
+   {
+      size_t n_blocks = std::min((n - i + 3) / 4, max_batch_blocks);
+      rng.fill(stream, block, words, n_blocks);
+      block += n_blocks;
+
+      for (size_t w = 0; w < 4 * n_blocks && i < n; w++)
+         periods[i++] = (uint32_t) (((uint64_t) words[w] * n_periods) >> 32);
+   }
+}
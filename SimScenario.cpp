@@ -0,0 +1,176 @@
+#include "SimScenario.h"
+
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+SimScenario::SimScenario()
+{
+   Channel channel;
+   channel.components.push_back({ 3000, 1.0 });
+   channels.push_back(channel);
+}
+
+SimScenario SimScenario::load(const QString& filename)
+{
+   QFile file(filename);
+   if (!file.open(QIODevice::ReadOnly))
+      throw std::runtime_error("Could not open scenario file: " + filename.toStdString());
+
+   return fromJson(file.readAll());
+}
+
+SimScenario SimScenario::fromJson(const QByteArray& json)
+{
+   QJsonParseError error;
+   QJsonDocument doc = QJsonDocument::fromJson(json, &error);
+   if (doc.isNull() || !doc.isObject())
+      throw std::runtime_error("Invalid scenario file: " + error.errorString().toStdString());
+
+   QJsonObject obj = doc.object();
+   SimScenario s;
+
+   s.laser_period_ps = obj["laser_period_ps"].toDouble(s.laser_period_ps);
+   s.line_rate_hz = obj["line_rate_hz"].toDouble(s.line_rate_hz);
+   s.line_flyback = obj["line_flyback"].toDouble(s.line_flyback);
+
+   s.photons_per_count = obj["photons_per_count"].toDouble(s.photons_per_count);
+   s.background_photons = obj["background_photons"].toDouble(s.background_photons);
+
+   for (auto p : obj["rate_profile"].toArray())
+   {
+      QJsonArray point = p.toArray();
+      if (point.size() != 2)
+         throw std::runtime_error("rate_profile entries must be [time_s, scale]");
+      s.rate_profile.push_back({ point[0].toDouble(), point[1].toDouble() });
+   }
+   std::sort(s.rate_profile.begin(), s.rate_profile.end());
+
+   for (auto b : obj["bursts"].toArray())
+   {
+      QJsonObject burst = b.toObject();
+      s.bursts.push_back({ burst["start_s"].toDouble(), burst["duration_s"].toDouble(),
+                           burst["period_s"].toDouble(0), burst["scale"].toDouble(1) });
+   }
+
+   if (obj.contains("channels"))
+   {
+      s.channels.clear();
+      for (auto c : obj["channels"].toArray())
+      {
+         QJsonObject ch = c.toObject();
+         Channel channel;
+         channel.irf_mean_ps = ch["irf_mean_ps"].toDouble(channel.irf_mean_ps);
+         channel.irf_sigma_ps = ch["irf_sigma_ps"].toDouble(channel.irf_sigma_ps);
+
+         double total_fraction = 0;
+         for (auto d : ch["components"].toArray())
+         {
+            QJsonObject component = d.toObject();
+            double tau_ps = component["tau_ps"].toDouble(0);
+            double fraction = component["fraction"].toDouble(1);
+            if (tau_ps <= 0 || fraction < 0)
+               throw std::runtime_error("Decay components need a positive tau_ps and a fraction of at least zero");
+
+            channel.components.push_back({ tau_ps, fraction });
+            total_fraction += fraction;
+         }
+
+         if (channel.components.empty())
+            throw std::runtime_error("Scenario channels need at least one decay component");
+         if (total_fraction <= 0)
+            throw std::runtime_error("Decay component fractions must not all be zero");
+         if (channel.irf_sigma_ps <= 0)
+            throw std::runtime_error("irf_sigma_ps must be positive");
+         s.channels.push_back(channel);
+      }
+
+      // Channel 0xF is reserved for markers
+      if (s.channels.empty() || s.channels.size() > 15)
+         throw std::runtime_error("Scenario must have between 1 and 15 channels");
+   }
+
+   s.sync_jitter_ps = obj["sync_jitter_ps"].toDouble(s.sync_jitter_ps);
+
+   QString arrivals = obj["arrivals"].toString("even");
+   if (arrivals != "even" && arrivals != "random")
+      throw std::runtime_error("arrivals must be \"even\" or \"random\"");
+   s.random_arrivals = (arrivals == "random");
+   s.pile_up = obj["pile_up"].toBool(s.pile_up);
+   s.dead_time_ps = obj["dead_time_ps"].toDouble(s.dead_time_ps);
+
+   for (auto w : obj["fifo_overflows"].toArray())
+   {
+      QJsonObject window = w.toObject();
+      s.fifo_overflows.push_back({ window["start_s"].toDouble(), window["duration_s"].toDouble() });
+   }
+
+   s.start_macro_time = (uint64_t) obj["start_macro_time"].toDouble(0);
+
+   for (auto g : obj["frame_gaps"].toArray())
+   {
+      QJsonObject gap = g.toObject();
+      s.frame_gaps.push_back({ (uint64_t) gap["frame"].toDouble(), gap["duration_s"].toDouble() });
+   }
+
+   if (s.laser_period_ps <= 0 || s.line_rate_hz <= 0 || s.line_flyback < 0)
+      throw std::runtime_error("Scenario timing must be positive");
+   if (s.dead_time_ps < 0)
+      throw std::runtime_error("dead_time_ps must not be negative");
+
+   return s;
+}
+
+double SimScenario::rateScale(double time_s) const
+{
+   double scale = 1;
+
+   if (!rate_profile.empty())
+   {
+      auto next = std::lower_bound(rate_profile.begin(), rate_profile.end(), std::make_pair(time_s, -HUGE_VAL));
+      if (next == rate_profile.begin())
+         scale = next->second;
+      else if (next == rate_profile.end())
+         scale = rate_profile.back().second;
+      else
+      {
+         auto last = next - 1;
+         double f = (time_s - last->first) / (next->first - last->first);
+         scale = last->second + f * (next->second - last->second);
+      }
+   }
+
+   for (auto& b : bursts)
+   {
+      double t = time_s - b.start_s;
+      if (t < 0)
+         continue;
+      if (b.period_s > 0)
+         t = std::fmod(t, b.period_s);
+      if (t < b.duration_s)
+         scale *= b.scale;
+   }
+
+   return std::max(scale, 0.0);
+}
+
+bool SimScenario::inFifoOverflow(double time_s) const
+{
+   for (auto& w : fifo_overflows)
+      if (time_s >= w.start_s && time_s < w.start_s + w.duration_s)
+         return true;
+   return false;
+}
+
+double SimScenario::gapBeforeFrame(uint64_t frame) const
+{
+   double gap = 0;
+   for (auto& g : frame_gaps)
+      if (g.frame < frame)
+         gap += g.duration_s;
+   return gap;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <QString>
+#include <QByteArray>
+#include <vector>
+#include <cstdint>
+
+/*
+   Scripted acquisition conditions for SimTcspc, loaded from a JSON file.
+   Every field is optional; an empty scenario reproduces the built-in
+   simulation. Times are from the start of the acquisition. The comments
+   below are for illustration only.
+
+   {
+      "laser_period_ps": 12500,
+      "line_rate_hz": 1000,
+      "line_flyback": 2,                  // fraction of the line time
+
+      "photons_per_count": 0.04,          // photons per pixel per intensity image count
+      "background_photons": 1,            // photons per pixel added everywhere
+      "rate_profile": [ [0, 1], [10, 4] ],  // [time_s, scale], linear between points
+      "bursts": [ { "start_s": 2, "duration_s": 0.05, "period_s": 1, "scale": 20 } ],
+
+      "channels": [ { "components": [ { "tau_ps": 3000, "fraction": 0.7 },
+                                      { "tau_ps": 400, "fraction": 0.3 } ],
+                      "irf_mean_ps": 1000, "irf_sigma_ps": 100 } ],
+      "sync_jitter_ps": 0,
+
+      "arrivals": "even",                 // or "random", uniform over the laser periods of a pixel
+      "pile_up": false,                   // record only the first photon per channel per laser period
+      "dead_time_ps": 0,                  // per channel, from each recorded photon
+
+      "fifo_overflows": [ { "start_s": 1, "duration_s": 0.01 } ],  // drop events, flag "FIFO Buffer"
+      "start_macro_time": 0,              // e.g. 65530 to start just before a rollover
+      "frame_gaps": [ { "frame": 3, "duration_s": 10 } ]            // idle time after a frame
+   }
+
+   Bursts repeat every period_s if it is given. Gaps longer than about
+   4.3 s at 1 ns macro time resolution need several rollover words.
+*/
+class SimScenario
+{
+public:
+
+   struct DecayComponent
+   {
+      double tau_ps;
+      double fraction;
+   };
+
+   struct Channel
+   {
+      std::vector<DecayComponent> components;
+      double irf_mean_ps = 1000;
+      double irf_sigma_ps = 100;
+   };
+
+   struct Burst
+   {
+      double start_s;
+      double duration_s;
+      double period_s;
+      double scale;
+   };
+
+   struct TimeWindow
+   {
+      double start_s;
+      double duration_s;
+   };
+
+   struct FrameGap
+   {
+      uint64_t frame;
+      double duration_s;
+   };
+
+   SimScenario();
+
+   // Throw std::runtime_error if the scenario can't be read
+   static SimScenario load(const QString& filename);
+   static SimScenario fromJson(const QByteArray& json);
+
+   // Count rate multiplier from the rate profile and bursts
+   double rateScale(double time_s) const;
+   bool isVarying() const { return !rate_profile.empty() || !bursts.empty(); }
+
+   bool inFifoOverflow(double time_s) const;
+
+   // Total idle time inserted before the given frame
+   double gapBeforeFrame(uint64_t frame) const;
+
+   double laser_period_ps = 12500;
+   double line_rate_hz = 1000;
+   double line_flyback = 2;
+
+   double photons_per_count = 0.04;
+   double background_photons = 1;
+   std::vector<std::pair<double, double>> rate_profile;
+   std::vector<Burst> bursts;
+
+   std::vector<Channel> channels;
+   double sync_jitter_ps = 0;
+
+   bool random_arrivals = false;
+   bool pile_up = false;
+   double dead_time_ps = 0;
+
+   std::vector<TimeWindow> fifo_overflows;
+   uint64_t start_macro_time = 0;
+   std::vector<FrameGap> frame_gaps;
+};
@@ -1,12 +1,10 @@
 #include "SimTcspc.h"
 
-#include <QMessageBox>
-#include <QStandardPaths>
-#include <QFileDialog>
 #include <chrono>
 #include <cassert>
 #include <cmath>
-#include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <iostream>
 
@@ -15,14 +13,12 @@ using namespace std;
 const double PI = 3.141592653589793238463;
 
 SimTcspc::SimTcspc(QObject* parent) :
-   FifoTcspc(FlimStatus({ "SYNC" }, {"Host Buffer"}), parent)
+   FifoTcspc(FlimStatus({ "SYNC" }, {"FIFO Buffer", "Host Buffer"}), parent)
 {
-   time_resolution_ps = T / (1 << n_bits);
-
    markers = Markers{ 0x0, 0x1, 0x2, 0x4, 0x8 };
 
    loadIntensityImage();
-   configureSyncTiming();
+   applyScenario();
 
    processor = createEventProcessor<SimTcspc>(this, 1000, 2000);
    startThread();
@@ -49,19 +45,84 @@ void SimTcspc::loadIntensityImage()
    int i_px = std::min(intensity.size().width, intensity.size().height);
    n_px = i_px / 2;
    px_offset = i_px / 4;
-   cur_px = n_px;
-   cur_py = n_px;
+}
+
+void SimTcspc::loadScenario(const QString& filename)
+{
+   scenario_file = filename;
+
+   try
+   {
+      scenario = filename.isEmpty() ? SimScenario() : SimScenario::load(filename);
+   }
+   catch (std::runtime_error e)
+   {
+      std::cout << "Error loading simulation scenario" << std::endl;
+      std::cout << e.what() << std::endl;
+      scenario = SimScenario();
+   }
+
+   // Apply now unless lines are being generated, otherwise when the next acquisition starts.
+   // Lines queued before the last stop may still be running on the pool and
+   // read the rates and decay model, so let them finish first
+   if (scanning)
+   {
+      scenario_pending = true;
+   }
+   else
+   {
+      cancelPendingLines();
+      applyScenario();
+   }
+}
+
+void SimTcspc::applyScenario()
+{
+   T = scenario.laser_period_ps;
+   n_chan = (int) scenario.channels.size();
+   time_resolution_ps = T / (1 << n_bits);
+
+   computePixelRates();
+   configureSyncTiming();
+   configurePhotonGenerator();
+
+   scenario_pending = false;
+}
+
+void SimTcspc::computePixelRates()
+{
+   // Precompute the photon rate of each pixel for the Poisson sampler
+   pixel_rates.resize(intensity.total());
+   for (int y = 0; y < intensity.rows; y++)
+      for (int x = 0; x < intensity.cols; x++)
+         pixel_rates[y * intensity.cols + x] = SimPhotonGenerator::makeRate(scenario.background_photons + scenario.photons_per_count * intensity.at<uint16_t>(y, x));
+
+   background_rate = SimPhotonGenerator::makeRate(scenario.background_photons);
+}
+
+const SimPhotonGenerator::Rate& SimTcspc::pixelRate(int x, int y) const
+{
+   if (x < 0 || y < 0 || x >= intensity.cols || y >= intensity.rows)
+      return background_rate;
+   return pixel_rates[y * intensity.cols + x];
+}
+
+void SimTcspc::configurePhotonGenerator()
+{
+   // Gaussian sync jitter just broadens the IRF
+   auto channels = scenario.channels;
+   for (auto& channel : channels)
+      channel.irf_sigma_ps = std::sqrt(channel.irf_sigma_ps * channel.irf_sigma_ps + scenario.sync_jitter_ps * scenario.sync_jitter_ps);
+
+   photon_generator.setDecayModel(T, 1 << n_bits, channels);
 }
 
 void SimTcspc::configureSyncTiming()
 {
-   double line_rate_hz = 1000;
-   uint64_t line_flyback_time = 2; // as a fraction of line time
-   uint64_t frame_flyback_time = 1; // as a fraction of frame time
    double macro_unit = 1e12 / macro_resolution_ps; // convert s -> macro_resolution_unit
 
-   pixel_duration = macro_unit / (line_rate_hz * n_px);
-   inter_line_duration = pixel_duration * n_px * line_flyback_time;
+   pixel_duration = macro_unit / (scenario.line_rate_hz * n_px);
+   inter_line_duration = pixel_duration * n_px * scenario.line_flyback;
    inter_frame_duration = inter_line_duration;
 }
 
@@ -74,140 +135,291 @@ void SimTcspc::init()
 
 void SimTcspc::startModule()
 {
+   cancelPendingLines();
+
+   if (scenario_pending)
+      applyScenario();
+
+   if (n_generator_threads <= 0)
+      generator_pool.reset();
+   else if (!generator_pool || generator_pool->getNumThreads() != n_generator_threads)
+      generator_pool.reset(new WorkerPool(n_generator_threads));
+
+   photon_generator.setSeed(seed);
+
    macro_time_rollovers = 0;
-   cur_macro_time = 0;
-   cur_px = n_px;
-   cur_py = n_px;
-   gen_frame = -1;
+   cur_line = LineChunk();
+   cur_line_pos = 0;
+   next_line_idx = 0;
 
-   flim_status.rates["SYNC"] = 80e6;
+   flim_status.rates["SYNC"] = getSyncRateHz();
+   flim_status.warnings["FIFO Buffer"] = FlimWarning(OK);
 }
 
 SimTcspc::~SimTcspc()
 {
+   // Queued lines read the image and rates, so finish them first
+   cancelPendingLines();
+   generator_pool.reset();
 }
 
-void SimTcspc::addEvent(uint64_t macro_time, uint32_t micro_time, uint8_t channel, uint8_t mark, std::vector<TcspcEvent>& buffer, int& idx)
+void SimTcspc::cancelPendingLines()
 {
-   uint64_t new_macro_time_rollovers = macro_time / (1 << 16);
-   uint64_t rollover_max = 0xFFFF;
+   for (auto& line : pending_lines)
+      line.wait();
+   pending_lines.clear();
+}
 
-   while ((idx + new_macro_time_rollovers - macro_time_rollovers) > buffer.size())
-      buffer.resize(buffer.size() * 2);
+void SimTcspc::addEvent(uint64_t macro_time, uint16_t micro_time_word, LineChunk& chunk)
+{
+   uint64_t epoch = macro_time >> 16;
+   uint64_t rollover_max = 0xFFFF;
 
-   while (new_macro_time_rollovers > macro_time_rollovers)
+   while (epoch > chunk.last_epoch)
    {
-      uint16_t r = (uint16_t)std::min(new_macro_time_rollovers - macro_time_rollovers, rollover_max);
-      buffer[idx++] = { r, 0xF };
-      macro_time_rollovers += r;
+      uint16_t r = (uint16_t)std::min(epoch - chunk.last_epoch, rollover_max);
+      chunk.events.push_back({ r, 0xF });
+      chunk.last_epoch += r;
    }
 
-   TcspcEvent evt;
-   evt.macro_time = macro_time & 0xFFFF;
-   if (mark != 0)
-      evt.micro_time = 0xF | (mark << 4);
-   else
-      evt.micro_time = channel | (micro_time << 4);
+   chunk.events.push_back({ (uint16_t) macro_time, micro_time_word });
+}
 
-   buffer[idx++] = evt;
+uint64_t SimTcspc::lineStart(uint64_t line_idx) const
+{
+   uint64_t frame = line_idx / n_px;
+   int line = line_idx % n_px;
 
-}
+   uint64_t line_duration = (uint64_t) n_px * pixel_duration + inter_line_duration;
+   uint64_t frame_duration = n_px * line_duration + inter_frame_duration;
+   uint64_t gap = (uint64_t) (scenario.gapBeforeFrame(frame) * 1e12 / macro_resolution_ps);
 
+   return scenario.start_macro_time + frame * frame_duration + line * line_duration + gap;
+}
 
-size_t SimTcspc::readPackets(std::vector<TcspcEvent>& buffer, double buffer_fill_factor)
+SimTcspc::LineChunk SimTcspc::generateLine(uint64_t line_idx) const
 {
+   uint64_t frame = line_idx / n_px;
+   int line = line_idx % n_px;
 
-   size_t buffer_length = buffer.size();
+   // The previous line ends right after its last pixel
+   uint64_t line_start = lineStart(line_idx);
+   uint64_t first_time = (line_idx > 0) ? lineStart(line_idx - 1) + (uint64_t) n_px * pixel_duration : line_start;
 
-   int idx = 0;
+   LineChunk chunk;
+   chunk.first_epoch = chunk.last_epoch = first_time >> 16;
 
-   FlimWarningStatus buffer_status = OK;
+   double seconds_per_macro = macro_resolution_ps * 1e-12;
+   bool has_overflows = !scenario.fifo_overflows.empty();
 
-   if (buffer_fill_factor > 0.8)
-      buffer_status = Critical;
-   else if (buffer_fill_factor > 0.5)
-      buffer_status = Warning;
+   auto inOverflow = [&](uint64_t macro_time)
+   {
+      if (!has_overflows || !scenario.inFifoOverflow(macro_time * seconds_per_macro))
+         return false;
+      chunk.fifo_overflow = true;
+      return true;
+   };
 
-   flim_status.warnings["Host Buffer"] = FlimWarning(buffer_status);
+   auto addMarker = [&](uint64_t macro_time, uint8_t mark)
+   {
+      if (!inOverflow(macro_time))
+         addEvent(macro_time, markerWord(mark), chunk);
+   };
+
+   if (line_idx > 0)
+      addMarker(first_time, markers.LineEndMarker);
+   if (line == 0)
+      addMarker(line_start, markers.FrameMarker);
+   addMarker(line_start, markers.LineStartMarker);
+
+   bool simple_arrivals = !scenario.random_arrivals && !scenario.pile_up && scenario.dead_time_ps == 0;
 
-   do
+   double approx_frame_time = n_px * (n_px * pixel_duration + inter_line_duration);
+   std::vector<uint16_t> micro_words;
+   std::vector<uint32_t> periods;
+   std::vector<double> last_detection_ps(n_chan, -HUGE_VAL);
+
+   for (int px = 0; px < n_px; px++)
    {
-      // start new line?
-      if (cur_px == n_px)
+      uint64_t pixel_start = line_start + (uint64_t) px * pixel_duration;
+
+      if (inOverflow(pixel_start))
+         continue;
+
+      int xsel = px + px_offset;
+      int ysel = line + px_offset;
+
+      if (displacement_amplitude != 0 && frame > 0)
       {
-         cur_px = 0;
+         double theta = pixel_start / approx_frame_time * displacement_frequency * 2.0 * PI;
+         xsel += cos(PI / 180.0 * displacement_angle) * displacement_amplitude * sin(theta);
+         ysel += sin(PI / 180.0 * displacement_angle) * displacement_amplitude * cos(theta);
+      }
 
-         // start new frame?
-         if (cur_py >= (n_px - 1))
-         {
-            cur_py = 0;
-            if (gen_frame >= 0)
-            {
-               addEvent(cur_macro_time, 0, 0, markers.LineEndMarker, buffer, idx);
-               cur_macro_time += inter_line_duration + inter_frame_duration;
-            }
+      const SimPhotonGenerator::Rate* rate = &pixelRate(xsel, ysel);
 
-            addEvent(cur_macro_time, 0, 0, markers.FrameMarker, buffer, idx);
-            addEvent(cur_macro_time, 0, 0, markers.LineStartMarker, buffer, idx);
-            gen_frame++;
+      SimPhotonGenerator::Rate scaled_rate;
+      if (scenario.isVarying())
+      {
+         double scale = scenario.rateScale(pixel_start * seconds_per_macro);
+         if (scale != 1)
+         {
+            scaled_rate = SimPhotonGenerator::makeRate(rate->mean * scale);
+            rate = &scaled_rate;
          }
-         else
+      }
+
+      uint64_t pixel_seq = line_idx * n_px + px;
+      size_t n = photon_generator.samplePixel(pixel_seq, *rate, micro_words);
+
+      if (n == 0)
+         continue;
+
+      if (!simple_arrivals)
+      {
+         addPhotons(pixel_seq, pixel_start, micro_words.data(), n, periods, last_detection_ps, chunk);
+      }
+      // Space photons evenly across the pixel, stepping macro_time = pixel_start + (i * pixel_duration) / n
+      // without a division per photon. If no rollover falls within the pixel the events can be written directly
+      else if (((pixel_start + pixel_duration) >> 16) == chunk.last_epoch)
+      {
+         uint64_t step = pixel_duration / n;
+         uint64_t remainder = pixel_duration % n;
+         uint64_t acc = 0;
+         uint64_t macro_time = pixel_start;
+
+         size_t idx = chunk.events.size();
+         chunk.events.resize(idx + n);
+         TcspcEvent* evts = chunk.events.data() + idx;
+
+         for (size_t i = 0; i < n; i++)
          {
-            cur_py++;
-            addEvent(cur_macro_time, 0, 0, markers.LineEndMarker, buffer, idx);
-            cur_macro_time += inter_line_duration;
-            addEvent(cur_macro_time, 0, 0, markers.LineStartMarker, buffer, idx);
+            evts[i] = { (uint16_t) macro_time, micro_words[i] };
+
+            macro_time += step;
+            acc += remainder;
+            if (acc >= n)
+            {
+               acc -= n;
+               macro_time++;
+            }
          }
       }
+      else
+      {
+         for (size_t i = 0; i < n; i++)
+            addEvent(pixel_start + (i * pixel_duration) / n, micro_words[i], chunk);
+      }
+   }
 
-      double approx_frame_time = n_px * (n_px * pixel_duration + inter_line_duration);
+   return chunk;
+}
 
-      double local_scale = (gen_frame > 0) ? 1.0 : 0.0;
+void SimTcspc::addPhotons(uint64_t pixel_seq, uint64_t pixel_start, const uint16_t* micro_words, size_t n,
+   std::vector<uint32_t>& periods, std::vector<double>& last_detection_ps, LineChunk& chunk) const
+{
+   // Place each photon in a laser period of the pixel, evenly or at random
+   uint32_t n_periods = std::max((uint32_t) 1, (uint32_t) (pixel_duration * macro_resolution_ps / T));
 
-      double theta = cur_macro_time / approx_frame_time * displacement_frequency * 2.0 * PI;
-      int xsel = cur_px + px_offset + cos(PI / 180.0 * displacement_angle) * displacement_amplitude * local_scale * sin(theta);
-      int ysel = cur_py + px_offset + sin(PI / 180.0 * displacement_angle) * displacement_amplitude * local_scale * cos(theta);
+   periods.resize(n);
+   if (scenario.random_arrivals)
+      photon_generator.sampleArrivals(pixel_seq, n, n_periods, periods.data());
+   else
+      for (size_t i = 0; i < n; i++)
+         periods[i] = (uint32_t) ((i * n_periods) / n);
 
-      cv::Size sz = intensity.size();
-      cv::Rect rect(0, 0, sz.width, sz.height);
+   // Sort by period then micro time, so the first photon of each period comes first
+   std::vector<std::pair<uint32_t, uint16_t>> photons(n);
+   for (size_t i = 0; i < n; i++)
+      photons[i] = { periods[i], micro_words[i] };
+   std::sort(photons.begin(), photons.end());
 
-      // Average number of photons
-      double N = 1;
-      if (rect.contains(cv::Point(ysel, xsel)))
-         N += 0.04 * intensity.at<uint16_t>(ysel, xsel);
+   double pixel_start_ps = pixel_start * macro_resolution_ps;
+   uint32_t last_period[16];
+   std::fill_n(last_period, 16, UINT32_MAX);
 
-      std::poisson_distribution<int> N_dist(N);
-      std::uniform_int_distribution<int> ch_dist(0, n_chan - 1);
+   for (auto& p : photons)
+   {
+      uint32_t period = p.first;
+      uint16_t word = p.second;
+      int channel = word & 0xF;
 
-      size_t n = N_dist(generator);
-      if (n >= buffer_length - idx) n = buffer_length - idx - 1;
+      // Pile-up: the electronics record only the first photon per laser period
+      if (scenario.pile_up && last_period[channel] == period)
+         continue;
 
-      std::vector<std::exponential_distribution<double>> exp_dist;
+      double detection_ps = pixel_start_ps + period * T + (word >> 4) * time_resolution_ps;
+      if (detection_ps < last_detection_ps[channel] + scenario.dead_time_ps)
+         continue;
 
-      double tau = static_cast<double>(cur_px) / n_px * 4000 + 500;
-      tau = 3000;
-      for (int i = 0; i < n_chan; i++)
-         exp_dist.push_back(std::exponential_distribution<double>(1 / (tau + i * 500)));
+      last_period[channel] = period;
+      last_detection_ps[channel] = detection_ps;
 
-      std::normal_distribution<double> irf_dist(1000, 100);
+      addEvent(pixel_start + (uint64_t) (period * T / macro_resolution_ps), word, chunk);
+   }
+}
 
+SimTcspc::LineChunk SimTcspc::nextLine()
+{
+   if (!generator_pool)
+      return generateLine(next_line_idx++);
 
-      for (int i = 0; i < n; i++)
+   // Keep a few lines queued per thread so the workers don't stall
+   size_t max_pending = 4 * generator_pool->getNumThreads();
+   while (pending_lines.size() < max_pending)
+   {
+      uint64_t line_idx = next_line_idx++;
+      pending_lines.push_back(generator_pool->submit([this, line_idx]() { return generateLine(line_idx); }));
+   }
+
+   LineChunk line = pending_lines.front().get();
+   pending_lines.pop_front();
+   return line;
+}
+
+size_t SimTcspc::readPackets(std::vector<TcspcEvent>& buffer, double buffer_fill_factor)
+{
+   size_t buffer_length = buffer.size();
+   size_t idx = 0;
+
+   FlimWarningStatus buffer_status = OK;
+
+   if (buffer_fill_factor > 0.8)
+      buffer_status = Critical;
+   else if (buffer_fill_factor > 0.5)
+      buffer_status = Warning;
+
+   flim_status.warnings["Host Buffer"] = FlimWarning(buffer_status);
+
+   // Stitch lines into the buffer in order. Lines carry their own rollover
+   // words, so only the gap between the epoch at the end of one line and
+   // the start of the next needs bridging here
+   while (idx < buffer_length)
+   {
+      if (cur_line_pos == cur_line.events.size())
       {
-         double intpart;
-         uint8_t channel = ch_dist(generator);
-         double t = exp_dist[channel](generator) + irf_dist(generator);
-         t = modf(t / T, &intpart);
+         macro_time_rollovers = cur_line.last_epoch;
+         cur_line = nextLine();
+         cur_line_pos = 0;
 
-         uint32_t micro_time = static_cast<int>(t * 256);
-         uint64_t macro_time = cur_macro_time + (i * pixel_duration) / n; // space photons evenly across pixel
+         // Stays set until the next acquisition, as with the hardware
+         if (cur_line.fifo_overflow)
+            flim_status.warnings["FIFO Buffer"] = FlimWarning(Critical);
+      }
 
-         addEvent(macro_time, micro_time, channel, markers.PhotonMarker, buffer, idx);
+      if (cur_line_pos == 0 && macro_time_rollovers < cur_line.first_epoch)
+      {
+         uint16_t r = (uint16_t)std::min(cur_line.first_epoch - macro_time_rollovers, (uint64_t) 0xFFFF);
+         buffer[idx++] = { r, 0xF };
+         macro_time_rollovers += r;
+         continue;
       }
 
-      cur_macro_time += pixel_duration;
-      cur_px++;
-   } while (idx < 0.8 * buffer.size());
+      size_t n = std::min(buffer_length - idx, cur_line.events.size() - cur_line_pos);
+      std::copy(cur_line.events.begin() + cur_line_pos, cur_line.events.begin() + cur_line_pos + n, buffer.begin() + idx);
+      cur_line_pos += n;
+      idx += n;
+   }
 
    return idx;
 }
@@ -2,9 +2,25 @@
 
 #include "FifoTcspc.h"
 #include "AbstractEventReader.h"
-#include <random>
-
-
+#include "SimPhotonGenerator.h"
+#include "SimScenario.h"
+#include "WorkerPool.h"
+#include <deque>
+#include <future>
+#include <memory>
+#include <limits>
+
+
+/*
+   Simulated TCSPC module generating a scanned FLIM stream from an
+   intensity image. Timing, count rates, decays and detector effects can
+   be scripted with a scenario file, see SimScenario.
+
+   The stream is generated one line at a time. Each line depends only on
+   its index and the seed, so with GeneratorThreads > 0 lines are
+   generated in parallel on a worker pool and stitched back in order,
+   giving the same stream whatever the number of threads.
+*/
 class SimTcspc : public FifoTcspc
 {
    Q_OBJECT
@@ -40,6 +56,12 @@ public:
          displacement_amplitude = value.toDouble();
       if (parameter == "DisplacementAngle")
          displacement_angle = value.toDouble();
+      if (parameter == "GeneratorThreads")
+         n_generator_threads = value.toInt();
+      if (parameter == "Seed")
+         seed = value.toULongLong();
+      if (parameter == "Scenario")
+         loadScenario(value.toString());
    };
 
    QVariant getParameter(const QString& parameter, ParameterType type) 
@@ -50,6 +72,12 @@ public:
          return displacement_amplitude;
       if (parameter == "DisplacementAngle")
          return displacement_angle;
+      if (parameter == "GeneratorThreads")
+         return n_generator_threads;
+      if (parameter == "Seed")
+         return (qulonglong) seed;
+      if (parameter == "Scenario")
+         return scenario_file;
 
       return QVariant();
    };
@@ -64,6 +92,10 @@ public:
       {
          if (parameter == "DisplacementAngle")
             return 360;
+         else if (parameter == "GeneratorThreads")
+            return 64;
+         else if (parameter == "Seed")
+            return (qulonglong) std::numeric_limits<uint64_t>::max();
          else
             return 1e3;
       }
@@ -82,8 +114,30 @@ private:
    void setSyncThreshold(float threshold);
    float getSyncThreshold();
 
+   // Events of one line, preceded by the markers ending the last one.
+   // Rollover words are relative to the epoch of the first event
+   struct LineChunk
+   {
+      std::vector<TcspcEvent> events;
+      uint64_t first_epoch = 0; // macro time >> 16 of the first event
+      uint64_t last_epoch = 0;  // ... and after the last event
+      bool fifo_overflow = false; // events were dropped by a scenario FIFO overflow
+   };
+
    void loadIntensityImage();
+   void loadScenario(const QString& filename);
+   void applyScenario();
+   void computePixelRates();
    void configureSyncTiming();
+   void configurePhotonGenerator();
+   const SimPhotonGenerator::Rate& pixelRate(int x, int y) const;
+
+   uint64_t lineStart(uint64_t line_idx) const;
+   LineChunk generateLine(uint64_t line_idx) const;
+   void addPhotons(uint64_t pixel_seq, uint64_t pixel_start, const uint16_t* micro_words, size_t n,
+      std::vector<uint32_t>& periods, std::vector<double>& last_detection_ps, LineChunk& chunk) const;
+   LineChunk nextLine();
+   void cancelPendingLines();
 
    void readRemainingPhotonsFromStream();
 
@@ -91,11 +145,6 @@ private:
    int n_chan = 1;
    int n_bits = 8;
 
-   int gen_frame = 0;
-
-   int cur_px;
-   int cur_py;
-
    double T = 12500;
    double time_resolution_ps;
    double macro_resolution_ps = 1e3; 
@@ -103,10 +152,26 @@ private:
    int pixel_duration;
    int inter_line_duration;
    int inter_frame_duration;
-   uint64_t cur_macro_time = 0;
    uint64_t macro_time_rollovers = 0;
-   std::default_random_engine generator;
-   std::chrono::system_clock::time_point last_frame_time;
+
+   // Photon rate for each intensity image pixel
+   std::vector<SimPhotonGenerator::Rate> pixel_rates;
+   SimPhotonGenerator::Rate background_rate;
+   SimPhotonGenerator photon_generator;
+   uint64_t seed = 0;
+
+   SimScenario scenario;
+   QString scenario_file;
+   bool scenario_pending = false;
+
+   // Line being copied out by readPackets, and lines queued on the pool
+   LineChunk cur_line;
+   size_t cur_line_pos = 0;
+   uint64_t next_line_idx = 0;
+   std::deque<std::future<LineChunk>> pending_lines;
+
+   int n_generator_threads = 0;
+   std::unique_ptr<WorkerPool> generator_pool;
 
    int px_offset;
 
@@ -116,7 +181,8 @@ private:
 
 protected:
 
-   void addEvent(uint64_t macro_time, uint32_t micro_time, uint8_t channel, uint8_t mark, std::vector<TcspcEvent>& buffer, int& idx);
+   static void addEvent(uint64_t macro_time, uint16_t micro_time_word, LineChunk& chunk);
+   uint16_t markerWord(uint8_t mark) const { return 0xF | (mark << 4); }
 
    cv::Mat intensity;
 
@@ -0,0 +1,320 @@
+#include "StreamingFileWriter.h"
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+void StreamingFileWriter::AlignedDeleter::operator()(char* p)
+{
+#ifdef _WIN32
+   _aligned_free(p);
+#else
+   free(p);
+#endif
+}
+
+StreamingFileWriter::StreamingFileWriter(size_t buffer_bytes_, int n_buffers)
+{
+   // Unbuffered I/O requires whole, aligned blocks
+   buffer_bytes = ((buffer_bytes_ + alignment - 1) / alignment) * alignment;
+
+   for (int i = 0; i < n_buffers; i++)
+   {
+      void* p = nullptr;
+#ifdef _WIN32
+      p = _aligned_malloc(buffer_bytes, alignment);
+#else
+      if (posix_memalign(&p, alignment, buffer_bytes) != 0)
+         p = nullptr;
+#endif
+      if (p == nullptr)
+         throw std::bad_alloc();
+
+      buffers.push_back(AlignedBuffer(static_cast<char*>(p)));
+   }
+}
+
+StreamingFileWriter::~StreamingFileWriter()
+{
+   close();
+}
+
+bool StreamingFileWriter::open(const std::string& filename)
+{
+   close();
+
+   {
+      std::lock_guard<std::mutex> lk(error_mutex);
+      error_string.clear();
+   }
+
+   if (!openHandle(filename))
+      return false;
+
+   free_buffers.clear();
+   pending_writes.clear();
+   for (auto& b : buffers)
+      free_buffers.push_back(b.get());
+
+   cur_buffer = nullptr;
+   cur_pos = 0;
+   logical_size = 0;
+   closing = false;
+   is_open = true;
+
+   io_thread = std::thread(&StreamingFileWriter::ioThread, this);
+   return true;
+}
+
+void StreamingFileWriter::close()
+{
+   if (!is_open)
+      return;
+
+   {
+      std::lock_guard<std::mutex> lk(queue_mutex);
+
+      if (cur_buffer != nullptr)
+      {
+         if (cur_pos > 0)
+            pending_writes.push_back({ cur_buffer, cur_pos });
+         else
+            free_buffers.push_back(cur_buffer);
+         cur_buffer = nullptr;
+         cur_pos = 0;
+      }
+
+      closing = true;
+      queue_cv.notify_all();
+   }
+
+   io_thread.join();
+
+   closeHandle(logical_size);
+   is_open = false;
+}
+
+void StreamingFileWriter::write(const char* data, size_t size)
+{
+   if (!is_open)
+      return;
+
+   logical_size += size;
+
+   while (size > 0)
+   {
+      if (cur_buffer == nullptr)
+      {
+         std::unique_lock<std::mutex> lk(queue_mutex);
+         queue_cv.wait(lk, [this] { return !free_buffers.empty(); });
+         cur_buffer = free_buffers.front();
+         free_buffers.pop_front();
+         cur_pos = 0;
+      }
+
+      size_t n_copy = std::min(size, buffer_bytes - cur_pos);
+      memcpy(cur_buffer + cur_pos, data, n_copy);
+      cur_pos += n_copy;
+      data += n_copy;
+      size -= n_copy;
+
+      if (cur_pos == buffer_bytes)
+         submitCurrentBuffer();
+   }
+}
+
+void StreamingFileWriter::submitCurrentBuffer()
+{
+   std::lock_guard<std::mutex> lk(queue_mutex);
+   pending_writes.push_back({ cur_buffer, cur_pos });
+   queue_cv.notify_all();
+
+   cur_buffer = nullptr;
+   cur_pos = 0;
+}
+
+void StreamingFileWriter::ioThread()
+{
+   while (true)
+   {
+      PendingWrite w;
+      {
+         std::unique_lock<std::mutex> lk(queue_mutex);
+         queue_cv.wait(lk, [this] { return !pending_writes.empty() || closing; });
+         if (pending_writes.empty())
+            return;
+
+         w = pending_writes.front();
+         pending_writes.pop_front();
+      }
+
+      // Only the final buffer can be partially filled. Pad it to a whole
+      // block for unbuffered I/O; the file is truncated on close
+      size_t write_size = w.size;
+      if (direct_io)
+      {
+         size_t padded_size = ((write_size + alignment - 1) / alignment) * alignment;
+         memset(w.data + write_size, 0, padded_size - write_size);
+         write_size = padded_size;
+      }
+
+      if (!hasError() && !writeHandle(w.data, write_size))
+         setError("Error writing to file");
+
+      // Buffers are always returned, even after an error, so that
+      // writers never block indefinitely
+      std::lock_guard<std::mutex> lk(queue_mutex);
+      free_buffers.push_back(w.data);
+      queue_cv.notify_all();
+   }
+}
+
+bool StreamingFileWriter::hasError()
+{
+   std::lock_guard<std::mutex> lk(error_mutex);
+   return !error_string.empty();
+}
+
+std::string StreamingFileWriter::errorString()
+{
+   std::lock_guard<std::mutex> lk(error_mutex);
+   return error_string;
+}
+
+void StreamingFileWriter::setError(const std::string& msg)
+{
+   std::lock_guard<std::mutex> lk(error_mutex);
+   error_string = msg;
+}
+
+#ifdef _WIN32
+
+bool StreamingFileWriter::openHandle(const std::string& filename)
+{
+   int n_wchar = MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, nullptr, 0);
+   std::wstring wfilename(n_wchar, 0);
+   MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, &wfilename[0], n_wchar);
+
+   DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
+   if (direct_io)
+      flags |= FILE_FLAG_NO_BUFFERING;
+
+   HANDLE h = CreateFileW(wfilename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, flags, nullptr);
+   if (h == INVALID_HANDLE_VALUE)
+   {
+      setError("Could not open file for writing");
+      return false;
+   }
+
+   if (preallocate_bytes > 0)
+   {
+      FILE_ALLOCATION_INFO info;
+      info.AllocationSize.QuadPart = preallocate_bytes;
+      SetFileInformationByHandle(h, FileAllocationInfo, &info, sizeof(info)); // not fatal if this fails
+   }
+
+   handle = h;
+   return true;
+}
+
+bool StreamingFileWriter::writeHandle(const char* data, size_t size)
+{
+   while (size > 0)
+   {
+      DWORD n_write = (DWORD) std::min(size, (size_t) 1024 * 1024 * 1024);
+      DWORD n_written = 0;
+      if (!WriteFile(handle, data, n_write, &n_written, nullptr))
+         return false;
+      data += n_written;
+      size -= n_written;
+   }
+   return true;
+}
+
+void StreamingFileWriter::closeHandle(uint64_t final_size)
+{
+   if (handle == nullptr)
+      return;
+
+   // Remove padding and any unused preallocated space
+   FILE_END_OF_FILE_INFO eof;
+   eof.EndOfFile.QuadPart = final_size;
+   SetFileInformationByHandle(handle, FileEndOfFileInfo, &eof, sizeof(eof));
+
+   CloseHandle(handle);
+   handle = nullptr;
+}
+
+#else
+
+bool StreamingFileWriter::openHandle(const std::string& filename)
+{
+   int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+   if (direct_io)
+      fd = ::open(filename.c_str(), flags | O_DIRECT, 0644);
+#endif
+
+   // Not all filesystems support O_DIRECT, fall back to buffered I/O
+   if (fd < 0)
+      fd = ::open(filename.c_str(), flags, 0644);
+
+   if (fd < 0)
+   {
+      setError("Could not open file for writing");
+      return false;
+   }
+
+#ifdef __APPLE__
+   if (direct_io)
+      fcntl(fd, F_NOCACHE, 1);
+#endif
+
+#ifdef __linux__
+   if (preallocate_bytes > 0)
+      posix_fallocate(fd, 0, (off_t) preallocate_bytes); // not fatal if this fails
+#endif
+
+   return true;
+}
+
+bool StreamingFileWriter::writeHandle(const char* data, size_t size)
+{
+   while (size > 0)
+   {
+      ssize_t n_written = ::write(fd, data, size);
+      if (n_written < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      data += n_written;
+      size -= n_written;
+   }
+   return true;
+}
+
+void StreamingFileWriter::closeHandle(uint64_t final_size)
+{
+   if (fd < 0)
+      return;
+
+   // Remove padding and any unused preallocated space
+   if (ftruncate(fd, (off_t) final_size) != 0)
+      setError("Could not set final file size");
+
+   ::close(fd);
+   fd = -1;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstdint>
+
+/*
+   Write-behind file writer for long, high rate recordings.
+
+   Data is collected into large page-aligned buffers which are written out
+   on a dedicated I/O thread, so callers only pay for a memcpy. Optionally
+   the file can be opened for unbuffered (O_DIRECT / FILE_FLAG_NO_BUFFERING)
+   writes, bypassing the OS page cache, and its extents preallocated up front.
+   If the I/O thread falls behind, write() blocks until a buffer is free.
+*/
+class StreamingFileWriter
+{
+public:
+
+   StreamingFileWriter(size_t buffer_bytes = 4 * 1024 * 1024, int n_buffers = 8);
+   ~StreamingFileWriter();
+
+   // Set before open()
+   void setDirectIO(bool direct_io_) { direct_io = direct_io_; }
+   void setPreallocationSize(uint64_t preallocate_bytes_) { preallocate_bytes = preallocate_bytes_; }
+
+   bool open(const std::string& filename);
+   void close();
+   bool isOpen() { return is_open; }
+
+   void write(const char* data, size_t size);
+
+   uint64_t bytesWritten() { return logical_size; }
+
+   bool hasError();
+   std::string errorString();
+
+   static const size_t alignment = 4096;
+
+private:
+
+   struct AlignedDeleter { void operator()(char* p); };
+   typedef std::unique_ptr<char[], AlignedDeleter> AlignedBuffer;
+
+   struct PendingWrite
+   {
+      char* data;
+      size_t size;
+   };
+
+   void ioThread();
+   void submitCurrentBuffer();
+   void setError(const std::string& msg);
+
+   bool openHandle(const std::string& filename);
+   bool writeHandle(const char* data, size_t size);
+   void closeHandle(uint64_t final_size);
+
+   size_t buffer_bytes;
+   std::vector<AlignedBuffer> buffers;
+
+   std::deque<char*> free_buffers;
+   std::deque<PendingWrite> pending_writes;
+   std::mutex queue_mutex;
+   std::condition_variable queue_cv;
+
+   char* cur_buffer = nullptr;
+   size_t cur_pos = 0;
+
+   std::thread io_thread;
+   bool is_open = false;
+   bool closing = false;
+
+   bool direct_io = false;
+   uint64_t preallocate_bytes = 0;
+   uint64_t logical_size = 0;
+
+   std::mutex error_mutex;
+   std::string error_string;
+
+#ifdef _WIN32
+   void* handle = nullptr;
+#else
+   int fd = -1;
+#endif
+};
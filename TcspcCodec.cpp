@@ -0,0 +1,442 @@
+#include "TcspcCodec.h"
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TCSPC_CODEC_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static_assert(sizeof(TcspcEvent) == sizeof(uint32_t), "TcspcEvent must be packed into 32 bits");
+
+namespace
+{
+   struct TcspcCodecHeader
+   {
+      uint32_t n_events;
+      uint8_t delta_bits;
+      uint8_t channel_bits;
+      uint8_t payload_bits;
+      uint8_t reserved;
+      uint32_t n_big_deltas;
+      uint32_t n_specials;
+      uint32_t packed_bytes;
+      uint32_t exception_bytes;
+   };
+
+   // Codes are packed in groups of 128, spread over the eight 16-bit lanes
+   // of a vector: value i of a group goes into lane i % 8, at bit (i / 8) * bits
+   // of that lane. A group of b-bit values therefore takes b vectors, and
+   // unpacking yields 8 consecutive values per step
+   const size_t group_size = 128;
+   const size_t lanes = 8;
+
+   // Events are decoded in tiles small enough for the scratch arrays to stay in L1
+   const size_t tile_size = 1024;
+
+   // Approximate cost of a big delta exception, for choosing the delta width
+   const size_t big_delta_bits = 24;
+
+   inline int bitsFor(uint32_t x)
+   {
+      if (x == 0)
+         return 0;
+#ifdef _MSC_VER
+      unsigned long idx;
+      _BitScanReverse(&idx, x);
+      return (int) idx + 1;
+#else
+      return 32 - __builtin_clz(x);
+#endif
+   }
+
+   inline size_t planeBytes(size_t n, int bits)
+   {
+      return (n + group_size - 1) / group_size * bits * lanes * sizeof(uint16_t);
+   }
+
+   void packPlane(const uint16_t* values, size_t n, int bits, char* out)
+   {
+      if (bits == 0)
+         return;
+
+      std::vector<uint16_t> words(bits * lanes);
+      for (size_t first = 0; first < n; first += group_size)
+      {
+         std::fill(words.begin(), words.end(), 0);
+         for (size_t i = 0; i < group_size && first + i < n; i++)
+         {
+            uint32_t v = values[first + i];
+            size_t lane = i % lanes;
+            int bit = (int) (i / lanes) * bits;
+            int w = bit >> 4, s = bit & 15;
+
+            words[w * lanes + lane] |= (uint16_t) (v << s);
+            if (s + bits > 16)
+               words[(w + 1) * lanes + lane] |= (uint16_t) (v >> (16 - s));
+         }
+
+         for (uint16_t w : words)
+         {
+            *out++ = (char) (w & 0xFF);
+            *out++ = (char) (w >> 8);
+         }
+      }
+   }
+
+   // Unpacks the groups covering values [first, first + m), first must be a multiple of group_size
+   void unpackPlane(const uint8_t* plane, size_t first, size_t m, int bits, uint16_t* values)
+   {
+      if (bits == 0)
+      {
+         std::fill(values, values + m, 0);
+         return;
+      }
+
+      const uint8_t* group = plane + first / group_size * bits * lanes * sizeof(uint16_t);
+      uint16_t mask = (uint16_t) ((1u << bits) - 1);
+
+      for (size_t j = 0; j < m; j += group_size, group += bits * lanes * sizeof(uint16_t))
+      {
+         uint16_t* out = values + j;
+
+#ifdef TCSPC_CODEC_SSE2
+         const __m128i* words = reinterpret_cast<const __m128i*>(group);
+         __m128i vmask = _mm_set1_epi16((short) mask);
+
+         for (int k = 0, bit = 0; k < (int) (group_size / lanes); k++, bit += bits)
+         {
+            int w = bit >> 4, s = bit & 15;
+            __m128i v = _mm_srl_epi16(_mm_loadu_si128(words + w), _mm_cvtsi32_si128(s));
+            if (s + bits > 16)
+               v = _mm_or_si128(v, _mm_sll_epi16(_mm_loadu_si128(words + w + 1), _mm_cvtsi32_si128(16 - s)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + k * lanes), _mm_and_si128(v, vmask));
+         }
+#else
+         for (size_t i = 0; i < group_size; i++)
+         {
+            size_t lane = i % lanes;
+            int bit = (int) (i / lanes) * bits;
+            int w = bit >> 4, s = bit & 15;
+
+            const uint8_t* p = group + (w * lanes + lane) * sizeof(uint16_t);
+            uint32_t v = (uint32_t) (p[0] | (p[1] << 8)) >> s;
+            if (s + bits > 16)
+            {
+               p += lanes * sizeof(uint16_t);
+               v |= (uint32_t) (p[0] | (p[1] << 8)) << (16 - s);
+            }
+            out[i] = (uint16_t) (v & mask);
+         }
+#endif
+      }
+   }
+
+   inline void putVarint(std::vector<char>& out, uint64_t x)
+   {
+      while (x >= 0x80)
+      {
+         out.push_back((char) (x | 0x80));
+         x >>= 7;
+      }
+      out.push_back((char) x);
+   }
+
+   inline void putU16(std::vector<char>& out, uint16_t x)
+   {
+      out.push_back((char) (x & 0xFF));
+      out.push_back((char) (x >> 8));
+   }
+
+   inline bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& x)
+   {
+      x = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+         if (p == end)
+            return false;
+         uint8_t b = *p++;
+         x |= (uint64_t) (b & 0x7F) << shift;
+         if (!(b & 0x80))
+            return true;
+      }
+      return false;
+   }
+
+   inline bool getU16(const uint8_t*& p, const uint8_t* end, uint16_t& x)
+   {
+      if (end - p < 2)
+         return false;
+      x = (uint16_t) (p[0] | (p[1] << 8));
+      p += 2;
+      return true;
+   }
+
+   // Rebuilds macro times from deltas and micro time words from payloads,
+   // returns the last macro time to carry into the next tile
+   uint16_t assembleEvents(const uint16_t* delta, const uint16_t* payload, size_t m, int channel_bits, uint16_t carry, TcspcEvent* evts)
+   {
+      uint16_t channel_mask = (uint16_t) ((1 << channel_bits) - 1);
+      size_t i = 0;
+
+#ifdef TCSPC_CODEC_SSE2
+      __m128i vcarry = _mm_set1_epi16((short) carry);
+      __m128i vchannel_mask = _mm_set1_epi16((short) channel_mask);
+      __m128i vshift = _mm_cvtsi32_si128(channel_bits);
+
+      for (; i + 8 <= m; i += 8)
+      {
+         // Inclusive prefix sum of 8 deltas in log steps, plus the carry
+         __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(delta + i));
+         d = _mm_add_epi16(d, _mm_slli_si128(d, 2));
+         d = _mm_add_epi16(d, _mm_slli_si128(d, 4));
+         d = _mm_add_epi16(d, _mm_slli_si128(d, 8));
+         __m128i macro = _mm_add_epi16(d, vcarry);
+
+         // Broadcast the last macro time
+         vcarry = _mm_shufflehi_epi16(macro, 0xFF);
+         vcarry = _mm_unpackhi_epi64(vcarry, vcarry);
+
+         __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(payload + i));
+         __m128i micro = _mm_or_si128(_mm_slli_epi16(_mm_srl_epi16(p, vshift), 4), _mm_and_si128(p, vchannel_mask));
+
+         __m128i* out = reinterpret_cast<__m128i*>(evts + i);
+         _mm_storeu_si128(out, _mm_unpacklo_epi16(macro, micro));
+         _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(macro, micro));
+      }
+
+      carry = (uint16_t) _mm_extract_epi16(vcarry, 0);
+#endif
+
+      for (; i < m; i++)
+      {
+         carry += delta[i];
+         evts[i].macro_time = carry;
+         evts[i].micro_time = (uint16_t) (((payload[i] >> channel_bits) << 4) | (payload[i] & channel_mask));
+      }
+
+      return carry;
+   }
+}
+
+bool TcspcCodec::encode(const TcspcEvent* evts, size_t n, std::vector<char>& out)
+{
+   if (n >= UINT32_MAX / sizeof(TcspcEvent))
+      return false;
+
+   // Rollovers take no part in the delta chain; their macro time is a count
+   std::vector<uint16_t> delta(n);
+   std::vector<uint16_t> payload(n);
+   size_t delta_hist[17] = {};
+   uint16_t max_channel = 0, max_bin = 0;
+   bool any_special = false;
+
+   uint16_t prev = 0;
+   for (size_t i = 0; i < n; i++)
+   {
+      const TcspcEvent& e = evts[i];
+      if (e.isMacroTimeRollover())
+      {
+         delta[i] = 0;
+         any_special = true;
+      }
+      else
+      {
+         delta[i] = (uint16_t) (e.macro_time - prev);
+         prev = e.macro_time;
+
+         if (e.isMark())
+            any_special = true;
+         else
+         {
+            max_channel = std::max(max_channel, (uint16_t) e.channel());
+            max_bin = std::max(max_bin, e.microTime());
+         }
+      }
+      delta_hist[bitsFor(delta[i])]++;
+   }
+
+   int channel_bits = bitsFor(max_channel);
+   uint32_t max_payload = ((uint32_t) max_bin << channel_bits) | max_channel;
+   int payload_bits = bitsFor(any_special ? max_payload + 1 : max_payload);
+   uint16_t payload_escape = (uint16_t) ((1u << payload_bits) - 1);
+
+   // Choose the delta width minimising the packed size plus exceptions
+   int delta_bits = 16;
+   size_t best_cost = SIZE_MAX;
+   for (int d = 1; d <= 16; d++)
+   {
+      size_t n_big = 0;
+      for (int b = d + 1; b <= 16; b++)
+         n_big += delta_hist[b];
+
+      size_t cost = n * d + n_big * big_delta_bits;
+      if (cost < best_cost)
+      {
+         best_cost = cost;
+         delta_bits = d;
+      }
+   }
+   uint16_t delta_escape = (uint16_t) ((1u << delta_bits) - 1);
+
+   std::vector<char> big_deltas;
+   std::vector<char> specials;
+   uint32_t n_big_deltas = 0, n_specials = 0;
+   size_t next_big = 0, next_special = 0;
+
+   for (size_t i = 0; i < n; i++)
+   {
+      const TcspcEvent& e = evts[i];
+
+      if (delta[i] >= delta_escape)
+      {
+         putVarint(big_deltas, i - next_big);
+         putU16(big_deltas, delta[i]);
+         next_big = i + 1;
+         n_big_deltas++;
+         delta[i] = delta_escape;
+      }
+
+      if (!e.isMark())
+      {
+         payload[i] = (uint16_t) ((e.microTime() << channel_bits) | e.channel());
+         continue;
+      }
+
+      payload[i] = payload_escape;
+
+      // Only the first of a run of identical specials starts an entry
+      if (i < next_special)
+         continue;
+
+      size_t run = 1;
+      while (i + run < n && evts[i + run].micro_time == e.micro_time &&
+             (!e.isMacroTimeRollover() || evts[i + run].macro_time == e.macro_time))
+         run++;
+
+      putVarint(specials, i - next_special);
+      putU16(specials, e.micro_time);
+      if (e.isMacroTimeRollover())
+         putVarint(specials, e.macro_time);
+      putVarint(specials, run - 1);
+
+      next_special = i + run;
+      n_specials++;
+   }
+
+   size_t delta_bytes = planeBytes(n, delta_bits);
+   size_t packed_bytes = delta_bytes + planeBytes(n, payload_bits);
+
+   TcspcCodecHeader header = { (uint32_t) n, (uint8_t) delta_bits, (uint8_t) channel_bits, (uint8_t) payload_bits, 0,
+                               n_big_deltas, n_specials, (uint32_t) packed_bytes, (uint32_t) (big_deltas.size() + specials.size()) };
+
+   out.resize(sizeof(header) + packed_bytes);
+   memcpy(out.data(), &header, sizeof(header));
+   packPlane(delta.data(), n, delta_bits, out.data() + sizeof(header));
+   packPlane(payload.data(), n, payload_bits, out.data() + sizeof(header) + delta_bytes);
+
+   out.insert(out.end(), big_deltas.begin(), big_deltas.end());
+   out.insert(out.end(), specials.begin(), specials.end());
+   return true;
+}
+
+bool TcspcCodec::decode(const char* data, size_t size, TcspcEvent* evts, size_t n)
+{
+   TcspcCodecHeader header;
+   if (size < sizeof(header))
+      return false;
+   memcpy(&header, data, sizeof(header));
+
+   int delta_bits = header.delta_bits;
+   int channel_bits = header.channel_bits;
+   int payload_bits = header.payload_bits;
+
+   if (header.n_events != n || delta_bits < 1 || delta_bits > 16 || channel_bits > 4 || payload_bits > 16)
+      return false;
+
+   size_t delta_bytes = planeBytes(n, delta_bits);
+   if (header.packed_bytes != delta_bytes + planeBytes(n, payload_bits))
+      return false;
+   if ((uint64_t) sizeof(header) + header.packed_bytes + header.exception_bytes != size)
+      return false;
+
+   const uint8_t* packed = reinterpret_cast<const uint8_t*>(data) + sizeof(header);
+   const uint8_t* p = packed + header.packed_bytes;
+   const uint8_t* end = p + header.exception_bytes;
+
+   // Big deltas have to be patched in before the prefix sum
+   uint32_t n_big_left = header.n_big_deltas;
+   uint64_t big_idx = 0, big_gap = 0;
+   uint16_t big_delta = 0;
+
+   auto nextBigDelta = [&]()
+   {
+      if (!getVarint(p, end, big_gap) || !getU16(p, end, big_delta))
+         return false;
+      big_idx += big_gap;
+      return true;
+   };
+
+   if (n_big_left > 0 && !nextBigDelta())
+      return false;
+
+   uint16_t delta[tile_size];
+   uint16_t payload[tile_size];
+   uint16_t carry = 0;
+
+   for (size_t first = 0; first < n; first += tile_size)
+   {
+      size_t m = std::min(tile_size, n - first);
+      unpackPlane(packed, first, m, delta_bits, delta);
+      unpackPlane(packed + delta_bytes, first, m, payload_bits, payload);
+
+      while (n_big_left > 0 && big_idx < first + m)
+      {
+         delta[big_idx - first] = big_delta;
+         big_idx++;
+         if (--n_big_left > 0 && !nextBigDelta())
+            return false;
+      }
+
+      carry = assembleEvents(delta, payload, m, channel_bits, carry, evts + first);
+   }
+
+   if (n_big_left > 0)
+      return false;
+
+   // Markers already have their macro time from the delta chain
+   uint64_t next_special = 0;
+   for (uint32_t k = 0; k < header.n_specials; k++)
+   {
+      uint64_t gap, macro_time = 0, run;
+      uint16_t micro_time;
+
+      if (!getVarint(p, end, gap) || !getU16(p, end, micro_time))
+         return false;
+
+      bool rollover = (micro_time == 0xF);
+      if (rollover && !getVarint(p, end, macro_time))
+         return false;
+      if (!getVarint(p, end, run))
+         return false;
+
+      uint64_t idx = next_special + gap;
+      run++;
+      if (idx > n || run > n - idx)
+         return false;
+
+      for (uint64_t i = idx; i < idx + run; i++)
+      {
+         evts[i].micro_time = micro_time;
+         if (rollover)
+            evts[i].macro_time = (uint16_t) macro_time;
+      }
+      next_special = idx + run;
+   }
+
+   return p == end;
+}
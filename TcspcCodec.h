@@ -0,0 +1,38 @@
+#pragma once
+
+#include "TcspcEvent.h"
+#include <vector>
+#include <cstdint>
+
+/*
+   Lossless codec for blocks of TcspcEvents, tuned to the structure of
+   TCSPC streams rather than to generic byte patterns.
+
+   Macro times are delta encoded against the previous event, and the photon
+   channel and micro time are packed into as few bits as the block needs.
+   Deltas and payloads are bit-packed into two planes of fixed width codes,
+   the widths being chosen per block. Deltas which do not fit, markers and
+   rollovers are escaped and stored in exception lists; runs of identical
+   markers or rollovers are run-length encoded.
+
+   Decoding unpacks the planes with SSE2 shifts in tiles, rebuilds the macro
+   times with an SSE2 prefix sum and then patches in the exceptions.
+
+   Block layout (little-endian):
+      TcspcCodecHeader
+      uint16 deltas[], uint16 payloads[]   vertically bit-packed planes
+      big deltas[n_big_deltas]       varint index gap, uint16 delta
+      specials[n_specials]           varint index gap, uint16 micro_time,
+                                     varint macro_time (rollovers only),
+                                     varint run length - 1
+*/
+class TcspcCodec
+{
+public:
+
+   // Returns false if the events can't be encoded
+   static bool encode(const TcspcEvent* evts, size_t n, std::vector<char>& out);
+
+   // Decodes exactly n events, returns false if the data is corrupt
+   static bool decode(const char* data, size_t size, TcspcEvent* evts, size_t n);
+};
@@ -1,5 +1,7 @@
 #pragma once
 #include <cstdint>
+#include <cstddef>
+#include "PacketBufferView.h"
 
 class TcspcEvent
 {
@@ -48,15 +50,110 @@ public:
    }
 };
 
-class TcspcEventConsumer
+/*
+   Event with an absolute macro time, so there are no rollover words and
+   consumers need no macro time offset. Packed into a 64-bit word with the
+   micro time word, laid out as in TcspcEvent, in the low 16 bits and a
+   48-bit macro time above it.
+*/
+class WideTcspcEvent
 {
 public:
 
+   uint64_t word;
+
+   static WideTcspcEvent make(uint64_t macro_time, uint16_t micro_time)
+   {
+      WideTcspcEvent evt;
+      evt.word = (macro_time << 16) | micro_time;
+      return evt;
+   }
+
+   uint64_t macroTime() const
+   {
+      return word >> 16;
+   }
+
+   uint16_t microTimeWord() const
+   {
+      return (uint16_t) word;
+   }
+
+   uint8_t channel() const
+   {
+      return word & 0xF;
+   }
+
+   uint16_t microTime() const
+   {
+      return microTimeWord() >> 4;
+   }
+
+   bool isMacroTimeRollover() const
+   {
+      return false;
+   }
+
+   bool isMark() const
+   {
+      return (channel() == 0xF);
+   }
+
+   uint8_t mark() const
+   {
+      return (uint8_t) (microTimeWord() >> 4);
+   }
+
+   void addMark(TcspcEvent::Mark mark_)
+   {
+      word |= ((uint64_t) mark_ << 4);
+   }
+};
+
+typedef PacketBufferView<TcspcEvent> TcspcEventView;
+typedef PacketBufferView<WideTcspcEvent> WideTcspcEventView;
+
+template<class Event>
+class EventConsumer
+{
+public:
+
+   typedef PacketBufferView<Event> EventView;
+
    virtual void eventStreamAboutToStart() {};
    virtual void eventStreamFinished() {};
    virtual void nextImageStarted() {};
    virtual void imageSequenceFinished() {};
-   virtual void addEvent(const TcspcEvent& evt) = 0;
+   virtual void addEvent(const Event& evt) = 0;
+
+   // Called with contiguous runs of events, already cut at image boundaries.
+   // Override to process events in bulk rather than one virtual call per event
+   virtual void addEvents(const Event* evts, size_t n) 
+   {
+      for (size_t i = 0; i < n; i++)
+         addEvent(evts[i]);
+   };
+
+   // Zero-copy variant of addEvents. Consumers may keep the view (or copies of
+   // it) after returning; the packet buffer slot is not reused until released
+   virtual void addEventView(const EventView& view)
+   {
+      addEvents(view.data(), view.size());
+   }
+
+   // Called before the first events in which only one photon in factor has
+   // been kept, see EventProcessor::setLoadShedding. Markers and rollovers
+   // are never dropped. Weight photons by factor to keep intensities to scale
+   virtual void photonDecimationChanged(int factor) {};
+
+   // Photons are only decimated while every consumer accepts it. Consumers
+   // which need every photon, e.g. to record them, must return false.
+   // Called from the reader thread
+   virtual bool acceptsDecimation() { return false; };
+
    virtual bool isProcessingEvents() { return true; };
 
 };
+
+typedef EventConsumer<TcspcEvent> TcspcEventConsumer;
+typedef EventConsumer<WideTcspcEvent> WideTcspcEventConsumer;
@@ -0,0 +1,120 @@
+#include "WideEventConverter.h"
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WIDE_EVENT_SSE2
+#include <emmintrin.h>
+#endif
+
+static_assert(sizeof(TcspcEvent) == sizeof(uint32_t), "TcspcEvent must be packed into 32 bits");
+static_assert(sizeof(WideTcspcEvent) == sizeof(uint64_t), "WideTcspcEvent must be packed into 64 bits");
+
+size_t TcspcEventWidener::convert(const TcspcEvent* evts, size_t n, WideTcspcEvent* out)
+{
+   size_t i = 0, n_out = 0;
+
+   auto convertScalar = [&](size_t end)
+   {
+      for (; i < end; i++)
+      {
+         const TcspcEvent& evt = evts[i];
+         if (evt.isMacroTimeRollover())
+            macro_time_offset += ((uint64_t) evt.macro_time) << 16;
+         else
+            out[n_out++] = WideTcspcEvent::make(macro_time_offset + evt.macro_time, evt.micro_time);
+      }
+   };
+
+#ifdef WIDE_EVENT_SSE2
+   // A rollover word has 0x000F in the micro time half of the event word
+   const __m128i rollover_mask = _mm_set1_epi32((int) 0xFFFF0000);
+   const __m128i rollover_word = _mm_set1_epi32(0x000F0000);
+   const __m128i zero = _mm_setzero_si128();
+
+   while (i + 4 <= n)
+   {
+      __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(evts + i));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(e, rollover_mask), rollover_word)))
+      {
+         convertScalar(i + 4);
+         continue;
+      }
+
+      // Swap the macro and micro time halves, widen to 64 bits and add the offset
+      __m128i swapped = _mm_shufflehi_epi16(_mm_shufflelo_epi16(e, 0xB1), 0xB1);
+      __m128i offset = _mm_set1_epi64x((long long) (macro_time_offset << 16));
+
+      __m128i* dst = reinterpret_cast<__m128i*>(out + n_out);
+      _mm_storeu_si128(dst, _mm_add_epi64(_mm_unpacklo_epi32(swapped, zero), offset));
+      _mm_storeu_si128(dst + 1, _mm_add_epi64(_mm_unpackhi_epi32(swapped, zero), offset));
+
+      i += 4;
+      n_out += 4;
+   }
+#endif
+
+   convertScalar(n);
+   return n_out;
+}
+
+void TcspcEventNarrower::convert(const WideTcspcEvent* evts, size_t n, std::vector<TcspcEvent>& out)
+{
+   size_t pos = out.size();
+   out.resize(pos + n);
+
+   size_t i = 0;
+
+   auto convertScalar = [&](size_t end)
+   {
+      for (; i < end; i++)
+      {
+         uint64_t macro_time = evts[i].macroTime();
+         uint64_t evt_epoch = macro_time >> 16;
+
+         if (evt_epoch > epoch)
+         {
+            // Rollover words count at most 0xFFFF rollovers each
+            uint64_t n_rollover = evt_epoch - epoch;
+            size_t n_words = (size_t) ((n_rollover + 0xFFFE) / 0xFFFF);
+            out.resize(out.size() + n_words);
+
+            while (n_rollover > 0)
+            {
+               uint16_t count = (uint16_t) std::min(n_rollover, (uint64_t) 0xFFFF);
+               out[pos++] = { count, 0xF };
+               n_rollover -= count;
+            }
+         }
+         epoch = evt_epoch;
+
+         out[pos++] = { (uint16_t) macro_time, evts[i].microTimeWord() };
+      }
+   };
+
+#ifdef WIDE_EVENT_SSE2
+   while (i + 4 <= n)
+   {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(evts + i));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(evts + i + 2));
+
+      // High dwords hold the epoch, low dwords the 16-bit macro and micro time
+      __m128i hi = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1)));
+      __m128i lo = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(hi, _mm_set1_epi32((int) epoch))) != 0xFFFF)
+      {
+         convertScalar(i + 4);
+         continue;
+      }
+
+      __m128i swapped = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xB1), 0xB1);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out.data() + pos), swapped);
+
+      i += 4;
+      pos += 4;
+   }
+#endif
+
+   convertScalar(n);
+   out.resize(pos);
+}
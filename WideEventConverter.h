@@ -0,0 +1,93 @@
+#pragma once
+
+#include "TcspcEvent.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+/*
+   Converts the hardware TcspcEvent stream, with 16-bit macro times and
+   rollover words, to absolute time WideTcspcEvents. Rollover words are
+   dropped. The macro time offset is kept between calls so a stream can be
+   converted span by span. An SSE2 kernel handles runs without rollovers.
+*/
+class TcspcEventWidener
+{
+public:
+
+   // Converts n events, returns the number written to out (at most n)
+   size_t convert(const TcspcEvent* evts, size_t n, WideTcspcEvent* out);
+
+   void reset() { macro_time_offset = 0; }
+   uint64_t getMacroTimeOffset() { return macro_time_offset; }
+
+private:
+
+   uint64_t macro_time_offset = 0;
+};
+
+/*
+   Converts WideTcspcEvents back to TcspcEvents, inserting rollover words
+   where the macro time crosses a 16-bit boundary. Macro times are
+   expected not to decrease.
+*/
+class TcspcEventNarrower
+{
+public:
+
+   // Appends the converted events to out
+   void convert(const WideTcspcEvent* evts, size_t n, std::vector<TcspcEvent>& out);
+
+   void reset() { epoch = 0; }
+
+private:
+
+   uint64_t epoch = 0; // macro time >> 16 of the last event
+};
+
+/*
+   Lets a WideTcspcEventConsumer be attached to a TcspcEvent processor,
+   widening each span of events as it is dispatched.
+*/
+class WideningEventConsumer : public TcspcEventConsumer
+{
+public:
+
+   WideningEventConsumer(std::shared_ptr<WideTcspcEventConsumer> consumer) :
+      consumer(consumer)
+   {}
+
+   void eventStreamAboutToStart() override
+   {
+      widener.reset();
+      consumer->eventStreamAboutToStart();
+   }
+
+   void eventStreamFinished() override { consumer->eventStreamFinished(); }
+   void nextImageStarted() override { consumer->nextImageStarted(); }
+   void imageSequenceFinished() override { consumer->imageSequenceFinished(); }
+   void photonDecimationChanged(int factor) override { consumer->photonDecimationChanged(factor); }
+   bool acceptsDecimation() override { return consumer->acceptsDecimation(); }
+   bool isProcessingEvents() override { return consumer->isProcessingEvents(); }
+
+   void addEvent(const TcspcEvent& evt) override
+   {
+      addEvents(&evt, 1);
+   }
+
+   void addEvents(const TcspcEvent* evts, size_t n) override
+   {
+      if (wide_events.size() < n)
+         wide_events.resize(n);
+
+      size_t n_wide = widener.convert(evts, n, wide_events.data());
+      if (n_wide > 0)
+         consumer->addEvents(wide_events.data(), n_wide);
+   }
+
+private:
+
+   std::shared_ptr<WideTcspcEventConsumer> consumer;
+   TcspcEventWidener widener;
+   std::vector<WideTcspcEvent> wide_events;
+};
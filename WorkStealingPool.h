@@ -0,0 +1,147 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+/*
+   Pool of worker threads, each with its own task queue. Tasks are dealt
+   out round-robin; a worker takes the newest task from its own queue and,
+   once that is empty, steals the oldest from the others. Each queue has
+   its own lock so workers rarely contend. wait() blocks until every
+   submitted task has run.
+*/
+class WorkStealingPool
+{
+public:
+
+   WorkStealingPool(int n_threads = 0)
+   {
+      if (n_threads <= 0)
+         n_threads = std::max(1, (int) std::thread::hardware_concurrency());
+
+      for (int i = 0; i < n_threads; i++)
+         queues.emplace_back(new TaskQueue);
+      for (int i = 0; i < n_threads; i++)
+         threads.push_back(std::thread(&WorkStealingPool::workerThread, this, i));
+   }
+
+   ~WorkStealingPool()
+   {
+      {
+         std::lock_guard<std::mutex> lk(idle_mutex);
+         stopping = true;
+      }
+      idle_cv.notify_all();
+
+      for (auto& t : threads)
+         t.join();
+   }
+
+   int getNumThreads() { return (int) threads.size(); }
+
+   void submit(std::function<void()> task)
+   {
+      // Count the task before it becomes visible to the workers, otherwise
+      // it can be taken and finished first, underflowing queued and letting
+      // wait() return with tasks still running
+      outstanding++;
+      auto& q = *queues[next_queue++ % queues.size()];
+      {
+         std::lock_guard<std::mutex> idle_lk(idle_mutex);
+         queued++;
+
+         std::lock_guard<std::mutex> lk(q.mutex);
+         q.tasks.push_back(std::move(task));
+      }
+      idle_cv.notify_one();
+   }
+
+   void wait()
+   {
+      std::unique_lock<std::mutex> lk(done_mutex);
+      done_cv.wait(lk, [this] { return outstanding == 0; });
+   }
+
+private:
+
+   struct TaskQueue
+   {
+      std::mutex mutex;
+      std::deque<std::function<void()>> tasks;
+   };
+
+   bool takeTask(int idx, std::function<void()>& task)
+   {
+      int n = (int) queues.size();
+      for (int i = 0; i < n; i++)
+      {
+         auto& q = *queues[(idx + i) % n];
+         std::lock_guard<std::mutex> lk(q.mutex);
+         if (q.tasks.empty())
+            continue;
+
+         if (i == 0)
+         {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+         }
+         else
+         {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+         }
+         return true;
+      }
+      return false;
+   }
+
+   void workerThread(int idx)
+   {
+      while (true)
+      {
+         std::function<void()> task;
+         if (takeTask(idx, task))
+         {
+            {
+               std::lock_guard<std::mutex> lk(idle_mutex);
+               queued--;
+            }
+
+            task();
+
+            if (--outstanding == 0)
+            {
+               std::lock_guard<std::mutex> lk(done_mutex);
+               done_cv.notify_all();
+            }
+            continue;
+         }
+
+         std::unique_lock<std::mutex> lk(idle_mutex);
+         idle_cv.wait(lk, [this] { return stopping || queued > 0; });
+         if (stopping && queued == 0)
+            return;
+      }
+   }
+
+   std::vector<std::unique_ptr<TaskQueue>> queues;
+   std::vector<std::thread> threads;
+   std::atomic<size_t> next_queue = { 0 };
+
+   // Tasks in the queues, and tasks submitted but not yet finished
+   size_t queued = 0;
+   std::atomic<size_t> outstanding = { 0 };
+
+   std::mutex idle_mutex;
+   std::condition_variable idle_cv;
+   std::mutex done_mutex;
+   std::condition_variable done_cv;
+   bool stopping = false;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <algorithm>
+
+/*
+   Fixed size pool of worker threads executing queued tasks in FIFO order.
+*/
+class WorkerPool
+{
+public:
+
+   WorkerPool(int n_threads = 0)
+   {
+      if (n_threads <= 0)
+         n_threads = std::max(1, (int) std::thread::hardware_concurrency());
+
+      for (int i = 0; i < n_threads; i++)
+         threads.push_back(std::thread(&WorkerPool::workerThread, this));
+   }
+
+   ~WorkerPool()
+   {
+      {
+         std::lock_guard<std::mutex> lk(task_mutex);
+         stopping = true;
+      }
+      task_cv.notify_all();
+
+      for (auto& t : threads)
+         t.join();
+   }
+
+   int getNumThreads() { return (int) threads.size(); }
+
+   template<class F>
+   auto submit(F fcn) -> std::future<decltype(fcn())>
+   {
+      typedef decltype(fcn()) R;
+      auto task = std::make_shared<std::packaged_task<R()>>(std::move(fcn));
+      std::future<R> result = task->get_future();
+
+      {
+         std::lock_guard<std::mutex> lk(task_mutex);
+         tasks.push_back([task]() { (*task)(); });
+      }
+      task_cv.notify_one();
+
+      return result;
+   }
+
+private:
+
+   void workerThread()
+   {
+      while (true)
+      {
+         std::function<void()> task;
+         {
+            std::unique_lock<std::mutex> lk(task_mutex);
+            task_cv.wait(lk, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+               return;
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+         }
+         task();
+      }
+   }
+
+   std::vector<std::thread> threads;
+   std::deque<std::function<void()>> tasks;
+   std::mutex task_mutex;
+   std::condition_variable task_cv;
+   bool stopping = false;
+};
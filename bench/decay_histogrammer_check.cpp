@@ -0,0 +1,188 @@
+#include "DecayHistogrammer.h"
+
+#include <random>
+#include <algorithm>
+#include <cstdio>
+
+/*
+   Checks that DecayHistogrammer gives the same cubes when binning lines on
+   its work stealing pool as when binning them serially.
+
+   A synthetic scan of frames, lines, pixel markers, rollovers and photons
+   is fed in chunks of random size to a serial histogrammer and to ones
+   with several pool sizes, in each accumulation mode, with time based and
+   pixel marker based x. Every published cube must match exactly.
+
+   Usage: decay-histogrammer-check
+   Returns non-zero if any cube differs.
+*/
+
+struct PublishedCube
+{
+   std::vector<uint32_t> counts;
+   uint64_t first_frame;
+   uint64_t n_frames;
+
+   bool operator==(const PublishedCube& other) const
+   {
+      return counts == other.counts && first_frame == other.first_frame && n_frames == other.n_frames;
+   }
+};
+
+static const int n_x = 32;
+static const int n_y = 24;
+static const int n_frames = 9;
+
+static void addMacroTime(std::vector<TcspcEvent>& evts, uint64_t& last_rollover, uint64_t t)
+{
+   uint64_t rollover = t >> 16;
+   if (rollover > last_rollover)
+   {
+      TcspcEvent evt;
+      evt.macro_time = (uint16_t) (rollover - last_rollover);
+      evt.micro_time = 0xF;
+      evts.push_back(evt);
+      last_rollover = rollover;
+   }
+}
+
+static void addMarker(std::vector<TcspcEvent>& evts, uint64_t& last_rollover, uint64_t t, int mark)
+{
+   addMacroTime(evts, last_rollover, t);
+   TcspcEvent evt;
+   evt.macro_time = (uint16_t) t;
+   evt.micro_time = 0xF;
+   evt.addMark((TcspcEvent::Mark) mark);
+   evts.push_back(evt);
+}
+
+static std::vector<TcspcEvent> makeScan()
+{
+   std::mt19937 rng(4321);
+   std::uniform_int_distribution<int> channel(0, 2); // channel 2 is outside the cube
+   std::uniform_int_distribution<int> micro(0, 255);
+   std::uniform_int_distribution<int> photons_per_pixel(0, 6);
+   std::uniform_int_distribution<int> pixel_time(0, 499);
+
+   const uint64_t pixel_duration = 500;
+   const uint64_t line_gap = 3000;
+
+   std::vector<TcspcEvent> evts;
+   uint64_t last_rollover = 0;
+   uint64_t t = 1000;
+
+   for (int f = 0; f < n_frames; f++)
+   {
+      // End an image part way through so that a cube is finished early
+      int mark = TcspcEvent::FrameMarker;
+      if (f == 5)
+         mark |= TcspcEvent::ImageMarker;
+      addMarker(evts, last_rollover, t, mark);
+
+      for (int y = 0; y < n_y; y++)
+      {
+         t += line_gap;
+         addMarker(evts, last_rollover, t, TcspcEvent::LineStartMarker);
+
+         for (int x = 0; x < n_x; x++)
+         {
+            std::vector<uint64_t> times(photons_per_pixel(rng));
+            for (auto& pt : times)
+               pt = t + pixel_time(rng);
+            std::sort(times.begin(), times.end());
+
+            for (uint64_t pt : times)
+            {
+               addMacroTime(evts, last_rollover, pt);
+               TcspcEvent evt;
+               evt.macro_time = (uint16_t) pt;
+               evt.micro_time = (uint16_t) ((micro(rng) << 4) | channel(rng));
+               evts.push_back(evt);
+            }
+
+            t += pixel_duration;
+            addMarker(evts, last_rollover, t, TcspcEvent::PixelMarker);
+         }
+
+         addMarker(evts, last_rollover, t, TcspcEvent::LineEndMarker);
+      }
+   }
+
+   t += line_gap;
+   addMarker(evts, last_rollover, t, TcspcEvent::FrameMarker);
+   return evts;
+}
+
+static std::vector<PublishedCube> histogram(const std::vector<TcspcEvent>& evts, DecayHistogrammer::AccumulationMode mode,
+   bool pixel_markers, bool bidirectional, int n_threads)
+{
+   TcspcAcquisitionParameters params;
+   params.time_resolution_ps = 50;
+   params.macro_resolution_ps = 12500;
+   params.n_timebins = 256;
+   params.n_channels = 2;
+
+   std::vector<PublishedCube> cubes;
+
+   DecayHistogrammer histogrammer(params, n_x, n_y);
+   histogrammer.setBinShift(1);
+   histogrammer.setUsingPixelMarkers(pixel_markers);
+   histogrammer.setBidirectional(bidirectional);
+   histogrammer.setAccumulationMode(mode);
+   histogrammer.setFrameAccumulation(3);
+   histogrammer.setNumThreads(n_threads);
+   histogrammer.setCubeReadyCallback([&](std::shared_ptr<const DecayCube> cube) {
+      cubes.push_back({ cube->counts, cube->first_frame, cube->n_frames });
+   });
+
+   // Chunks cut lines at arbitrary points, as packet buffers do
+   std::mt19937 rng(1234);
+   std::uniform_int_distribution<size_t> chunk(1, 4000);
+
+   histogrammer.eventStreamAboutToStart();
+   for (size_t begin = 0; begin < evts.size(); )
+   {
+      size_t n = std::min(chunk(rng), evts.size() - begin);
+      histogrammer.addEventView(TcspcEventView::copyOf(evts.data() + begin, n));
+      begin += n;
+   }
+   histogrammer.imageSequenceFinished();
+   histogrammer.eventStreamFinished();
+
+   return cubes;
+}
+
+int main()
+{
+   auto evts = makeScan();
+
+   const char* mode_names[] = { "block", "sliding", "exponential" };
+   DecayHistogrammer::AccumulationMode modes[] = {
+      DecayHistogrammer::BlockAccumulation,
+      DecayHistogrammer::SlidingAccumulation,
+      DecayHistogrammer::ExponentialAccumulation
+   };
+
+   int n_failed = 0;
+   for (int m = 0; m < 3; m++)
+      for (bool pixel_markers : { false, true })
+         for (bool bidirectional : { false, true })
+         {
+            auto serial = histogram(evts, modes[m], pixel_markers, bidirectional, 0);
+
+            for (int n_threads : { 1, 2, 4, 8 })
+            {
+               auto parallel = histogram(evts, modes[m], pixel_markers, bidirectional, n_threads);
+               bool match = !serial.empty() && parallel == serial;
+               n_failed += !match;
+
+               printf("%-12s %-14s %-14s threads=%d cubes=%zu: %s\n", mode_names[m],
+                  pixel_markers ? "pixel-markers" : "time-based",
+                  bidirectional ? "bidirectional" : "unidirectional",
+                  n_threads, serial.size(), match ? "ok" : "MISMATCH");
+            }
+         }
+
+   printf("%s\n", n_failed ? "FAILED" : "PASSED");
+   return n_failed ? 1 : 0;
+}
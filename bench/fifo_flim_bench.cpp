@@ -0,0 +1,501 @@
+#include "SimTcspc.h"
+#include "ReplayTcspc.h"
+#include "FlimFileWriter.h"
+#include "LZ4ThreadedStream.h"
+#include "LiveFlimReader.h"
+#include "DecayHistogrammer.h"
+#include "LifetimeImager.h"
+#include "EventProcessor.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QTemporaryDir>
+#include <QDir>
+#include <QFile>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+
+/*
+   End-to-end throughput of the acquisition pipeline.
+
+   Events come from SimTcspc, generating as fast as it can, or from an FFD
+   recording replayed by ReplayTcspc, by default as fast as it can be
+   read. They pass through the
+   PacketBuffer and EventProcessor to the consumers of a live acquisition:
+   FlimFileWriter recording to a temporary file, LZ4ThreadedStream
+   compressing every event, LiveFlimReader with its event queue drained as
+   the display would, DecayHistogrammer, LifetimeImager and a counting
+   probe.
+
+   For every packet buffer the processor reports when readPackets returned
+   and when the consumers were called and returned, giving the queueing
+   and dispatch latency, together with the buffer fill factor seen by
+   readPackets. Results are written as JSON to stdout or --output.
+
+   Usage: fifo-flim-bench [options], see --help
+*/
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(Clock::time_point start, Clock::time_point end)
+{
+   return std::chrono::duration<double>(end - start).count();
+}
+
+/*
+   LiveFlimReader with its event queue drained on a separate thread, standing
+   in for the display which would otherwise read the events. Packet buffer
+   slots stay pinned until the drain thread reaches them
+*/
+class DrainedLiveFlimReader : public LiveFlimReader
+{
+public:
+
+   DrainedLiveFlimReader(const TcspcAcquisitionParameters& params) :
+      LiveFlimReader(params)
+   {}
+
+   ~DrainedLiveFlimReader()
+   {
+      if (drain_thread.joinable())
+         drain_thread.join();
+   }
+
+   void eventStreamAboutToStart()
+   {
+      LiveFlimReader::eventStreamAboutToStart();
+
+      drain_thread = std::thread([this]()
+      {
+         while (live_event_reader->hasMoreData())
+         {
+            auto evt = live_event_reader->getRawEvent();
+            if (std::get<0>(evt).valid)
+               n_drained++;
+         }
+      });
+   }
+
+   void eventStreamFinished()
+   {
+      LiveFlimReader::eventStreamFinished();
+      drain_thread.join();
+   }
+
+   uint64_t eventsDrained() { return n_drained; }
+
+protected:
+
+   std::thread drain_thread;
+   std::atomic<uint64_t> n_drained = { 0 };
+};
+
+class CountingDevice : public QIODevice
+{
+public:
+   CountingDevice() { open(QIODevice::WriteOnly); }
+
+   qint64 bytesWritten() { return bytes_written; }
+
+protected:
+   qint64 readData(char*, qint64) override { return -1; }
+   qint64 writeData(const char*, qint64 len) override { bytes_written += len; return len; }
+
+   std::atomic<qint64> bytes_written = { 0 };
+};
+
+/*
+   Compresses the event stream through LZ4ThreadedStream, discarding the
+   output. FlimFileWriter records through LZ4BlockStream, so this keeps the
+   chained stream in the pipeline being measured
+*/
+class LZ4StreamConsumer : public TcspcEventConsumer
+{
+public:
+
+   void eventStreamAboutToStart() { stream.reset(new LZ4ThreadedStream(&device)); }
+   void eventStreamFinished() { stream->close(); }
+
+   void addEvent(const TcspcEvent& evt) { addEvents(&evt, 1); }
+   void addEvents(const TcspcEvent* evts, size_t n)
+   {
+      stream->write(reinterpret_cast<const char*>(evts), n * sizeof(TcspcEvent));
+      bytes_in += n * sizeof(TcspcEvent);
+   }
+
+   uint64_t bytesIn() { return bytes_in; }
+   qint64 bytesOut() { return device.bytesWritten(); }
+
+protected:
+
+   CountingDevice device;
+   std::unique_ptr<LZ4ThreadedStream> stream;
+   std::atomic<uint64_t> bytes_in = { 0 };
+};
+
+class CountingConsumer : public TcspcEventConsumer
+{
+public:
+
+   void addEvent(const TcspcEvent& evt) { n_events++; }
+   void addEvents(const TcspcEvent* evts, size_t n) { n_events += n; }
+   void nextImageStarted() { n_images++; }
+
+   std::atomic<uint64_t> n_events = { 0 };
+   std::atomic<uint64_t> n_images = { 0 };
+};
+
+class TimingRecorder
+{
+public:
+
+   struct Sample
+   {
+      double queue_us;
+      double dispatch_us;
+      double fill_factor;
+      size_t n_events;
+   };
+
+   void add(const EventBufferTiming& t)
+   {
+      Sample s{ seconds(t.read_time, t.dispatch_start) * 1e6, seconds(t.read_time, t.dispatch_end) * 1e6, t.fill_factor, t.n_events };
+
+      std::lock_guard<std::mutex> lk(mutex);
+      if (t.cursor >= (int) samples.size())
+         samples.resize(t.cursor + 1);
+      samples[t.cursor].push_back(s);
+   }
+
+   const std::vector<Sample>& getSamples(int cursor)
+   {
+      std::lock_guard<std::mutex> lk(mutex);
+      if (cursor >= (int) samples.size())
+         samples.resize(cursor + 1);
+      return samples[cursor];
+   }
+
+   // mean, p50/p90/p99 and max of a field over the samples of a cursor
+   static QJsonObject distribution(const std::vector<Sample>& samples, double Sample::* field)
+   {
+      std::vector<double> v;
+      v.reserve(samples.size());
+      for (auto& s : samples)
+         v.push_back(s.*field);
+
+      QJsonObject obj;
+      if (v.empty())
+         return obj;
+
+      std::sort(v.begin(), v.end());
+      auto quantile = [&](double q) { return v[std::min(v.size() - 1, (size_t) (q * v.size()))]; };
+
+      double sum = 0;
+      for (double x : v)
+         sum += x;
+
+      obj["mean"] = sum / v.size();
+      obj["p50"] = quantile(0.5);
+      obj["p90"] = quantile(0.9);
+      obj["p99"] = quantile(0.99);
+      obj["max"] = v.back();
+      return obj;
+   }
+
+private:
+
+   std::mutex mutex;
+   std::vector<std::vector<Sample>> samples;
+};
+
+static FlimCompression parseCompression(const QString& name)
+{
+   if (name == "none")
+      return NoCompression;
+   if (name == "lz4")
+      return LZ4BlockCompression;
+   if (name == "zstd")
+      return ZstdBlockCompression;
+   if (name == "tcspc")
+      return TcspcBlockCompression;
+   throw std::runtime_error("Unknown compression: " + name.toStdString());
+}
+
+int main(int argc, char* argv[])
+{
+   QCoreApplication app(argc, argv);
+
+   QCommandLineParser parser;
+   parser.setApplicationDescription("End-to-end throughput of the FIFO FLIM acquisition pipeline");
+   parser.addHelpOption();
+   parser.addOptions({
+      { "source", "Event source: 'sim' or an .ffd recording", "source", "sim" },
+      { "replay-rate", "Replay speed relative to the recording, 0 for as fast as possible", "rate", "0" },
+      { "duration", "Maximum run time in seconds", "seconds", "10" },
+      { "threads", "SimTcspc generator threads, 0 to generate on the reader thread", "n", QString::number(std::thread::hardware_concurrency()) },
+      { "seed", "SimTcspc seed", "seed", "0" },
+      { "scenario", "SimTcspc scenario file", "file" },
+      { "consumers", "Comma separated consumers to attach: writer, lz4-stream, live, histogram, lifetime", "list", "writer,lz4-stream,live" },
+      { "image-size", "Image size in pixels for the histogram and lifetime consumers", "n", "128" },
+      { "histogram-threads", "Threads binning lines for the histogram consumer, 0 to bin on its own thread", "n", "0" },
+      { "compression", "Recording compression: none, lz4, zstd or tcspc", "codec", "none" },
+      { "compression-threads", "Recording compression threads, 0 for automatic", "n", "0" },
+      { "broadcast", "Feed each consumer from its own thread" },
+      { "output", "Write JSON results to a file rather than stdout", "file" },
+   });
+   parser.process(app);
+
+   QJsonObject results;
+   QJsonObject config;
+   bool ok = false;
+
+   try
+   {
+      QString source_name = parser.value("source");
+      double duration = parser.value("duration").toDouble();
+      QStringList consumer_names = parser.value("consumers").split(",", QString::SkipEmptyParts);
+      bool broadcast = parser.isSet("broadcast");
+
+      std::unique_ptr<FifoTcspc> tcspc;
+      ReplayTcspc* replay = nullptr;
+
+      if (source_name == "sim")
+      {
+         auto sim = new SimTcspc(nullptr);
+         sim->setParameter("GeneratorThreads", ParameterType(), parser.value("threads").toInt());
+         sim->setParameter("Seed", ParameterType(), parser.value("seed").toULongLong());
+         if (parser.isSet("scenario"))
+            sim->setParameter("Scenario", ParameterType(), parser.value("scenario"));
+         tcspc.reset(sim);
+
+         config["threads"] = parser.value("threads").toInt();
+         config["seed"] = parser.value("seed");
+         config["scenario"] = parser.value("scenario");
+      }
+      else
+      {
+         // Check the file here, ReplayTcspc only logs errors
+         FlimFileReader check(source_name, false);
+
+         replay = new ReplayTcspc(nullptr, source_name);
+         replay->setParameter("ReplayRate", ParameterType(), parser.value("replay-rate").toDouble());
+         tcspc.reset(replay);
+
+         config["replay_rate"] = parser.value("replay-rate").toDouble();
+      }
+
+      config["source"] = source_name;
+      config["duration_s"] = duration;
+      config["consumers"] = QJsonArray::fromStringList(consumer_names);
+      config["broadcast"] = broadcast;
+
+      // The probe is added first so that in broadcast mode it is on cursor 1
+      auto probe = std::make_shared<CountingConsumer>();
+      tcspc->addTcspcEventConsumer(probe);
+
+      QTemporaryDir record_dir;
+      std::shared_ptr<FlimFileWriter> writer;
+      if (consumer_names.contains("writer"))
+      {
+         FlimCompression compression = parseCompression(parser.value("compression"));
+         writer = std::make_shared<FlimFileWriter>();
+         writer->setFifoTcspc(tcspc.get());
+         writer->setCompression(compression, 0, parser.value("compression-threads").toInt());
+         writer->startRecording(record_dir.filePath("bench.ffd"));
+         tcspc->addTcspcEventConsumer(writer);
+
+         config["compression"] = FlimFileWriter::compressionTag(compression);
+      }
+
+      std::shared_ptr<LZ4StreamConsumer> lz4_stream;
+      if (consumer_names.contains("lz4-stream"))
+      {
+         lz4_stream = std::make_shared<LZ4StreamConsumer>();
+         tcspc->addTcspcEventConsumer(lz4_stream);
+      }
+
+      std::shared_ptr<DrainedLiveFlimReader> live_reader;
+      if (consumer_names.contains("live"))
+      {
+         live_reader = std::make_shared<DrainedLiveFlimReader>(tcspc->getAcquisitionParameters());
+         tcspc->addTcspcEventConsumer(live_reader);
+      }
+
+      std::shared_ptr<DecayHistogrammer> histogrammer;
+      std::atomic<uint64_t> n_cubes(0);
+      if (consumer_names.contains("histogram"))
+      {
+         int image_size = parser.value("image-size").toInt();
+         histogrammer = std::make_shared<DecayHistogrammer>(tcspc->getAcquisitionParameters(), image_size, image_size);
+         histogrammer->setUsingPixelMarkers(tcspc->usingPixelMarkers());
+         histogrammer->setNumThreads(parser.value("histogram-threads").toInt());
+         histogrammer->setCubeReadyCallback([&](std::shared_ptr<const DecayCube>) { n_cubes++; });
+         tcspc->addTcspcEventConsumer(histogrammer);
+
+         config["image_size"] = image_size;
+         config["histogram_threads"] = parser.value("histogram-threads").toInt();
+      }
+
+      std::shared_ptr<LifetimeImager> lifetime_imager;
+      std::atomic<uint64_t> n_lifetime_images(0);
+      if (consumer_names.contains("lifetime"))
+      {
+         int image_size = parser.value("image-size").toInt();
+         lifetime_imager = std::make_shared<LifetimeImager>(tcspc->getAcquisitionParameters(), image_size, image_size);
+         lifetime_imager->setUsingPixelMarkers(tcspc->usingPixelMarkers());
+         lifetime_imager->setImageReadyCallback([&](std::shared_ptr<const LifetimeImage>) { n_lifetime_images++; });
+         tcspc->addTcspcEventConsumer(lifetime_imager);
+
+         config["image_size"] = image_size;
+      }
+
+      TimingRecorder recorder;
+      tcspc->setBufferTimingCallback([&](const EventBufferTiming& t) { recorder.add(t); });
+      tcspc->setConsumerBroadcastMode(broadcast);
+
+      // Decimated photons would inflate the throughput
+      tcspc->setLiveLoadShedding(false);
+
+      auto start = Clock::now();
+      tcspc->setLive(true);
+
+      // A replayed recording ends early once every event has been read; the
+      // remaining buffers are dispatched when the FIFO is stopped
+      while (seconds(start, Clock::now()) < duration)
+      {
+         if (replay && replay->isFinished())
+            break;
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+
+      tcspc->setLive(false);
+      double elapsed = seconds(start, Clock::now());
+
+      if (writer)
+         writer->stopRecording();
+
+      auto& samples = recorder.getSamples(broadcast ? 1 : 0);
+
+      results["elapsed_s"] = elapsed;
+      results["events"] = (double) probe->n_events;
+      results["events_per_s"] = probe->n_events / elapsed;
+      results["images"] = (double) probe->n_images;
+      results["buffers"] = (double) samples.size();
+      results["fill_factor"] = TimingRecorder::distribution(samples, &TimingRecorder::Sample::fill_factor);
+
+      FlimStatus status = tcspc->getStatus();
+      results["decimated_photons"] = (double) status.counters["Decimated Photons"];
+      results["photon_decimation"] = (double) status.counters["Photon Decimation"];
+
+      // Latency per dispatching thread: the processor thread, or each
+      // consumer in broadcast mode, in the order they were added
+      QStringList thread_names = { "probe" };
+      if (writer)
+         thread_names.append("writer");
+      if (lz4_stream)
+         thread_names.append("lz4-stream");
+      if (live_reader)
+         thread_names.append("live");
+      if (histogrammer)
+         thread_names.append("histogram");
+      if (lifetime_imager)
+         thread_names.append("lifetime");
+      if (!broadcast)
+         thread_names = QStringList({ "processor" });
+
+      QJsonArray latency;
+      for (int i = 0; i < thread_names.size(); i++)
+      {
+         auto& s = recorder.getSamples(broadcast ? i + 1 : 0);
+         QJsonObject obj;
+         obj["thread"] = thread_names[i];
+         obj["queue_us"] = TimingRecorder::distribution(s, &TimingRecorder::Sample::queue_us);
+         obj["dispatch_us"] = TimingRecorder::distribution(s, &TimingRecorder::Sample::dispatch_us);
+         latency.append(obj);
+      }
+      results["latency"] = latency;
+
+      if (writer)
+      {
+         qint64 bytes = 0;
+         for (auto& f : QDir(record_dir.path()).entryInfoList({ "*.ffd" }, QDir::Files))
+            bytes += f.size();
+
+         QJsonObject obj;
+         obj["bytes_written"] = (double) bytes;
+         obj["bytes_per_event"] = probe->n_events ? (double) bytes / probe->n_events : 0.0;
+         obj["MB_per_s"] = bytes / elapsed / 1e6;
+         results["writer"] = obj;
+      }
+
+      if (lz4_stream)
+      {
+         QJsonObject obj;
+         obj["bytes_in"] = (double) lz4_stream->bytesIn();
+         obj["bytes_out"] = (double) lz4_stream->bytesOut();
+         obj["compression_ratio"] = lz4_stream->bytesIn() ? (double) lz4_stream->bytesOut() / lz4_stream->bytesIn() : 0.0;
+         obj["MB_per_s"] = lz4_stream->bytesIn() / elapsed / 1e6;
+         results["lz4_stream"] = obj;
+      }
+
+      if (live_reader)
+      {
+         QJsonObject obj;
+         obj["events_drained"] = (double) live_reader->eventsDrained();
+         results["live"] = obj;
+      }
+
+      if (histogrammer)
+      {
+         QJsonObject obj;
+         obj["cubes"] = (double) n_cubes;
+         results["histogram"] = obj;
+      }
+
+      if (lifetime_imager)
+      {
+         QJsonObject obj;
+         obj["images"] = (double) n_lifetime_images;
+         results["lifetime"] = obj;
+      }
+
+      ok = true;
+   }
+   catch (const std::exception& e)
+   {
+      results["error"] = e.what();
+   }
+
+   results["status"] = ok ? "ok" : "error";
+
+   QJsonObject output;
+   output["benchmark"] = "fifo-flim-bench";
+   output["config"] = config;
+   output["results"] = results;
+
+   QByteArray json = QJsonDocument(output).toJson();
+
+   if (parser.isSet("output"))
+   {
+      QFile file(parser.value("output"));
+      if (!file.open(QIODevice::WriteOnly))
+      {
+         fprintf(stderr, "Could not open %s\n", qPrintable(parser.value("output")));
+         return 1;
+      }
+      file.write(json);
+   }
+   else
+   {
+      fwrite(json.constData(), 1, json.size(), stdout);
+   }
+
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+#include "LZ4Stream.h"
+#include "LZ4ThreadedStream.h"
+#include "LZ4BlockStream.h"
+#include "TcspcEvent.h"
+
+#include <QIODevice>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+
+/*
+   Throughput of the LZ4 recording streams on synthetic TCSPC data.
+
+   Input is pushed through write() in chunks of various sizes, as it
+   arrives from FlimFileWriter, and the output is discarded so that only
+   the stream itself is measured. For LZ4ThreadedStream the time spent in
+   write() is reported separately from the end-to-end compression time.
+
+   Usage: lz4-stream-bench [MB of input]
+*/
+
+class NullDevice : public QIODevice
+{
+public:
+   NullDevice() { open(QIODevice::WriteOnly); }
+
+protected:
+   qint64 readData(char*, qint64) override { return -1; }
+   qint64 writeData(const char*, qint64 len) override { bytes_written += len; return len; }
+
+   qint64 bytes_written = 0;
+};
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double seconds(Clock::time_point start, Clock::time_point end)
+{
+   return std::chrono::duration<double>(end - start).count();
+}
+
+static std::vector<char> makeEvents(size_t n_bytes)
+{
+   std::mt19937 rng(1234);
+   std::exponential_distribution<double> arrival(1.0 / 40.0);
+   std::uniform_int_distribution<int> micro(0, 4095);
+
+   std::vector<TcspcEvent> evts(n_bytes / sizeof(TcspcEvent));
+   double macro_time = 0;
+   for (auto& e : evts)
+   {
+      macro_time += arrival(rng);
+      e.macro_time = (uint16_t) macro_time;
+      e.micro_time = (uint16_t) (micro(rng) << 4);
+   }
+
+   std::vector<char> data(evts.size() * sizeof(TcspcEvent));
+   memcpy(data.data(), evts.data(), data.size());
+   return data;
+}
+
+template<class Stream>
+static void writeChunked(Stream& stream, const std::vector<char>& data, size_t chunk)
+{
+   for (size_t pos = 0; pos < data.size(); pos += chunk)
+      stream.write(data.data() + pos, std::min(chunk, data.size() - pos));
+}
+
+int main(int argc, char* argv[])
+{
+   size_t n_mb = (argc > 1) ? atoi(argv[1]) : 12;
+   std::vector<char> data = makeEvents(n_mb * 1024 * 1024);
+   double gb = data.size() / 1e9;
+
+   const size_t chunks[] = { 64, 4096, 65536 };
+
+   printf("%-20s %10s %14s %14s\n", "stream", "chunk", "write GB/s", "total GB/s");
+
+   for (size_t chunk : chunks)
+   {
+      NullDevice device;
+      LZ4Stream stream(&device);
+
+      auto start = Clock::now();
+      writeChunked(stream, data, chunk);
+      double t = seconds(start, Clock::now());
+
+      printf("%-20s %10zu %14.3f %14.3f\n", "LZ4Stream", chunk, gb / t, gb / t);
+   }
+
+   // The threaded stream drops data if its 16 MB ring overflows,
+   // so keep the input within the ring
+   std::vector<char> threaded_data(data.begin(), data.begin() + std::min(data.size(), (size_t) 15 * 1024 * 1024));
+   double threaded_gb = threaded_data.size() / 1e9;
+
+   for (size_t chunk : chunks)
+   {
+      NullDevice device;
+      LZ4ThreadedStream stream(&device);
+
+      auto start = Clock::now();
+      writeChunked(stream, threaded_data, chunk);
+      auto written = Clock::now();
+      stream.close();
+      auto end = Clock::now();
+
+      printf("%-20s %10zu %14.3f %14.3f\n", "LZ4ThreadedStream", chunk, threaded_gb / seconds(start, written), threaded_gb / seconds(start, end));
+   }
+
+   const LZ4BlockStream::Codec codecs[] = { LZ4BlockStream::CodecLZ4, LZ4BlockStream::CodecTcspc };
+
+   for (auto codec : codecs)
+   {
+      const char* name = (codec == LZ4BlockStream::CodecTcspc) ? "LZ4BlockStream/tcspc" : "LZ4BlockStream/lz4";
+
+      for (size_t chunk : chunks)
+      {
+         NullDevice device;
+         LZ4BlockStream stream(&device);
+         stream.setCodec(codec);
+
+         auto start = Clock::now();
+         writeChunked(stream, data, chunk);
+         auto written = Clock::now();
+         stream.close();
+         auto end = Clock::now();
+
+         printf("%-20s %10zu %14.3f %14.3f   ratio %.2f\n", name, chunk, gb / seconds(start, written), gb / seconds(start, end),
+            (double) stream.getTotalIn() / stream.getTotalOut());
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,30 @@
+# Try to find the zstd compression library
+# Once done this will define
+#  Zstd_FOUND - if system found zstd library
+#  Zstd_INCLUDE_DIRS - The zstd include directories
+#  Zstd_LIBRARIES - The libraries needed to use zstd
+#  Zstd_DEFINITIONS - Compiler switches required for using zstd
+
+find_path(Zstd_INCLUDE_DIR
+    NAMES zstd.h
+    DOC "The zstd include directory"
+)
+
+find_library(Zstd_LIBRARY 
+    NAMES zstd zstd_static libzstd
+    DOC "The zstd library"
+)
+
+include(FindPackageHandleStandardArgs)
+# handle the QUIETLY and REQUIRED arguments and set Zstd_FOUND to TRUE
+# if all listed variables are TRUE
+find_package_handle_standard_args(Zstd DEFAULT_MSG Zstd_INCLUDE_DIR Zstd_LIBRARY)
+
+if (Zstd_FOUND)
+    set(Zstd_LIBRARIES ${Zstd_LIBRARY})
+    set(Zstd_INCLUDE_DIRS ${Zstd_INCLUDE_DIR})
+    set(Zstd_DEFINITIONS "-DUSE_ZSTD")
+endif()
+
+# Tell cmake GUIs to ignore the "local" variables.
+mark_as_advanced(Zstd_INCLUDE_DIR Zstd_LIBRARY)
@@ -1,9 +1,5 @@
 #include "Cronologic.h"
 
-#include <QMessageBox>
-#include <QStandardPaths>
-#include <QFileDialog>
-#include <QInputDialog>
 #include <chrono>
 #include <cassert>
 #include <algorithm>
@@ -20,20 +16,20 @@ void CHECK(int err)
    }
 }
 
-Cronologic::Cronologic(QObject* parent) :
-   FifoTcspc(FlimStatus({ "SYNC" }, {"Sync Rate", "FIFO Buffer", "Host Buffer"}), parent)
+Cronologic::Cronologic(QObject* parent, AcquisitionMode acq_mode) :
+   FifoTcspc(FlimStatus({ "SYNC" }, {"Sync Rate", "FIFO Buffer", "Host Buffer"}), parent),
+   acq_mode(acq_mode)
 {
-   QString mode = QInputDialog::getItem(nullptr, "Choose Imaging Mode", "Imaging Mode", { "FLIM", "PLIM" }, 0, false);
-
-   if (mode == "PLIM")
-      acq_mode = PLIM;
-   else
-      acq_mode = FLIM;
-
    if (acq_mode == PLIM)
       modulator = new PLIMLaserModulator(this);
 
-   processor = createEventProcessor<Cronologic>(this, 10000, 10000);
+   // Buffers are sized to the count rate, using no more memory than 10000 x 10000 fixed buffers did
+   processor = createEventProcessor<Cronologic>(this, 1, 1000);
+
+   AdaptiveBufferSizing sizing;
+   sizing.max_bytes = (size_t) 10000 * 10000 * sizeof(TcspcEvent);
+   sizing.max_buffers = 10000;
+   processor->setAdaptiveBufferSizing(sizing);
 
    threshold = { -60.0, -60.0, -60.0 };
    time_shift = { 0, 0, 0 };
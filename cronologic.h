@@ -19,10 +19,11 @@ class Cronologic : public FifoTcspc
 {
 	Q_OBJECT
 
+public:
+
    enum AcquisitionMode { FLIM, PLIM } ;
 
-public:
-   Cronologic(QObject* parent);
+   Cronologic(QObject* parent, AcquisitionMode acq_mode = FLIM);
    ~Cronologic();
 
 	void init();